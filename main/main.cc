@@ -1,10 +1,35 @@
 #include <iostream>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+#include <map>
 #include <memory>
 #include <algorithm>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define DB_SIMD_X86 1
+#include <immintrin.h>
+#endif
 
 using std::vector;
 using std::cout;
@@ -14,63 +39,355 @@ using std::unordered_map;
 using std::unique_ptr;
 
 extern "C" {
+  #include <stdio.h>
   #include "thirdparty/csv_parser/csv.h"
 }
 
+// TIMESTAMP values are seconds since the Unix epoch, stored like INT64
+enum class ColumnType { STRING, INT64, DOUBLE, TIMESTAMP };
+
+static bool is_integer_type(ColumnType type) {
+  return type == ColumnType::INT64 || type == ColumnType::TIMESTAMP;
+}
+
+static std::string_view trim_spaces(std::string_view text) {
+  while (!text.empty() && text.front() == ' ') {
+    text.remove_prefix(1);
+  }
+  while (!text.empty() && text.back() == ' ') {
+    text.remove_suffix(1);
+  }
+  return text;
+}
+
+// The parse_* helpers accept only text that is entirely a value of the type
+
+static bool parse_int64(std::string_view text, int64_t& out) {
+  text = trim_spaces(text);
+  if (!text.empty() && text.front() == '+') {
+    text.remove_prefix(1);
+  }
+  auto result = std::from_chars(text.data(), text.data() + text.size(), out);
+  return !text.empty() && result.ec == std::errc() && result.ptr == text.data() + text.size();
+}
+
+static bool parse_double(std::string_view text, double& out) {
+  text = trim_spaces(text);
+  if (!text.empty() && text.front() == '+') {
+    text.remove_prefix(1);
+  }
+  auto result = std::from_chars(text.data(), text.data() + text.size(), out);
+  return !text.empty() && result.ec == std::errc() && result.ptr == text.data() + text.size();
+}
+
+// Reads a STRING field summed or averaged as a number. Empty fields are
+// missing values and return false, other text that is not a number throws.
+static bool parse_numeric_field(std::string_view text, const string& column, double& out) {
+  if (trim_spaces(text).empty()) {
+    return false;
+  }
+  if (!parse_double(text, out)) {
+    throw std::runtime_error("Not a number in column " + column + ": " + string(text));
+  }
+  return true;
+}
+
+// Days since 1970-01-01 for a proleptic Gregorian date
+static int64_t days_from_civil(int64_t year, int64_t month, int64_t day) {
+  year -= month <= 2;
+  int64_t era = (year >= 0 ? year : year - 399) / 400;
+  int64_t year_of_era = year - era * 400;
+  int64_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+  return era * 146097 + day_of_era - 719468;
+}
+
+/**
+ * Accepts either Unix epoch seconds or "YYYY-MM-DD[ HH:MM:SS]" (a 'T' may
+ * separate date and time), read as UTC.
+ */
+static bool parse_timestamp(std::string_view text, int64_t& out) {
+  text = trim_spaces(text);
+  if (parse_int64(text, out)) {
+    return true;
+  }
+  int fields[6] = {0, 0, 0, 0, 0, 0};
+  const size_t widths[6] = {4, 2, 2, 2, 2, 2};
+  const char separators[6] = {'-', '-', ' ', ':', ':', '\0'};
+  size_t pos = 0;
+  for (int i = 0; i < 6; i++) {
+    if (i == 3 && pos >= text.size()) {
+      break; // date only
+    }
+    if (pos + widths[i] > text.size()) {
+      return false;
+    }
+    auto result = std::from_chars(text.data() + pos, text.data() + pos + widths[i], fields[i]);
+    if (result.ec != std::errc() || result.ptr != text.data() + pos + widths[i]) {
+      return false;
+    }
+    pos += widths[i];
+    if (i < 5 && pos < text.size()) {
+      char sep = text[pos];
+      if (sep != separators[i] && !(i == 2 && sep == 'T')) {
+        return false;
+      }
+      pos++;
+    }
+  }
+  if (pos != text.size() || fields[1] < 1 || fields[1] > 12 || fields[2] < 1 || fields[2] > 31) {
+    return false;
+  }
+  out = days_from_civil(fields[0], fields[1], fields[2]) * 86400 + fields[3] * 3600 + fields[4] * 60 + fields[5];
+  return true;
+}
+
+static string format_timestamp(int64_t seconds) {
+  int64_t days = seconds >= 0 ? seconds / 86400 : (seconds - 86399) / 86400;
+  int64_t secs = seconds - days * 86400;
+  // Inverse of days_from_civil
+  days += 719468;
+  int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  int64_t day_of_era = days - era * 146097;
+  int64_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+  int64_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+  int64_t mp = (5 * day_of_year + 2) / 153;
+  int64_t day = day_of_year - (153 * mp + 2) / 5 + 1;
+  int64_t month = mp < 10 ? mp + 3 : mp - 9;
+  int64_t year = year_of_era + era * 400 + (month <= 2);
+
+  char buf[128];
+  snprintf(buf, sizeof(buf), "%04lld-%02lld-%02lld %02lld:%02lld:%02lld", (long long) year, (long long) month,
+      (long long) day, (long long) (secs / 3600), (long long) (secs / 60 % 60), (long long) (secs % 60));
+  return string(buf);
+}
+
+/**
+ * A single typed field. Numbers are kept in the union, strings in str_val.
+ */
+class Value {
+  public:
+    Value() {}
+    Value(string str) : str_val(std::move(str)) {}
+    Value(const char* str) : str_val(str) {}
+
+    static Value make_int(int64_t val) {
+      Value v;
+      v.type = ColumnType::INT64;
+      v.int_val = val;
+      return v;
+    }
+
+    static Value make_double(double val) {
+      Value v;
+      v.type = ColumnType::DOUBLE;
+      v.double_val = val;
+      return v;
+    }
+
+    static Value make_timestamp(int64_t seconds) {
+      Value v;
+      v.type = ColumnType::TIMESTAMP;
+      v.int_val = seconds;
+      return v;
+    }
+
+    ColumnType get_type() const { return type; }
+    bool is_numeric() const { return type != ColumnType::STRING; }
+    int64_t as_int() const { return type == ColumnType::DOUBLE ? (int64_t) double_val : int_val; }
+    double as_double() const { return type == ColumnType::DOUBLE ? double_val : (double) int_val; }
+    const string& as_string() const { return str_val; }
+
+    string to_string() const {
+      switch (type) {
+        case ColumnType::INT64:
+          return std::to_string(int_val);
+        case ColumnType::DOUBLE:
+          return std::to_string(double_val);
+        case ColumnType::TIMESTAMP:
+          return format_timestamp(int_val);
+        default:
+          return str_val;
+      }
+    }
+
+    bool operator==(const Value& other) const {
+      if (type == ColumnType::STRING && other.type == ColumnType::STRING) {
+        return str_val == other.str_val;
+      }
+      if (is_numeric() && other.is_numeric()) {
+        if (is_integer_type(type) && is_integer_type(other.type)) {
+          return int_val == other.int_val;
+        }
+        return as_double() == other.as_double();
+      }
+      return to_string() == other.to_string();
+    }
+
+    bool operator!=(const Value& other) const {
+      return !(*this == other);
+    }
+
+    bool operator<(const Value& other) const {
+      if (type == ColumnType::STRING && other.type == ColumnType::STRING) {
+        return str_val < other.str_val;
+      }
+      if (is_numeric() && other.is_numeric()) {
+        if (is_integer_type(type) && is_integer_type(other.type)) {
+          return int_val < other.int_val;
+        }
+        return as_double() < other.as_double();
+      }
+      return to_string() < other.to_string();
+    }
+
+  private:
+    ColumnType type = ColumnType::STRING;
+    union {
+      int64_t int_val = 0;
+      double double_val;
+    };
+    string str_val;
+};
+
+class StringDictionary;
+
+// A STRING column with a dictionary stores its values as codes into it
+struct Column {
+  string name;
+  ColumnType type;
+  std::shared_ptr<StringDictionary> dictionary = nullptr;
+};
+
+/**
+ * Column names, types and ordinal positions, built once per input and shared
+ * by every RowTuple that input produces.
+ */
+class Schema {
+  public:
+    Schema() {}
+
+    Schema(const vector<Column>& columns) {
+      for (const auto& column : columns) {
+        add_column(column.name, column.type, column.dictionary);
+      }
+    }
+
+    void add_column(const string& name, ColumnType type = ColumnType::STRING,
+        std::shared_ptr<StringDictionary> dictionary = nullptr) {
+      ordinals[name] = columns.size();
+      columns.push_back({name, type, std::move(dictionary)});
+    }
+
+    // Returns -1 if the schema has no column with this name
+    int get_ordinal(const string& name) const {
+      auto it = ordinals.find(name);
+      if (it == ordinals.end()) {
+        return -1;
+      }
+      return (int) it->second;
+    }
+
+    size_t size() const {
+      return columns.size();
+    }
+
+    const Column& get_column(size_t ordinal) const {
+      return columns[ordinal];
+    }
+
+    const vector<Column>& get_columns() const {
+      return columns;
+    }
+
+  private:
+    vector<Column> columns;
+    unordered_map<string, size_t> ordinals;
+};
+
+using SchemaPtr = std::shared_ptr<const Schema>;
+
 class RowTuple {
   public:
     RowTuple() {}
-    RowTuple(unordered_map<string, string> input_map) : row_data(std::move(input_map)) {}
+    RowTuple(SchemaPtr schema, vector<Value> values) : schema(std::move(schema)), values(std::move(values)) {}
+
+    // Convenience constructor for one-off tuples. Columns are ordered by name
+    // so that two tuples built from the same map share a layout.
+    RowTuple(unordered_map<string, string> input_map) {
+      vector<string> keys;
+      for (const auto& it : input_map) {
+        keys.push_back(it.first);
+      }
+      std::sort(keys.begin(), keys.end());
+
+      auto new_schema = std::make_shared<Schema>();
+      for (const auto& key : keys) {
+        new_schema->add_column(key);
+        values.push_back(Value(std::move(input_map[key])));
+      }
+      schema = std::move(new_schema);
+    }
 
     bool is_empty() {
-      return row_data.empty();
+      return values.empty();
     }
 
     std::string get_value(const string& key) {
-      auto it = row_data.find(key);
-      if (it == row_data.end()) {
+      int ordinal = schema == nullptr ? -1 : schema->get_ordinal(key);
+      if (ordinal < 0) {
         cout << "Could not find key " << key << endl;
         return "";
       }
-      return it->second;
+      return values[ordinal].to_string();
+    }
 
+    const Value& get_value(size_t ordinal) const {
+      return values[ordinal];
     }
 
-    void add_pair_to_record(string key, string value) {
-      std::pair<std::string, std::string> new_pair(key, value);
-      this->row_data.insert(new_pair);
+    const SchemaPtr& get_schema() const {
+      return schema;
+    }
+
+    const vector<Value>& get_values() const {
+      return values;
     }
 
     void print_contents() {
-      if (row_data.empty()) {
+      if (values.empty()) {
         cout << "Column: None" << endl;
         cout << "Value: None" << endl;
         return;
       }
 
-      for (const auto& it : row_data) {
-        cout << "<" << it.first << ", ";
-        cout <<  it.second << "> ";
+      for (size_t i = 0; i < values.size(); i++) {
+        cout << "<" << schema->get_column(i).name << ", ";
+        cout <<  values[i].to_string() << "> ";
       }
       cout << endl;
     }
 
-    const std::unordered_map<std::string, std::string>& get_row_data() {
-      return row_data;
-    } 
-
     // Note this is case sensitive right now
     // TODO Maybe make case-insensitive
     bool operator==(const RowTuple& other) {
-      if (row_data.size() != other.row_data.size()) {
+      if (values.size() != other.values.size()) {
         return false;
       }
-      
-      for (const auto& it : row_data) {
-        string key = it.first;
-        string value = it.second;
-        auto other_it = other.row_data.find(key);
-        if ((other_it == other.row_data.end()) || (other_it->second != value)) {
+
+      // Tuples from the same input share a schema, so compare positionally
+      if (schema == other.schema) {
+        for (size_t i = 0; i < values.size(); i++) {
+          if (values[i] != other.values[i]) {
+            return false;
+          }
+        }
+        return true;
+      }
+
+      for (size_t i = 0; i < values.size(); i++) {
+        int other_ordinal = other.schema->get_ordinal(schema->get_column(i).name);
+        if ((other_ordinal < 0) || (other.values[other_ordinal] != values[i])) {
           return false;
         }
       }
@@ -82,517 +399,6809 @@ class RowTuple {
     }
 
   private:
-    std::unordered_map<string, string> row_data;
+    friend class RowBatch;
+
+    SchemaPtr schema;
+    vector<Value> values;
 };
 
+const size_t BATCH_SIZE = 1024;
+
+// Finalizer from MurmurHash3, spreads every input bit across the result
+inline uint64_t mix_hash(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+inline uint64_t combine_hashes(uint64_t seed, uint64_t hash) {
+  return mix_hash(seed ^ (hash + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2)));
+}
+
 /**
- * Note, all the init method of an iterator must be called before it is used
- * Behavior is undefined if you call an iterator class without calling init first
+ * Bump allocator for many small allocations with a shared lifetime. Memory is
+ * carved out of blocks that double in size, and reset() frees everything at
+ * once while keeping the largest block for reuse.
  */
-class Iterator {
+class Arena {
   public:
+    Arena() {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    Arena(Arena&& other) = default;
+    Arena& operator=(Arena&& other) = default;
 
-    virtual ~Iterator() = default;
-
-    virtual void init() {
-      for (std::unique_ptr<Iterator>& input : inputs) {
-        input->init();
+    void* allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+      size_t offset = (used + align - 1) & ~(align - 1);
+      if (blocks.empty() || offset + size > blocks.back().size) {
+        add_block(size);
+        offset = 0;
       }
+      used = offset + size;
+      return blocks.back().data.get() + offset;
     }
 
-    virtual void close() {
-      for (std::unique_ptr<Iterator>& input : inputs) {
-        input->close();
+    std::string_view copy_string(std::string_view text) {
+      if (text.empty()) {
+        return std::string_view("", 0);
       }
+      char* dest = (char*) allocate(text.size(), 1);
+      memcpy(dest, text.data(), text.size());
+      return std::string_view(dest, text.size());
     }
 
-    virtual std::unique_ptr<RowTuple> get_next_ptr() = 0;
-
-    void set_inputs(vector<unique_ptr<Iterator>> inputs) {
-      this->inputs = std::move(inputs);
+    void reset() {
+      if (blocks.size() > 1) {
+        auto largest = std::max_element(blocks.begin(), blocks.end(),
+            [](const Block& a, const Block& b) { return a.size < b.size; });
+        Block keep = std::move(*largest);
+        blocks.clear();
+        blocks.push_back(std::move(keep));
+      }
+      used = 0;
     }
 
-    void append_input(unique_ptr<Iterator> new_input) {
-      inputs.push_back(std::move(new_input));
+    size_t memory_usage() const {
+      size_t bytes = 0;
+      for (const auto& block : blocks) {
+        bytes += block.size;
+      }
+      return bytes;
     }
 
-  protected:
-    vector<unique_ptr<Iterator>> inputs; //inputs = some other vector -> assignment op
-};
-
-class FileScan : public Iterator {
-  public:
-
-    FileScan() {}
+  private:
+    static constexpr size_t MIN_BLOCK_SIZE = 4096;
+    static constexpr size_t MAX_BLOCK_SIZE = 1 << 20;
 
-    FileScan(string file_path) : file_path(file_path) {}
+    struct Block {
+      std::unique_ptr<char[]> data;
+      size_t size;
+    };
 
-    void init() {
-      cout << "File scan Init method" << endl;
-      Iterator::init();
+    vector<Block> blocks;
+    // Bytes taken from the last block
+    size_t used = 0;
 
-      record_ptrs.clear();
-      iterator_position = 0;
-      //read_dummy_data(); // comment out once you've implemented the read_csv function
-      read_csv_data(); // uncomment when ready to read in CSV
+    void add_block(size_t min_size) {
+      size_t size = blocks.empty() ? MIN_BLOCK_SIZE : std::min(blocks.back().size * 2, MAX_BLOCK_SIZE);
+      size = std::max(size, min_size);
+      blocks.push_back({std::unique_ptr<char[]>(new char[size]), size});
     }
+};
 
-    void close() {
-      cout << "File Scan Closed Called" << endl;
-      Iterator::close();
+/**
+ * Interned values of a string column, shared by every batch of a scan. Each
+ * distinct value is stored once with its hash and rows hold its 32-bit code,
+ * so columns sharing a dictionary test equality and hash by code alone.
+ * Entries never move once added, which lets scan threads intern while others
+ * read codes they were handed.
+ *
+ * Each thread remembers the codes it was recently handed in a small cache, so
+ * repeated values take no lock at all. Other lookups share a reader lock and
+ * only new values take the writer lock. At most max_size values are kept;
+ * once the dictionary is full, columns using it store plain strings instead.
+ */
+class StringDictionary {
+  public:
+    static constexpr size_t DEFAULT_MAX_SIZE = 1 << 16;
 
-      record_ptrs.clear();
-      csv_headers.clear();
-      iterator_position = 0;
-    }
+    StringDictionary(size_t max_size = DEFAULT_MAX_SIZE)
+      : max_size(std::min<size_t>(max_size, UINT32_MAX)), id(next_id++) {}
+    StringDictionary(const StringDictionary&) = delete;
+    StringDictionary& operator=(const StringDictionary&) = delete;
 
-    std::unique_ptr<RowTuple> get_next_ptr() {
-      if (iterator_position >= record_ptrs.size()) {
-        return nullptr;
+    // Returns false, adding nothing, if val is new and the dictionary is full
+    bool try_intern(std::string_view val, uint32_t& code) {
+      uint64_t val_hash = std::hash<std::string_view>()(val);
+      CacheSlot& slot = cache[(val_hash ^ id) & (CACHE_SIZE - 1)];
+      if (slot.dictionary_id == id && entry(slot.code).text == val) {
+        code = slot.code;
+        return true;
       }
-
-      auto row_tuple = std::move(record_ptrs[iterator_position]); 
-      iterator_position++;
-      return row_tuple;
+      if (!find(val, code)) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto it = codes.find(val);
+        if (it != codes.end()) {
+          code = it->second;
+        } else if (count >= max_size) {
+          return false;
+        } else {
+          size_t offset;
+          size_t block = locate((uint32_t) count, offset);
+          if (offset == 0) {
+            blocks[block].reset(new Entry[FIRST_BLOCK_SIZE << block]);
+          }
+          Entry& entry = blocks[block][offset];
+          entry.text = bytes.copy_string(val);
+          entry.hash = mix_hash(val_hash);
+          codes.emplace(entry.text, (uint32_t) count);
+          code = (uint32_t) count++;
+          if (count == max_size) {
+            full.store(true, std::memory_order_relaxed);
+          }
+        }
+      }
+      slot.dictionary_id = id;
+      slot.code = code;
+      return true;
     }
 
-  private:
-    std::vector<std::unique_ptr<RowTuple>> record_ptrs;
-    std::vector<std::string> csv_headers;
-    unsigned int iterator_position = 0;
-    const unsigned int max_csv_line_size = 100000;
-    string file_path = ""; // should be absolute path
-
-    void read_csv_data() {
-      // Reading everything into memory for now
-      FILE *fp = std::fopen(this->file_path.c_str(), "r");
-      if (fp == nullptr) {
-        throw std::runtime_error("Failed to open csv file at path: " + this->file_path);
-      }
-      process_csv_headers(fp);
-      process_csv_data(fp);
-      std::fclose(fp);
-      //print_stored_records();
+    // No new value can be added
+    bool is_full() const {
+      return full.load(std::memory_order_relaxed);
     }
 
-    void print_stored_records() {
-      // WARNING: I wouldn't call this if full csv file is read in
-      cout << "Now Printing Stored Records from File Scan" << endl;
-      for (auto &record : record_ptrs) {
-        record->print_contents();
+    // Returns false if val was never interned
+    bool find(std::string_view val, uint32_t& code) const {
+      std::shared_lock<std::shared_mutex> lock(mutex);
+      auto it = codes.find(val);
+      if (it == codes.end()) {
+        return false;
       }
+      code = it->second;
+      return true;
     }
 
-    void process_csv_data(FILE* fp) {
-      int done = 0;
-      int err = 0;
-      char* csv_line;
+    std::string_view get(uint32_t code) const {
+      return entry(code).text;
+    }
 
-      while (true) {
-        csv_line = fread_csv_line(fp, max_csv_line_size, &done, &err);
-        if (done) {
-          return;
-        }
-        if (err || (csv_line == nullptr)) {
-          throw std::runtime_error("Failed to process csv data: " + this->file_path);
-        }
-        char **parsed = parse_csv(csv_line);
-        free(csv_line);
+    // Same as ColumnVector::hash of the value in a plain column
+    uint64_t hash(uint32_t code) const {
+      return entry(code).hash;
+    }
 
-        auto new_tuple = unique_ptr<RowTuple>(new RowTuple());
-        unsigned int counter = 0;
-        char **curr_field = parsed;
-        for(; *curr_field != nullptr; curr_field++) {
-          string header = csv_headers[counter];
-          string value = string(*curr_field);
-          new_tuple->add_pair_to_record(header, value);
-          counter++;
-        }
-        record_ptrs.push_back(std::move(new_tuple));
-        free_csv_line(parsed);
-      }
+    size_t size() const {
+      std::shared_lock<std::shared_mutex> lock(mutex);
+      return count;
     }
 
-    void process_csv_headers(FILE* fp) {
-      int done = 0;
-      int err = 0;
-      char* csv_line = fread_csv_line(fp, max_csv_line_size, &done, &err);
+  private:
+    struct Entry {
+      std::string_view text;
+      uint64_t hash;
+    };
 
-      if (done) {
-        throw std::runtime_error("CSV has no data at path: " + this->file_path);
-      }
-      if (err) {
-        throw std::runtime_error("CSV reading error at path: " + this->file_path);
-      }
-      char **parsed = parse_csv(csv_line);
-      free(csv_line);
-      if (parsed == nullptr) {
-        throw std::runtime_error("Error parsing csv file: " + this->file_path);
-      }
+    // Ids start at 1 and are never reused, so a slot can not match a later
+    // dictionary that happens to get the same address
+    struct CacheSlot {
+      uint64_t dictionary_id;
+      uint32_t code;
+    };
 
-      char **curr_field = parsed;
-      for(; *curr_field != nullptr; curr_field++) {
-        csv_headers.push_back(std::string(*curr_field));
-      }
-      free_csv_line(parsed);
-    }
+    static constexpr size_t CACHE_SIZE = 1024;
+    static inline thread_local CacheSlot cache[CACHE_SIZE];
+    static inline std::atomic<uint64_t> next_id{1};
 
-    void read_dummy_data() {
-      if (!record_ptrs.empty()) { record_ptrs.clear(); }
+    // Block b holds FIRST_BLOCK_SIZE << b entries, so 23 blocks cover every code
+    static constexpr size_t FIRST_BLOCK_SIZE = 1024;
+    static constexpr int FIRST_BLOCK_BITS = 10;
+    static constexpr size_t NUM_BLOCKS = 23;
 
-      auto record1 = std::unique_ptr<RowTuple>(
-          new RowTuple({{"student", "Jimmy Cricket"}, {"Sport", "Tennis"}, {"id", "2"}}));
-      auto record2 = std::unique_ptr<RowTuple>(
-          new RowTuple({{"student", "Foo Bar"}, {"Sport", "Rocket League"}, {"id", "3"}}));
-      auto record3 = std::unique_ptr<RowTuple>(
-          new RowTuple({{"student", "Arry Potter"}, {"Sport", "Quidditch"}, {"id", "2"}}));
-      auto record4 = std::unique_ptr<RowTuple>(
-          new RowTuple({{"student", "Arry Potter"}, {"Sport", "Quidditch"}, {"id", "2"}}));
-      auto record5 = std::unique_ptr<RowTuple>(
-          new RowTuple({{"student", "Harry Potter"}, {"Sport", "Foo"}, {"id", "5"}}));
+    const size_t max_size;
+    const uint64_t id;
+    mutable std::shared_mutex mutex;
+    std::unique_ptr<Entry[]> blocks[NUM_BLOCKS];
+    unordered_map<std::string_view, uint32_t> codes;
+    Arena bytes;
+    size_t count = 0;
+    std::atomic<bool> full{false};
 
-      record_ptrs.push_back(std::move(record1));
-      record_ptrs.push_back(std::move(record2));
-      record_ptrs.push_back(std::move(record3));
-      record_ptrs.push_back(std::move(record4));
-      record_ptrs.push_back(std::move(record5));
+    static size_t locate(uint32_t code, size_t& offset) {
+      uint64_t n = (uint64_t) code + FIRST_BLOCK_SIZE;
+      size_t block = (size_t) (63 - __builtin_clzll(n) - FIRST_BLOCK_BITS);
+      offset = (size_t) (n - ((uint64_t) FIRST_BLOCK_SIZE << block));
+      return block;
     }
 
+    const Entry& entry(uint32_t code) const {
+      size_t offset;
+      size_t block = locate(code, offset);
+      return blocks[block][offset];
+    }
 };
 
-class Select : public Iterator {
+/**
+ * Values of one column across a batch, stored as a contiguous typed array.
+ * Appended values are converted to the column's type. Empty fields of numeric
+ * columns are nulls: their slot holds 0 and a flag marks them missing. Nulls
+ * read back as an empty STRING Value, compare and sort before every value,
+ * and are skipped by filters and aggregates.
+ */
+class ColumnVector {
   public:
+    ColumnVector() {}
+    // A dictionary is only used by STRING columns
+    ColumnVector(ColumnType type, std::shared_ptr<StringDictionary> dictionary = nullptr)
+      : type(type), dictionary(type == ColumnType::STRING ? std::move(dictionary) : nullptr) {}
 
-    void init() {
-      cout << "Select Node Inited" << endl;
-      Iterator::init();
+    // Copies get their own arena, so they can be appended to on other threads
+    ColumnVector(const ColumnVector& other)
+      : type(other.type), ints(other.ints), doubles(other.doubles), nulls(other.nulls), dictionary(other.dictionary),
+        codes(other.codes) {
+      copy_strings(other);
     }
 
-    void close() {
-      cout <<  "Select Node closed" << endl;
-      Iterator::close();
+    ColumnVector& operator=(const ColumnVector& other) {
+      if (this != &other) {
+        type = other.type;
+        ints = other.ints;
+        doubles = other.doubles;
+        nulls = other.nulls;
+        dictionary = other.dictionary;
+        codes = other.codes;
+        strings.clear();
+        arena.reset();
+        copy_strings(other);
+      }
+      return *this;
     }
 
-    void set_predicate(bool (*predicate) (const std::unique_ptr<RowTuple>&)) {
-      this->predicate = predicate;
-    }
-    
-    std::unique_ptr<RowTuple> get_next_ptr() {
-      if (inputs.empty() || predicate == nullptr) {
-        return nullptr;
-      }
-      std::unique_ptr<Iterator>& input = inputs[0];
-      std::unique_ptr<RowTuple> curr_tuple;
-      while((curr_tuple = input->get_next_ptr()) != nullptr) {
-        if (predicate(curr_tuple)) {
-          return curr_tuple;
-        }
-      }
-      return nullptr;
+    ColumnVector(ColumnVector&& other) = default;
+    ColumnVector& operator=(ColumnVector&& other) = default;
 
+    ColumnType get_type() const {
+      return type;
     }
-    
-  private:
-    bool (*predicate) (const std::unique_ptr<RowTuple>&);
-};
-
-class Count : public Iterator {
-  public:
 
-    Count() {}
+    size_t size() const {
+      switch (type) {
+        case ColumnType::INT64:
+        case ColumnType::TIMESTAMP:
+          return ints.size();
+        case ColumnType::DOUBLE:
+          return doubles.size();
+        default:
+          return dictionary != nullptr ? codes.size() : strings.size();
+      }
+    }
 
-    Count(string alias) : result_alias(alias) {}
+    // String bytes are released in bulk with the arena
+    void clear() {
+      ints.clear();
+      doubles.clear();
+      nulls.clear();
+      strings.clear();
+      codes.clear();
+      arena.reset();
+    }
 
-    void init() {
-      cout << "Initializing Count Node" << endl;
-      Iterator::init();
-      num_records = 0;
+    // Drops every value from row num_rows on
+    void truncate(size_t num_rows) {
+      ints.resize(std::min(ints.size(), num_rows));
+      doubles.resize(std::min(doubles.size(), num_rows));
+      nulls.resize(std::min(nulls.size(), num_rows));
+      strings.resize(std::min(strings.size(), num_rows));
+      codes.resize(std::min(codes.size(), num_rows));
     }
 
-    void close() {
-      cout << "Closing Count Node" << endl;
-      Iterator::close();
+    void reserve(size_t num_rows) {
+      switch (type) {
+        case ColumnType::INT64:
+        case ColumnType::TIMESTAMP:
+          ints.reserve(num_rows);
+          break;
+        case ColumnType::DOUBLE:
+          doubles.reserve(num_rows);
+          break;
+        default:
+          if (dictionary != nullptr) {
+            codes.reserve(num_rows);
+          } else {
+            strings.reserve(num_rows);
+          }
+      }
     }
 
-    void set_result_alias(const string& alias) {
-      this->result_alias = alias;
+    void append(const Value& val) {
+      if (!val.is_numeric() && type != ColumnType::STRING) {
+        append_text(val.as_string());
+        return;
+      }
+      switch (type) {
+        case ColumnType::INT64:
+        case ColumnType::TIMESTAMP:
+          ints.push_back(val.as_int());
+          break;
+        case ColumnType::DOUBLE:
+          doubles.push_back(val.as_double());
+          break;
+        default:
+          append_string(val.to_string());
+      }
     }
 
-    std::unique_ptr<RowTuple> get_next_ptr() {
-      if (inputs.empty()) {
-        return std::unique_ptr<RowTuple>(new RowTuple());
+    // Parses raw field text straight into the column's storage, once.
+    // Empty fields in numeric columns are appended as nulls.
+    void append_text(std::string_view text) {
+      if (type != ColumnType::STRING && trim_spaces(text).empty()) {
+        append_null();
+        return;
       }
-      
-      unique_ptr<Iterator>& input = inputs[0];
-      while((input->get_next_ptr()) != nullptr) {
-        num_records++;
+      switch (type) {
+        case ColumnType::INT64:
+        case ColumnType::TIMESTAMP: {
+          int64_t val = 0;
+          bool parsed = type == ColumnType::INT64 ? parse_int64(text, val) : parse_timestamp(text, val);
+          if (!parsed) {
+            throw std::runtime_error("Not an integer or timestamp: " + string(text));
+          }
+          ints.push_back(val);
+          break;
+        }
+        case ColumnType::DOUBLE: {
+          double val = 0.0;
+          if (!parse_double(text, val)) {
+            throw std::runtime_error("Not a number: " + string(text));
+          }
+          doubles.push_back(val);
+          break;
+        }
+        default:
+          append_string(text);
       }
+    }
 
-      auto total_count = std::unique_ptr<RowTuple>(
-          new RowTuple(std::unordered_map<string, string>{{result_alias, std::to_string(num_records)}}));
+    // STRING columns have no nulls and get an empty string
+    void append_null() {
+      size_t row = size();
+      switch (type) {
+        case ColumnType::INT64:
+        case ColumnType::TIMESTAMP:
+          ints.push_back(0);
+          break;
+        case ColumnType::DOUBLE:
+          doubles.push_back(0.0);
+          break;
+        default:
+          append_string("");
+          return;
+      }
+      set_null(row, true);
+    }
 
-      return total_count;
+    // Only numeric columns hold nulls. The flags are only as long as the last
+    // null, so columns without any never touch them.
+    bool is_null(size_t row) const {
+      return row < nulls.size() && nulls[row];
     }
 
-  private:
-    long num_records = 0;
-    string result_alias = "Count";
-};
+    bool has_nulls() const {
+      return !nulls.empty();
+    }
 
-class Average : public Iterator {
-  // Don't forget... need to take in column name
-  // Also, avg will only work work on integers at the moment
-  public:
-    Average() {}
-    Average(const string& alias) : result_alias(alias) {}
+    void append_from(const ColumnVector& other, size_t row) {
+      if (other.type != type) {
+        append(other.get(row));
+        return;
+      }
+      if (other.is_null(row)) {
+        append_null();
+        return;
+      }
+      switch (type) {
+        case ColumnType::INT64:
+        case ColumnType::TIMESTAMP:
+          ints.push_back(other.ints[row]);
+          break;
+        case ColumnType::DOUBLE:
+          doubles.push_back(other.doubles[row]);
+          break;
+        default:
+          if (dictionary != nullptr && dictionary == other.dictionary) {
+            codes.push_back(other.codes[row]);
+          } else {
+            append_string(other.get_string(row));
+          }
+      }
+    }
+
+    Value get(size_t row) const {
+      if (is_null(row)) {
+        return Value();
+      }
+      switch (type) {
+        case ColumnType::INT64:
+          return Value::make_int(ints[row]);
+        case ColumnType::TIMESTAMP:
+          return Value::make_timestamp(ints[row]);
+        case ColumnType::DOUBLE:
+          return Value::make_double(doubles[row]);
+        default:
+          return Value(string(get_string(row)));
+      }
+    }
+
+    // Overwrites row with other_row of other, which must have the same type
+    void set_from(size_t row, const ColumnVector& other, size_t other_row) {
+      if (is_null(row) || other.is_null(other_row)) {
+        set_null(row, other.is_null(other_row));
+      }
+      switch (type) {
+        case ColumnType::INT64:
+        case ColumnType::TIMESTAMP:
+          ints[row] = other.ints[other_row];
+          break;
+        case ColumnType::DOUBLE:
+          doubles[row] = other.doubles[other_row];
+          break;
+        default:
+          if (dictionary != nullptr && dictionary == other.dictionary) {
+            codes[row] = other.codes[other_row];
+            break;
+          }
+          uint32_t code;
+          if (dictionary != nullptr && !dictionary->is_full()
+              && dictionary->try_intern(other.get_string(other_row), code)) {
+            codes[row] = code;
+            break;
+          }
+          drop_dictionary();
+          strings[row] = arena.copy_string(other.get_string(other_row));
+      }
+    }
+
+    // Returns <0, 0 or >0 like strcmp
+    int compare(size_t row, const ColumnVector& other, size_t other_row) const {
+      if (other.type != type) {
+        Value a = get(row);
+        Value b = other.get(other_row);
+        return a < b ? -1 : (b < a ? 1 : 0);
+      }
+      if (is_null(row) || other.is_null(other_row)) {
+        return (int) other.is_null(other_row) - (int) is_null(row);
+      }
+      switch (type) {
+        case ColumnType::INT64:
+        case ColumnType::TIMESTAMP:
+          return ints[row] < other.ints[other_row] ? -1 : (ints[row] > other.ints[other_row] ? 1 : 0);
+        case ColumnType::DOUBLE:
+          return doubles[row] < other.doubles[other_row] ? -1 : (doubles[row] > other.doubles[other_row] ? 1 : 0);
+        default:
+          if (dictionary != nullptr && dictionary == other.dictionary && codes[row] == other.codes[other_row]) {
+            return 0;
+          }
+          return get_string(row).compare(other.get_string(other_row));
+      }
+    }
+
+    // Values that compare equal hash equal, including integral doubles
+    // against integer columns
+    uint64_t hash(size_t row) const {
+      if (is_null(row)) {
+        // Same as the empty string a null reads back as
+        return mix_hash(std::hash<std::string_view>()(std::string_view()));
+      }
+      switch (type) {
+        case ColumnType::INT64:
+        case ColumnType::TIMESTAMP:
+          return mix_hash((uint64_t) ints[row]);
+        case ColumnType::DOUBLE: {
+          double val = doubles[row];
+          if (val >= -9.2e18 && val <= 9.2e18 && val == (double) (int64_t) val) {
+            return mix_hash((uint64_t) (int64_t) val);
+          }
+          uint64_t bits;
+          memcpy(&bits, &val, sizeof(bits));
+          return mix_hash(bits);
+        }
+        default:
+          if (dictionary != nullptr) {
+            return dictionary->hash(codes[row]);
+          }
+          return mix_hash(std::hash<std::string_view>()(strings[row]));
+      }
+    }
+
+    // Appends a byte string for row whose memcmp order is the order of
+    // compare() within this column. Keys of several columns can simply be
+    // concatenated, and descending keys are the same bytes inverted.
+    void append_sort_key(size_t row, bool descending, vector<uint8_t>& out) const {
+      size_t start = out.size();
+      switch (type) {
+        case ColumnType::INT64:
+        case ColumnType::TIMESTAMP:
+          // Nulls get the smallest key, which only INT64_MIN shares
+          append_big_endian(is_null(row) ? 0 : (uint64_t) ints[row] ^ (1ULL << 63), out);
+          break;
+        case ColumnType::DOUBLE: {
+          // -0.0 compares equal to 0.0, so it gets the same key
+          double val = doubles[row] == 0.0 ? 0.0 : doubles[row];
+          uint64_t bits;
+          memcpy(&bits, &val, sizeof(bits));
+          append_big_endian(is_null(row) ? 0 : ((bits >> 63) ? ~bits : bits ^ (1ULL << 63)), out);
+          break;
+        }
+        default:
+          // NUL is escaped as 00 FF so the 00 00 terminator sorts first
+          for (char c : get_string(row)) {
+            out.push_back((uint8_t) c);
+            if (c == '\0') {
+              out.push_back(0xFF);
+            }
+          }
+          out.push_back(0);
+          out.push_back(0);
+      }
+      if (descending) {
+        for (size_t i = start; i < out.size(); i++) {
+          out[i] = (uint8_t) ~out[i];
+        }
+      }
+    }
+
+    // Bulk appends for readers that already hold values of the column's type
+
+    void append_ints(const void* vals, size_t count) {
+      size_t old_size = ints.size();
+      ints.resize(old_size + count);
+      memcpy(ints.data() + old_size, vals, count * sizeof(int64_t));
+    }
+
+    void append_doubles(const void* vals, size_t count) {
+      size_t old_size = doubles.size();
+      doubles.resize(old_size + count);
+      memcpy(doubles.data() + old_size, vals, count * sizeof(double));
+    }
+
+    void append_string(std::string_view val) {
+      uint32_t code;
+      if (dictionary != nullptr && !dictionary->is_full() && dictionary->try_intern(val, code)) {
+        codes.push_back(code);
+        return;
+      }
+      drop_dictionary();
+      strings.push_back(arena.copy_string(val));
+    }
+
+    // code must come from this column's dictionary
+    void append_code(uint32_t code) {
+      codes.push_back(code);
+    }
+
+    // Appends the rows of other listed in selection
+    void append_selected(const ColumnVector& other, const vector<uint32_t>& selection) {
+      if (other.type != type) {
+        for (uint32_t row : selection) {
+          append(other.get(row));
+        }
+        return;
+      }
+      if (other.has_nulls()) {
+        size_t first = size();
+        for (size_t i = 0; i < selection.size(); i++) {
+          if (other.is_null(selection[i])) {
+            set_null(first + i, true);
+          }
+        }
+      }
+      switch (type) {
+        case ColumnType::INT64:
+        case ColumnType::TIMESTAMP:
+          for (uint32_t row : selection) {
+            ints.push_back(other.ints[row]);
+          }
+          break;
+        case ColumnType::DOUBLE:
+          for (uint32_t row : selection) {
+            doubles.push_back(other.doubles[row]);
+          }
+          break;
+        default:
+          if (dictionary != nullptr && dictionary == other.dictionary) {
+            for (uint32_t row : selection) {
+              codes.push_back(other.codes[row]);
+            }
+            break;
+          }
+          for (uint32_t row : selection) {
+            append_string(other.get_string(row));
+          }
+      }
+    }
+
+    void append_all(const ColumnVector& other) {
+      if (other.type != type) {
+        for (size_t i = 0; i < other.size(); i++) {
+          append(other.get(i));
+        }
+        return;
+      }
+      if (other.has_nulls()) {
+        set_nulls(size(), other.nulls.data(), other.nulls.size());
+      }
+      ints.insert(ints.end(), other.ints.begin(), other.ints.end());
+      doubles.insert(doubles.end(), other.doubles.begin(), other.doubles.end());
+      if (type != ColumnType::STRING) {
+        return;
+      }
+      if (dictionary != nullptr && dictionary == other.dictionary) {
+        codes.insert(codes.end(), other.codes.begin(), other.codes.end());
+        return;
+      }
+      for (size_t row = 0; row < other.size(); row++) {
+        append_string(other.get_string(row));
+      }
+    }
+
+    // Approximate heap bytes held by the values, used for memory budgets
+    size_t memory_usage() const {
+      // A shared dictionary is not charged to any one column
+      return ints.size() * sizeof(int64_t) + doubles.size() * sizeof(double) + codes.size() * sizeof(uint32_t)
+          + strings.size() * sizeof(std::string_view) + nulls.size() + arena.memory_usage();
+    }
+
+    // Marks rows first_row on whose flag is set as null, for readers that
+    // bulk append the values themselves
+    void set_nulls(size_t first_row, const uint8_t* flags, size_t count) {
+      for (size_t i = 0; i < count; i++) {
+        if (flags[i]) {
+          set_null(first_row + i, true);
+        }
+      }
+    }
+
+    const vector<int64_t>& get_ints() const { return ints; }
+    const vector<double>& get_doubles() const { return doubles; }
+    // 1 for null rows, and shorter than the column after its last null
+    const vector<uint8_t>& get_nulls() const { return nulls; }
+    // Views into the column's arena, valid until the column is cleared.
+    // Dictionary encoded columns keep codes instead, see get_string.
+    const vector<std::string_view>& get_strings() const { return strings; }
+
+    std::string_view get_string(size_t row) const {
+      return dictionary != nullptr ? dictionary->get(codes[row]) : strings[row];
+    }
+
+    bool is_dictionary_encoded() const { return dictionary != nullptr; }
+    const std::shared_ptr<StringDictionary>& get_dictionary() const { return dictionary; }
+    const vector<uint32_t>& get_codes() const { return codes; }
+
+  private:
+    static void append_big_endian(uint64_t val, vector<uint8_t>& out) {
+      for (int shift = 56; shift >= 0; shift -= 8) {
+        out.push_back((uint8_t) (val >> shift));
+      }
+    }
+
+    // Decodes the column to plain strings, once its dictionary is full
+    void drop_dictionary() {
+      if (dictionary == nullptr) {
+        return;
+      }
+      strings.reserve(codes.size());
+      for (uint32_t code : codes) {
+        strings.push_back(arena.copy_string(dictionary->get(code)));
+      }
+      codes.clear();
+      dictionary = nullptr;
+    }
+
+    void set_null(size_t row, bool null) {
+      if (row >= nulls.size()) {
+        if (!null) {
+          return;
+        }
+        nulls.resize(row + 1, 0);
+      }
+      nulls[row] = null;
+    }
+
+    void copy_strings(const ColumnVector& other) {
+      strings.reserve(other.strings.size());
+      for (std::string_view val : other.strings) {
+        strings.push_back(arena.copy_string(val));
+      }
+    }
+
+    ColumnType type = ColumnType::STRING;
+    vector<int64_t> ints;
+    vector<double> doubles;
+    vector<uint8_t> nulls;
+    vector<std::string_view> strings;
+    // Owns the bytes of strings
+    Arena arena;
+    std::shared_ptr<StringDictionary> dictionary;
+    vector<uint32_t> codes;
+};
+
+/**
+ * Up to BATCH_SIZE rows stored column by column. Batches are reused across
+ * calls to get_next_batch, so reset() keeps the column buffers' capacity.
+ */
+class RowBatch {
+  public:
+    RowBatch() {}
+
+    void reset(SchemaPtr new_schema) {
+      num_rows = 0;
+      if (new_schema == schema) {
+        for (auto& column : columns) {
+          column.clear();
+        }
+        return;
+      }
+      schema = std::move(new_schema);
+      columns.clear();
+      if (schema == nullptr) {
+        return;
+      }
+      for (const auto& column : schema->get_columns()) {
+        columns.push_back(ColumnVector(column.type, column.dictionary));
+        columns.back().reserve(BATCH_SIZE);
+      }
+    }
+
+    void clear() {
+      reset(schema);
+    }
+
+    const SchemaPtr& get_schema() const {
+      return schema;
+    }
+
+    size_t size() const {
+      return num_rows;
+    }
+
+    bool is_full() const {
+      return num_rows >= BATCH_SIZE;
+    }
+
+    size_t num_columns() const {
+      return columns.size();
+    }
+
+    const ColumnVector& get_column(size_t ordinal) const {
+      return columns[ordinal];
+    }
+
+    ColumnVector& get_column(size_t ordinal) {
+      return columns[ordinal];
+    }
+
+    // Called after values were pushed straight into the columns
+    void set_size(size_t rows) {
+      num_rows = rows;
+    }
+
+    void truncate(size_t rows) {
+      for (auto& column : columns) {
+        column.truncate(rows);
+      }
+      num_rows = std::min(num_rows, rows);
+    }
+
+    // Tuple columns are matched by position, so it must share the batch layout
+    void append_row(const RowTuple& tuple) {
+      for (size_t i = 0; i < columns.size(); i++) {
+        columns[i].append(i < tuple.values.size() ? tuple.values[i] : Value());
+      }
+      num_rows++;
+    }
+
+    void append_row_from(const RowBatch& other, size_t row) {
+      for (size_t i = 0; i < columns.size(); i++) {
+        columns[i].append_from(other.columns[i], row);
+      }
+      num_rows++;
+    }
+
+    void append_selected(const RowBatch& other, const vector<uint32_t>& selection) {
+      for (size_t i = 0; i < columns.size(); i++) {
+        columns[i].append_selected(other.columns[i], selection);
+      }
+      num_rows += selection.size();
+    }
+
+    unique_ptr<RowTuple> get_row(size_t row) const {
+      auto tuple = unique_ptr<RowTuple>(new RowTuple());
+      load_row(row, *tuple);
+      return tuple;
+    }
+
+    // Refills an existing tuple so callers can reuse its storage
+    void load_row(size_t row, RowTuple& tuple) const {
+      tuple.schema = schema;
+      tuple.values.resize(columns.size());
+      for (size_t i = 0; i < columns.size(); i++) {
+        tuple.values[i] = columns[i].get(row);
+      }
+    }
+
+    int compare_rows(size_t row, const RowBatch& other, size_t other_row) const {
+      size_t num_cols = std::min(columns.size(), other.columns.size());
+      for (size_t i = 0; i < num_cols; i++) {
+        int cmp = columns[i].compare(row, other.columns[i], other_row);
+        if (cmp != 0) {
+          return cmp;
+        }
+      }
+      return columns.size() < other.columns.size() ? -1 : (columns.size() > other.columns.size() ? 1 : 0);
+    }
+
+    // hashes[i] combines the hashes of the given columns in row i
+    void hash_columns(const vector<size_t>& ordinals, vector<uint64_t>& hashes) const {
+      hashes.assign(num_rows, 0);
+      for (size_t ordinal : ordinals) {
+        const ColumnVector& column = columns[ordinal];
+        for (size_t i = 0; i < num_rows; i++) {
+          hashes[i] = combine_hashes(hashes[i], column.hash(i));
+        }
+      }
+    }
+
+    size_t memory_usage() const {
+      size_t bytes = 0;
+      for (const auto& column : columns) {
+        bytes += column.memory_usage();
+      }
+      return bytes;
+    }
+
+  private:
+    SchemaPtr schema;
+    vector<ColumnVector> columns;
+    size_t num_rows = 0;
+};
+
+/**
+ * Fixed set of worker threads, each with its own deque of tasks. A task
+ * submitted by one of the pool's workers goes on that worker's deque, other
+ * submissions are dealt out round robin. Workers run their own newest task
+ * first and, once their deque is empty, steal the oldest task of another
+ * worker, so uneven tasks still keep every thread busy. Destroying the pool
+ * finishes the queued tasks and joins the workers.
+ */
+class ThreadPool {
+  public:
+    ThreadPool(size_t num_threads) {
+      for (size_t i = 0; i < std::max<size_t>(num_threads, 1); i++) {
+        queues.push_back(std::unique_ptr<WorkerQueue>(new WorkerQueue()));
+      }
+      for (size_t i = 0; i < queues.size(); i++) {
+        workers.emplace_back([this, i]() { worker_loop(i); });
+      }
+    }
+
+    ~ThreadPool() {
+      {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stopping = true;
+      }
+      wake_cv.notify_all();
+      for (auto& worker : workers) {
+        worker.join();
+      }
+    }
+
+    size_t size() const {
+      return workers.size();
+    }
+
+    // Index of the calling thread among this pool's workers, or size() when
+    // called from any other thread
+    size_t worker_index() const {
+      return current_pool == this ? current_worker : workers.size();
+    }
+
+    // Exceptions thrown by the task are rethrown from the future's get()
+    template <typename F>
+    auto submit(F task) -> std::future<decltype(task())> {
+      using Result = decltype(task());
+      auto packaged = std::make_shared<std::packaged_task<Result()>>(std::move(task));
+      std::future<Result> result = packaged->get_future();
+      size_t target = worker_index();
+      if (target >= queues.size()) {
+        target = next_queue++ % queues.size();
+      }
+      {
+        std::lock_guard<std::mutex> lock(queues[target]->mutex);
+        queues[target]->tasks.push_back([packaged]() { (*packaged)(); });
+      }
+      {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        queued_tasks++;
+      }
+      wake_cv.notify_one();
+      return result;
+    }
+
+  private:
+    struct WorkerQueue {
+      std::mutex mutex;
+      std::deque<std::function<void()>> tasks;
+    };
+
+    vector<std::thread> workers;
+    vector<std::unique_ptr<WorkerQueue>> queues;
+    std::atomic<size_t> next_queue{0};
+    // Tasks sitting in any deque. A worker claims one before looking for it,
+    // so there is always a task for every claim.
+    std::mutex sleep_mutex;
+    std::condition_variable wake_cv;
+    size_t queued_tasks = 0;
+    bool stopping = false;
+
+    static inline thread_local const ThreadPool* current_pool = nullptr;
+    static inline thread_local size_t current_worker = 0;
+
+    bool take_task(size_t worker, std::function<void()>& task) {
+      {
+        WorkerQueue& own = *queues[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+          task = std::move(own.tasks.back());
+          own.tasks.pop_back();
+          return true;
+        }
+      }
+      for (size_t i = 1; i < queues.size(); i++) {
+        WorkerQueue& victim = *queues[(worker + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+          task = std::move(victim.tasks.front());
+          victim.tasks.pop_front();
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void worker_loop(size_t worker) {
+      current_pool = this;
+      current_worker = worker;
+      while (true) {
+        {
+          std::unique_lock<std::mutex> lock(sleep_mutex);
+          wake_cv.wait(lock, [this]() { return stopping || queued_tasks > 0; });
+          if (queued_tasks == 0) {
+            return;
+          }
+          queued_tasks--;
+        }
+        std::function<void()> task;
+        // Another worker may take the task we saw first, but one is left
+        while (!take_task(worker, task)) {
+          std::this_thread::yield();
+        }
+        task();
+      }
+    }
+};
+
+// Waits for every task, then rethrows the first exception any of them threw.
+// Tasks often reference the caller's locals, so none may be left running.
+void wait_for_all(vector<std::future<void>>& tasks) {
+  std::exception_ptr error;
+  for (auto& task : tasks) {
+    try {
+      task.get();
+    } catch (...) {
+      if (error == nullptr) {
+        error = std::current_exception();
+      }
+    }
+  }
+  tasks.clear();
+  if (error != nullptr) {
+    std::rethrow_exception(error);
+  }
+}
+
+/**
+ * Min and max of one column over a block of rows, e.g. a columnar row group.
+ */
+struct ZoneMap {
+  bool has_stats = false;
+  Value min;
+  Value max;
+};
+
+enum class CompareOp { EQ, NE, LT, LE, GT, GE };
+
+// Ascending row numbers of a batch that are still candidates
+using SelectionVector = vector<uint32_t>;
+
+/**
+ * Boolean expression over the columns of a batch, evaluated a batch at a time
+ * by narrowing a selection vector. Column names are resolved by bind(), which
+ * must see the schema of the batches before filter() does.
+ */
+class Expression {
+  public:
+    virtual ~Expression() = default;
+
+    // Throws if a referenced column is not in schema
+    virtual void bind(const Schema& schema) = 0;
+
+    // Keeps only the selected rows for which the expression is true
+    virtual void filter(const RowBatch& batch, SelectionVector& selection) const = 0;
+
+    // zones are indexed by bound ordinal. False means no row in the block can
+    // match, true means some might.
+    virtual bool might_match(const vector<ZoneMap>& zones) const {
+      return true;
+    }
+
+    virtual void collect_columns(vector<string>& columns) const = 0;
+};
+
+using ExprPtr = std::shared_ptr<Expression>;
+
+template <typename T>
+static bool compare_values(CompareOp op, const T& a, const T& b) {
+  switch (op) {
+    case CompareOp::EQ: return a == b;
+    case CompareOp::NE: return a != b;
+    case CompareOp::LT: return a < b;
+    case CompareOp::LE: return a <= b;
+    case CompareOp::GT: return a > b;
+    default: return a >= b;
+  }
+}
+
+// Keeps the selected rows for which matches(vals[row]), with no branch on the outcome
+template <typename T, typename Match>
+static void select_rows(const T* vals, SelectionVector& selection, Match matches) {
+  size_t kept = 0;
+  for (size_t i = 0; i < selection.size(); i++) {
+    uint32_t row = selection[i];
+    selection[kept] = row;
+    kept += matches(vals[row]) ? 1 : 0;
+  }
+  selection.resize(kept);
+}
+
+// Nulls match no predicate, so they leave the selection
+static void drop_nulls(const ColumnVector& column, SelectionVector& selection) {
+  if (!column.has_nulls()) {
+    return;
+  }
+  size_t kept = 0;
+  for (size_t i = 0; i < selection.size(); i++) {
+    uint32_t row = selection[i];
+    selection[kept] = row;
+    kept += column.is_null(row) ? 0 : 1;
+  }
+  selection.resize(kept);
+}
+
+template <typename T>
+static void select_compare_scalar(const T* vals, CompareOp op, const T& literal, SelectionVector& selection) {
+  switch (op) {
+    case CompareOp::EQ:
+      select_rows(vals, selection, [&literal](const T& val) { return val == literal; });
+      break;
+    case CompareOp::NE:
+      select_rows(vals, selection, [&literal](const T& val) { return val != literal; });
+      break;
+    case CompareOp::LT:
+      select_rows(vals, selection, [&literal](const T& val) { return val < literal; });
+      break;
+    case CompareOp::LE:
+      select_rows(vals, selection, [&literal](const T& val) { return val <= literal; });
+      break;
+    case CompareOp::GT:
+      select_rows(vals, selection, [&literal](const T& val) { return val > literal; });
+      break;
+    case CompareOp::GE:
+      select_rows(vals, selection, [&literal](const T& val) { return val >= literal; });
+      break;
+  }
+}
+
+#ifdef DB_SIMD_X86
+
+static bool has_avx2() {
+  static const bool supported = __builtin_cpu_supports("avx2");
+  return supported;
+}
+
+// Appends base + i for every set bit i of a 4 lane mask
+static inline size_t append_lanes(unsigned mask, uint32_t base, uint32_t* out, size_t kept) {
+  while (mask != 0) {
+    out[kept++] = base + (uint32_t) __builtin_ctz(mask);
+    mask &= mask - 1;
+  }
+  return kept;
+}
+
+// Writes the rows of vals[0..num_rows) that compare true to out, four lanes
+// per instruction. out may alias the selection the rows came from.
+template <CompareOp OP>
+__attribute__((target("avx2")))
+static size_t select_ints_avx2(const int64_t* vals, size_t num_rows, int64_t literal, uint32_t* out) {
+  const __m256i lit = _mm256_set1_epi64x(literal);
+  size_t kept = 0;
+  size_t i = 0;
+  for (; i + 4 <= num_rows; i += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i*) (vals + i));
+    __m256i hits;
+    if (OP == CompareOp::EQ || OP == CompareOp::NE) {
+      hits = _mm256_cmpeq_epi64(v, lit);
+    } else if (OP == CompareOp::LT || OP == CompareOp::GE) {
+      hits = _mm256_cmpgt_epi64(lit, v);
+    } else {
+      hits = _mm256_cmpgt_epi64(v, lit);
+    }
+    unsigned mask = (unsigned) _mm256_movemask_pd(_mm256_castsi256_pd(hits));
+    if (OP == CompareOp::NE || OP == CompareOp::LE || OP == CompareOp::GE) {
+      mask ^= 0xF;
+    }
+    kept = append_lanes(mask, (uint32_t) i, out, kept);
+  }
+  for (; i < num_rows; i++) {
+    out[kept] = (uint32_t) i;
+    kept += compare_values(OP, vals[i], literal) ? 1 : 0;
+  }
+  return kept;
+}
+
+// Ordered, non-signalling predicates, except NE which is true for NaN like !=
+static constexpr int avx_predicate(CompareOp op) {
+  return op == CompareOp::EQ ? _CMP_EQ_OQ : op == CompareOp::NE ? _CMP_NEQ_UQ
+      : op == CompareOp::LT ? _CMP_LT_OQ : op == CompareOp::LE ? _CMP_LE_OQ
+      : op == CompareOp::GT ? _CMP_GT_OQ : _CMP_GE_OQ;
+}
+
+template <CompareOp OP>
+__attribute__((target("avx2")))
+static size_t select_doubles_avx2(const double* vals, size_t num_rows, double literal, uint32_t* out) {
+  // Bound first so the immediate is a constant even without optimization
+  constexpr int predicate = avx_predicate(OP);
+  const __m256d lit = _mm256_set1_pd(literal);
+  size_t kept = 0;
+  size_t i = 0;
+  for (; i + 4 <= num_rows; i += 4) {
+    __m256d hits = _mm256_cmp_pd(_mm256_loadu_pd(vals + i), lit, predicate);
+    kept = append_lanes((unsigned) _mm256_movemask_pd(hits), (uint32_t) i, out, kept);
+  }
+  for (; i < num_rows; i++) {
+    out[kept] = (uint32_t) i;
+    kept += compare_values(OP, vals[i], literal) ? 1 : 0;
+  }
+  return kept;
+}
+
+#endif
+
+// Dense selections over a whole column use the SIMD kernels when the CPU has
+// them, sparse ones the scalar loop
+static void select_compare(const vector<int64_t>& vals, CompareOp op, int64_t literal, SelectionVector& selection) {
+#ifdef DB_SIMD_X86
+  if (selection.size() == vals.size() && has_avx2()) {
+    size_t kept = 0;
+    switch (op) {
+      case CompareOp::EQ: kept = select_ints_avx2<CompareOp::EQ>(vals.data(), vals.size(), literal, selection.data()); break;
+      case CompareOp::NE: kept = select_ints_avx2<CompareOp::NE>(vals.data(), vals.size(), literal, selection.data()); break;
+      case CompareOp::LT: kept = select_ints_avx2<CompareOp::LT>(vals.data(), vals.size(), literal, selection.data()); break;
+      case CompareOp::LE: kept = select_ints_avx2<CompareOp::LE>(vals.data(), vals.size(), literal, selection.data()); break;
+      case CompareOp::GT: kept = select_ints_avx2<CompareOp::GT>(vals.data(), vals.size(), literal, selection.data()); break;
+      case CompareOp::GE: kept = select_ints_avx2<CompareOp::GE>(vals.data(), vals.size(), literal, selection.data()); break;
+    }
+    selection.resize(kept);
+    return;
+  }
+#endif
+  select_compare_scalar(vals.data(), op, literal, selection);
+}
+
+static void select_compare(const vector<double>& vals, CompareOp op, double literal, SelectionVector& selection) {
+#ifdef DB_SIMD_X86
+  if (selection.size() == vals.size() && has_avx2()) {
+    size_t kept = 0;
+    switch (op) {
+      case CompareOp::EQ: kept = select_doubles_avx2<CompareOp::EQ>(vals.data(), vals.size(), literal, selection.data()); break;
+      case CompareOp::NE: kept = select_doubles_avx2<CompareOp::NE>(vals.data(), vals.size(), literal, selection.data()); break;
+      case CompareOp::LT: kept = select_doubles_avx2<CompareOp::LT>(vals.data(), vals.size(), literal, selection.data()); break;
+      case CompareOp::LE: kept = select_doubles_avx2<CompareOp::LE>(vals.data(), vals.size(), literal, selection.data()); break;
+      case CompareOp::GT: kept = select_doubles_avx2<CompareOp::GT>(vals.data(), vals.size(), literal, selection.data()); break;
+      case CompareOp::GE: kept = select_doubles_avx2<CompareOp::GE>(vals.data(), vals.size(), literal, selection.data()); break;
+    }
+    selection.resize(kept);
+    return;
+  }
+#endif
+  select_compare_scalar(vals.data(), op, literal, selection);
+}
+
+// a op b is b flipped(op) a
+static CompareOp flip_compare(CompareOp op) {
+  switch (op) {
+    case CompareOp::LT: return CompareOp::GT;
+    case CompareOp::LE: return CompareOp::GE;
+    case CompareOp::GT: return CompareOp::LT;
+    case CompareOp::GE: return CompareOp::LE;
+    default: return op;
+  }
+}
+
+static size_t bind_column(const Schema& schema, const string& column) {
+  int ordinal = schema.get_ordinal(column);
+  if (ordinal < 0) {
+    throw std::runtime_error("Predicate column not found: " + column);
+  }
+  return (size_t) ordinal;
+}
+
+// Converts a literal to the type of the column it is compared with. String
+// literals are parsed, so timestamp columns can be compared with dates.
+static Value coerce_literal(const Value& literal, ColumnType type) {
+  if (literal.is_numeric() || type == ColumnType::STRING) {
+    if (type == ColumnType::STRING) {
+      return Value(literal.to_string());
+    }
+    return literal;
+  }
+  int64_t int_val = 0;
+  double double_val = 0.0;
+  switch (type) {
+    case ColumnType::INT64:
+      if (parse_int64(literal.as_string(), int_val)) {
+        return Value::make_int(int_val);
+      }
+      break;
+    case ColumnType::TIMESTAMP:
+      if (parse_timestamp(literal.as_string(), int_val)) {
+        return Value::make_timestamp(int_val);
+      }
+      break;
+    default:
+      if (parse_double(literal.as_string(), double_val)) {
+        return Value::make_double(double_val);
+      }
+  }
+  throw std::runtime_error("Literal does not match column type: " + literal.as_string());
+}
+
+/**
+ * One side of a comparison, a column or a typed literal.
+ */
+struct Operand {
+  string column;
+  Value literal;
+
+  static Operand column_ref(const string& name) {
+    Operand operand;
+    operand.column = name;
+    return operand;
+  }
+
+  static Operand constant(const Value& val) {
+    Operand operand;
+    operand.literal = val;
+    return operand;
+  }
+
+  bool is_column() const {
+    return !column.empty();
+  }
+};
+
+class Comparison : public Expression {
+  public:
+    Comparison(const Operand& left, CompareOp op, const Operand& right) : left(left), op(op), right(right) {}
+
+    void bind(const Schema& schema) {
+      bound_op = op;
+      constant = -1;
+      right_ordinal = -1;
+      const Operand* column = &left;
+      const Operand* other = &right;
+      if (!left.is_column()) {
+        if (!right.is_column()) {
+          constant = compare_values(op, left.literal < right.literal ? -1 : (right.literal < left.literal ? 1 : 0), 0);
+          return;
+        }
+        std::swap(column, other);
+        bound_op = flip_compare(op);
+      }
+      ordinal = bind_column(schema, column->column);
+      column_type = schema.get_column(ordinal).type;
+      if (other->is_column()) {
+        right_ordinal = (int) bind_column(schema, other->column);
+        return;
+      }
+      literal = coerce_literal(other->literal, column_type);
+      // Integer columns against a fractional literal are compared as doubles
+      ints_as_doubles = is_integer_type(column_type) && literal.get_type() == ColumnType::DOUBLE
+          && literal.as_double() != (double) literal.as_int();
+    }
+
+    void filter(const RowBatch& batch, SelectionVector& selection) const {
+      if (constant >= 0) {
+        if (constant == 0) {
+          selection.clear();
+        }
+        return;
+      }
+      const ColumnVector& column = batch.get_column(ordinal);
+      drop_nulls(column, selection);
+      if (right_ordinal >= 0) {
+        const ColumnVector& other = batch.get_column((size_t) right_ordinal);
+        drop_nulls(other, selection);
+        size_t kept = 0;
+        for (size_t i = 0; i < selection.size(); i++) {
+          uint32_t row = selection[i];
+          selection[kept] = row;
+          kept += compare_values(bound_op, column.compare(row, other, row), 0) ? 1 : 0;
+        }
+        selection.resize(kept);
+        return;
+      }
+      switch (column_type) {
+        case ColumnType::INT64:
+        case ColumnType::TIMESTAMP:
+          if (ints_as_doubles) {
+            double val = literal.as_double();
+            CompareOp compare_op = bound_op;
+            select_rows(column.get_ints().data(), selection, [val, compare_op](int64_t row_val) {
+              return compare_values(compare_op, (double) row_val, val);
+            });
+          } else {
+            select_compare(column.get_ints(), bound_op, literal.as_int(), selection);
+          }
+          break;
+        case ColumnType::DOUBLE:
+          select_compare(column.get_doubles(), bound_op, literal.as_double(), selection);
+          break;
+        default:
+          if (column.is_dictionary_encoded()) {
+            filter_codes(column, selection);
+          } else {
+            select_compare_scalar(column.get_strings().data(), bound_op, std::string_view(literal.as_string()), selection);
+          }
+      }
+    }
+
+    bool might_match(const vector<ZoneMap>& zones) const {
+      if (constant >= 0) {
+        return constant == 1;
+      }
+      if (right_ordinal >= 0 || ordinal >= zones.size() || !zones[ordinal].has_stats) {
+        return true;
+      }
+      const Value& min = zones[ordinal].min;
+      const Value& max = zones[ordinal].max;
+      switch (bound_op) {
+        case CompareOp::EQ: return !(literal < min) && !(max < literal);
+        case CompareOp::NE: return !(min == max && min == literal);
+        case CompareOp::LT: return min < literal;
+        case CompareOp::LE: return !(literal < min);
+        case CompareOp::GT: return literal < max;
+        default: return !(max < literal);
+      }
+    }
+
+    void collect_columns(vector<string>& columns) const {
+      for (const Operand* operand : {&left, &right}) {
+        if (operand->is_column()) {
+          columns.push_back(operand->column);
+        }
+      }
+    }
+
+  private:
+    Operand left;
+    CompareOp op;
+    Operand right;
+    // Bound form: column ordinal bound_op (literal or right_ordinal's column)
+    CompareOp bound_op = CompareOp::EQ;
+    size_t ordinal = 0;
+    int right_ordinal = -1;
+    ColumnType column_type = ColumnType::STRING;
+    Value literal;
+    bool ints_as_doubles = false;
+    // 0 or 1 when both sides are literals
+    int constant = -1;
+
+    // Equality on a dictionary column compares codes with the literal's code
+    void filter_codes(const ColumnVector& column, SelectionVector& selection) const {
+      const StringDictionary& dictionary = *column.get_dictionary();
+      std::string_view text = literal.as_string();
+      if (bound_op == CompareOp::EQ || bound_op == CompareOp::NE) {
+        uint32_t code;
+        if (dictionary.find(text, code)) {
+          select_compare_scalar(column.get_codes().data(), bound_op, code, selection);
+        } else if (bound_op == CompareOp::EQ) {
+          selection.clear();
+        }
+        return;
+      }
+      CompareOp compare_op = bound_op;
+      select_rows(column.get_codes().data(), selection, [&dictionary, text, compare_op](uint32_t code) {
+        return compare_values(compare_op, dictionary.get(code), text);
+      });
+    }
+};
+
+// column IN (values...)
+class InList : public Expression {
+  public:
+    InList(const string& column, const vector<Value>& values) : column(column), values(values) {}
+
+    void bind(const Schema& schema) {
+      ordinal = bind_column(schema, column);
+      column_type = schema.get_column(ordinal).type;
+      typed_values.clear();
+      ints.clear();
+      doubles.clear();
+      strings.clear();
+      for (const Value& val : values) {
+        Value typed = coerce_literal(val, column_type);
+        if (is_integer_type(column_type)) {
+          // A fractional value can never equal an integer
+          if (typed.get_type() == ColumnType::DOUBLE && typed.as_double() != (double) typed.as_int()) {
+            continue;
+          }
+          ints.push_back(typed.as_int());
+        } else if (column_type == ColumnType::DOUBLE) {
+          doubles.push_back(typed.as_double());
+        } else {
+          strings.push_back(typed.as_string());
+        }
+        typed_values.push_back(std::move(typed));
+      }
+      std::sort(ints.begin(), ints.end());
+      std::sort(doubles.begin(), doubles.end());
+      std::sort(strings.begin(), strings.end());
+    }
+
+    void filter(const RowBatch& batch, SelectionVector& selection) const {
+      const ColumnVector& col = batch.get_column(ordinal);
+      drop_nulls(col, selection);
+      switch (column_type) {
+        case ColumnType::INT64:
+        case ColumnType::TIMESTAMP:
+          select_rows(col.get_ints().data(), selection, [this](int64_t val) {
+            return std::binary_search(ints.begin(), ints.end(), val);
+          });
+          break;
+        case ColumnType::DOUBLE:
+          select_rows(col.get_doubles().data(), selection, [this](double val) {
+            return std::binary_search(doubles.begin(), doubles.end(), val);
+          });
+          break;
+        default:
+          if (col.is_dictionary_encoded()) {
+            // Values never interned cannot occur in the column
+            vector<uint32_t> codes;
+            uint32_t code;
+            for (const string& val : strings) {
+              if (col.get_dictionary()->find(val, code)) {
+                codes.push_back(code);
+              }
+            }
+            std::sort(codes.begin(), codes.end());
+            select_rows(col.get_codes().data(), selection, [&codes](uint32_t code) {
+              return std::binary_search(codes.begin(), codes.end(), code);
+            });
+            break;
+          }
+          select_rows(col.get_strings().data(), selection, [this](std::string_view val) {
+            return std::binary_search(strings.begin(), strings.end(), val);
+          });
+      }
+    }
+
+    bool might_match(const vector<ZoneMap>& zones) const {
+      if (ordinal >= zones.size() || !zones[ordinal].has_stats) {
+        return !typed_values.empty();
+      }
+      for (const Value& val : typed_values) {
+        if (!(val < zones[ordinal].min) && !(zones[ordinal].max < val)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void collect_columns(vector<string>& columns) const {
+      columns.push_back(column);
+    }
+
+  private:
+    string column;
+    vector<Value> values;
+    size_t ordinal = 0;
+    ColumnType column_type = ColumnType::STRING;
+    vector<Value> typed_values;
+    vector<int64_t> ints;
+    vector<double> doubles;
+    vector<string> strings;
+};
+
+// Each child narrows what the previous ones kept
+class AndExpression : public Expression {
+  public:
+    AndExpression(vector<ExprPtr> children) : children(std::move(children)) {}
+
+    void bind(const Schema& schema) {
+      for (auto& child : children) {
+        child->bind(schema);
+      }
+    }
+
+    void filter(const RowBatch& batch, SelectionVector& selection) const {
+      for (size_t i = 0; i < children.size() && !selection.empty(); i++) {
+        children[i]->filter(batch, selection);
+      }
+    }
+
+    bool might_match(const vector<ZoneMap>& zones) const {
+      for (const auto& child : children) {
+        if (!child->might_match(zones)) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    void collect_columns(vector<string>& columns) const {
+      for (const auto& child : children) {
+        child->collect_columns(columns);
+      }
+    }
+
+  private:
+    vector<ExprPtr> children;
+};
+
+// Each child only looks at the rows no earlier child matched
+class OrExpression : public Expression {
+  public:
+    OrExpression(vector<ExprPtr> children) : children(std::move(children)) {}
+
+    void bind(const Schema& schema) {
+      for (auto& child : children) {
+        child->bind(schema);
+      }
+    }
+
+    void filter(const RowBatch& batch, SelectionVector& selection) const {
+      SelectionVector remaining = selection;
+      SelectionVector matched;
+      SelectionVector candidates;
+      SelectionVector merged;
+      for (const auto& child : children) {
+        if (remaining.empty()) {
+          break;
+        }
+        candidates = remaining;
+        child->filter(batch, candidates);
+        merged.clear();
+        std::set_union(matched.begin(), matched.end(), candidates.begin(), candidates.end(), std::back_inserter(merged));
+        matched.swap(merged);
+        merged.clear();
+        std::set_difference(remaining.begin(), remaining.end(), candidates.begin(), candidates.end(),
+                            std::back_inserter(merged));
+        remaining.swap(merged);
+      }
+      selection.swap(matched);
+    }
+
+    bool might_match(const vector<ZoneMap>& zones) const {
+      for (const auto& child : children) {
+        if (child->might_match(zones)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void collect_columns(vector<string>& columns) const {
+      for (const auto& child : children) {
+        child->collect_columns(columns);
+      }
+    }
+
+  private:
+    vector<ExprPtr> children;
+};
+
+class NotExpression : public Expression {
+  public:
+    NotExpression(ExprPtr child) : child(std::move(child)) {}
+
+    void bind(const Schema& schema) {
+      child->bind(schema);
+      vector<string> columns;
+      child->collect_columns(columns);
+      ordinals.clear();
+      for (const auto& column : columns) {
+        ordinals.push_back(bind_column(schema, column));
+      }
+    }
+
+    // Rows with a null in any of the child's columns match neither the child
+    // nor its negation
+    void filter(const RowBatch& batch, SelectionVector& selection) const {
+      SelectionVector matched = selection;
+      child->filter(batch, matched);
+      SelectionVector kept;
+      std::set_difference(selection.begin(), selection.end(), matched.begin(), matched.end(), std::back_inserter(kept));
+      for (size_t ordinal : ordinals) {
+        drop_nulls(batch.get_column(ordinal), kept);
+      }
+      selection.swap(kept);
+    }
+
+    void collect_columns(vector<string>& columns) const {
+      child->collect_columns(columns);
+    }
+
+  private:
+    ExprPtr child;
+    vector<size_t> ordinals;
+};
+
+ExprPtr make_comparison(const Operand& left, CompareOp op, const Operand& right) {
+  return ExprPtr(new Comparison(left, op, right));
+}
+
+// column op literal, the common case
+ExprPtr make_comparison(const string& column, CompareOp op, const Value& literal) {
+  return make_comparison(Operand::column_ref(column), op, Operand::constant(literal));
+}
+
+ExprPtr make_and(vector<ExprPtr> children) {
+  return ExprPtr(new AndExpression(std::move(children)));
+}
+
+ExprPtr make_or(vector<ExprPtr> children) {
+  return ExprPtr(new OrExpression(std::move(children)));
+}
+
+ExprPtr make_not(ExprPtr child) {
+  return ExprPtr(new NotExpression(std::move(child)));
+}
+
+ExprPtr make_in(const string& column, const vector<Value>& values) {
+  return ExprPtr(new InList(column, values));
+}
+
+// low <= column <= high
+ExprPtr make_between(const string& column, const Value& low, const Value& high) {
+  return make_and({make_comparison(column, CompareOp::GE, low), make_comparison(column, CompareOp::LE, high)});
+}
+
+class Pipeline;
+
+/**
+ * One streaming operator's work on a batch, as run inside a Pipeline. Every
+ * worker gets its own stage, so a stage can keep scratch space unlocked.
+ */
+class PipelineStage {
+  public:
+    virtual ~PipelineStage() = default;
+
+    // Replaces batch with the rows this step produces from it, possibly none
+    virtual void process(RowBatch& batch) = 0;
+};
+
+/**
+ * Note, all the init method of an iterator must be called before it is used
+ * Behavior is undefined if you call an iterator class without calling init first
+ */
+class Iterator {
+  public:
+
+    virtual ~Iterator() = default;
+
+    virtual void init() {
+      for (std::unique_ptr<Iterator>& input : inputs) {
+        input->init();
+      }
+    }
+
+    virtual void close() {
+      for (std::unique_ptr<Iterator>& input : inputs) {
+        input->close();
+      }
+    }
+
+    virtual std::unique_ptr<RowTuple> get_next_ptr() = 0;
+
+    /**
+     * Fills batch with up to BATCH_SIZE rows and returns false once the input
+     * is exhausted. This default drains get_next_ptr() so that row-at-a-time
+     * operators can still feed batch consumers.
+     */
+    virtual bool get_next_batch(RowBatch& batch) {
+      batch.clear();
+      std::unique_ptr<RowTuple> tuple;
+      while (!batch.is_full() && (tuple = get_next_ptr()) != nullptr) {
+        if (batch.size() == 0 && batch.get_schema() != tuple->get_schema()) {
+          batch.reset(tuple->get_schema());
+        }
+        batch.append_row(*tuple);
+      }
+      return batch.size() > 0;
+    }
+
+    /**
+     * Asks this iterator to produce only the given columns, in that order.
+     * Must be called before init(). Returns false if the iterator cannot
+     * narrow its output, in which case the caller has to project itself.
+     */
+    virtual bool push_down_projection(const vector<string>& columns) {
+      return false;
+    }
+
+    /**
+     * Offers a filter over this iterator's output columns. The iterator may
+     * then drop rows the filter rejects, e.g. whole blocks ruled out by their
+     * zone maps, but the caller still has to apply the filter itself. Must be
+     * called before init(). An iterator that returns true binds the filter to
+     * its output schema in init().
+     */
+    virtual bool push_down_filter(const ExprPtr& filter) {
+      return false;
+    }
+
+    /**
+     * Morsel-driven execution, see Pipeline. A scan that can be read in
+     * independent pieces splits its input into morsels, sets schema to the
+     * schema of its batches and returns true. Called after init(), after
+     * which read_morsel may run on several threads at once, each reading a
+     * different morsel and passing every batch of it to emit.
+     */
+    virtual bool split_into_morsels(ThreadPool& pool, SchemaPtr& schema, size_t& num_morsels) {
+      return false;
+    }
+
+    virtual void read_morsel(size_t morsel, const std::function<void(RowBatch&)>& emit) {
+      throw std::runtime_error("Iterator cannot be read in morsels");
+    }
+
+    /**
+     * A streaming operator returns a stage doing its work on batches of
+     * input_schema, and sets output_schema to the schema of the batches the
+     * stage produces. Called after init(), once per worker. Returns nullptr
+     * if the operator has to see its input in order.
+     */
+    virtual unique_ptr<PipelineStage> make_pipeline_stage(const SchemaPtr& input_schema, SchemaPtr& output_schema) {
+      return nullptr;
+    }
+
+    /**
+     * A pipeline breaker that can keep partial state per worker reads the
+     * given input through pipeline instead of pulling it, then merges the
+     * partial states. Must be called before init(). Returns false if the
+     * operator pulls that input itself.
+     */
+    virtual bool set_pipeline(size_t input, std::shared_ptr<Pipeline> pipeline) {
+      return false;
+    }
+
+    const vector<unique_ptr<Iterator>>& get_inputs() const {
+      return inputs;
+    }
+
+    void set_inputs(vector<unique_ptr<Iterator>> inputs) {
+      this->inputs = std::move(inputs);
+    }
+
+    void append_input(unique_ptr<Iterator> new_input) {
+      inputs.push_back(std::move(new_input));
+    }
+
+  protected:
+    vector<unique_ptr<Iterator>> inputs; //inputs = some other vector -> assignment op
+};
+
+/**
+ * Base for operators that work natively on RowBatches. get_next_ptr() hands
+ * out rows from an internal batch so row-at-a-time parents still work.
+ */
+class BatchIterator : public Iterator {
+  public:
+
+    void init() {
+      Iterator::init();
+      row_buffer.clear();
+      row_position = 0;
+    }
+
+    void close() {
+      Iterator::close();
+      row_buffer.clear();
+      row_position = 0;
+    }
+
+    std::unique_ptr<RowTuple> get_next_ptr() {
+      if (row_position >= row_buffer.size()) {
+        if (!get_next_batch(row_buffer)) {
+          return nullptr;
+        }
+        row_position = 0;
+      }
+      return row_buffer.get_row(row_position++);
+    }
+
+    virtual bool get_next_batch(RowBatch& batch) = 0;
+
+  private:
+    RowBatch row_buffer;
+    size_t row_position = 0;
+};
+
+/**
+ * A chain of streaming operators over a morsel source, feeding one input of
+ * a pipeline breaker. The chain is given from the breaker's input down to
+ * the source. run() hands the source's morsels to the workers of a
+ * work-stealing ThreadPool; each worker pushes the batches of its morsel
+ * through its own stage of every operator and passes the result on along
+ * with its worker index, so the breaker can keep one partial state per
+ * worker without locking.
+ */
+class Pipeline {
+  public:
+    Pipeline(std::shared_ptr<ThreadPool> pool, vector<Iterator*> chain)
+      : pool(std::move(pool)), chain(std::move(chain)) {}
+
+    size_t num_workers() const {
+      return pool->size();
+    }
+
+    ThreadPool& get_pool() {
+      return *pool;
+    }
+
+    /**
+     * Splits the source and sets up the stages, once the chain is
+     * initialized. Returns the schema of the batches run() produces, or
+     * nullptr if the source cannot be split or an operator cannot stream,
+     * in which case the breaker has to pull its input as usual.
+     */
+    SchemaPtr open() {
+      stages.clear();
+      num_morsels = 0;
+      SchemaPtr schema;
+      if (!chain.back()->split_into_morsels(*pool, schema, num_morsels)) {
+        return nullptr;
+      }
+      stages.resize(num_workers());
+      for (size_t i = chain.size() - 1; i-- > 0;) {
+        SchemaPtr input_schema = schema;
+        for (size_t w = 0; w < num_workers(); w++) {
+          unique_ptr<PipelineStage> stage = chain[i]->make_pipeline_stage(input_schema, schema);
+          if (stage == nullptr) {
+            stages.clear();
+            return nullptr;
+          }
+          stages[w].push_back(std::move(stage));
+        }
+      }
+      return schema;
+    }
+
+    // consume may take the batch's contents. Calls with the same worker
+    // index never overlap.
+    void run(const std::function<void(size_t, RowBatch&)>& consume) {
+      vector<std::future<void>> tasks;
+      for (size_t m = 0; m < num_morsels; m++) {
+        tasks.push_back(pool->submit([this, m, &consume]() {
+          size_t worker = pool->worker_index();
+          chain.back()->read_morsel(m, [this, worker, &consume](RowBatch& batch) {
+            for (auto& stage : stages[worker]) {
+              if (batch.size() == 0) {
+                return;
+              }
+              stage->process(batch);
+            }
+            if (batch.size() > 0) {
+              consume(worker, batch);
+            }
+          });
+        }));
+      }
+      wait_for_all(tasks);
+    }
+
+  private:
+    std::shared_ptr<ThreadPool> pool;
+    vector<Iterator*> chain;
+    size_t num_morsels = 0;
+    // Per worker, the stages from the source up
+    vector<vector<unique_ptr<PipelineStage>>> stages;
+};
+
+class FileScan : public BatchIterator {
+  public:
+
+    FileScan() {}
+
+    FileScan(string file_path) : file_path(file_path) {}
+
+    ~FileScan() {
+      close_csv_file();
+    }
+
+    /**
+     * Parse the file on num_threads threads. The mapped file is split into
+     * byte ranges that are moved forward to row boundaries, and each range is
+     * parsed into batches by the pool. With preserve_order false, batches
+     * come back in whatever order the ranges finish.
+     * Inputs that cannot be memory mapped are always read on one thread.
+     */
+    void set_parallelism(size_t num_threads, bool preserve_order = true) {
+      this->num_threads = std::max<size_t>(num_threads, 1);
+      this->preserve_order = preserve_order;
+    }
+
+    // Columns given an explicit type here skip inference
+    void set_column_type(const string& column, ColumnType type) {
+      explicit_types[column] = type;
+    }
+
+    void set_schema(const vector<Column>& columns) {
+      for (const auto& column : columns) {
+        set_column_type(column.name, column.type);
+      }
+    }
+
+    /**
+     * When on (the default), the types of columns without an explicit type
+     * are guessed from the first type_sample_rows rows, then checked against
+     * every other row before the scan starts. A column with a value that does
+     * not fit is widened, INT64 to DOUBLE and anything else to STRING. Inputs
+     * that cannot be memory mapped are not sampled, so their columns stay
+     * STRING.
+     */
+    void set_infer_types(bool infer_types) {
+      this->infer_types = infer_types;
+    }
+
+    /**
+     * Dictionary encoded string columns intern each distinct value once per
+     * scan and hold 32-bit codes. Inferred STRING columns with at most one
+     * distinct value per four sampled rows are encoded unless turned off here.
+     * A column with more distinct values than its dictionary holds, which the
+     * sample can miss, goes back to plain strings once the dictionary is full.
+     */
+    void set_dictionary_encoding(const string& column, bool encode) {
+      explicit_dictionary[column] = encode;
+    }
+
+    // Only these columns are parsed and stored, in this order. Empty means all.
+    void set_projection(const vector<string>& columns) {
+      projected_columns = columns;
+    }
+
+    bool push_down_projection(const vector<string>& columns) {
+      for (size_t i = 0; i < columns.size(); i++) {
+        if (std::find(columns.begin() + i + 1, columns.end(), columns[i]) != columns.end()) {
+          return false;
+        }
+      }
+      set_projection(columns);
+      return true;
+    }
+
+    /**
+     * Memory mapped inputs parse only the filter's columns of each row first.
+     * Rows the filter rejects are dropped without parsing or copying any
+     * other field, rows that pass are split again and parsed in full.
+     */
+    bool push_down_filter(const ExprPtr& filter) {
+      this->filter = filter;
+      return true;
+    }
+
+    // Morsels are byte ranges of about morsel_size starting on row
+    // boundaries. Streamed inputs, and scans already parsing on their own
+    // threads, are only read in order.
+    bool split_into_morsels(ThreadPool& pool, SchemaPtr& schema, size_t& num_morsels) {
+      if (!reader_open || !chunks.empty()) {
+        return false;
+      }
+      size_t data_size = reader.size - reader.pos;
+      morsels = split_at_rows(std::max<size_t>(1, data_size / morsel_size), pool);
+      schema = this->schema;
+      num_morsels = morsels.size();
+      return true;
+    }
+
+    void read_morsel(size_t morsel, const std::function<void(RowBatch&)>& emit) {
+      const Chunk& range = morsels[morsel];
+      parse_csv_range(reader.data + range.begin, range.end - range.begin, schema, *field_map, filter_layout,
+                      file_path, emit);
+    }
+
+    void init() {
+      cout << "File scan Init method" << endl;
+      BatchIterator::init();
+
+      // Only the header is read here, rows are parsed as they are pulled
+      close_csv_file();
+      open_csv_file();
+    }
+
+    void close() {
+      cout << "File Scan Closed Called" << endl;
+      BatchIterator::close();
+
+      close_csv_file();
+      schema = nullptr;
+    }
+
+    // Parses at most one batch worth of rows per call, so memory use does not
+    // depend on the size of the file
+    bool get_next_batch(RowBatch& batch) {
+      if (!chunks.empty()) {
+        return get_next_parallel_batch(batch);
+      }
+      if (filtered_reader != nullptr) {
+        batch.reset(schema);
+        while (batch.size() == 0 && !file_done) {
+          file_done = !filtered_reader->read(batch);
+        }
+        return batch.size() > 0;
+      }
+      batch.reset(schema);
+      while (!batch.is_full() && !file_done) {
+        read_csv_row(batch);
+      }
+      return batch.size() > 0;
+    }
+
+  private:
+    // Byte range of the mapped file, starting and ending on row boundaries
+    struct Chunk {
+      size_t begin;
+      size_t end;
+    };
+
+    // Where a pushed down filter's columns are in the CSV rows
+    struct FilterLayout {
+      ExprPtr filter;
+      // CSV field and output ordinal of each filter column
+      vector<size_t> fields;
+      vector<size_t> ordinals;
+      // field_map without the filter columns
+      vector<int> other_fields;
+    };
+
+    /**
+     * Reads rows of a mapped CSV through a filter. A batch worth of rows gets
+     * its filter columns parsed and tested together; only rows that pass are
+     * split again from their recorded offsets to fill in the other columns.
+     */
+    class FilteredReader {
+      public:
+        FilteredReader(csv_mmap* source, std::shared_ptr<const FilterLayout> layout, string path)
+          : source(source), layout(std::move(layout)), path(std::move(path)) {
+          csv_mmap_view(&row_view, source->data, source->size);
+        }
+
+        ~FilteredReader() {
+          csv_mmap_close(&row_view);
+        }
+
+        FilteredReader(const FilteredReader&) = delete;
+        FilteredReader& operator=(const FilteredReader&) = delete;
+
+        // Appends the rows that pass among the next BATCH_SIZE to batch.
+        // Returns false once the input is exhausted.
+        bool read(RowBatch& batch) {
+          candidates.reset(batch.get_schema());
+          offsets.clear();
+          bool more = true;
+          while (!candidates.is_full()) {
+            size_t offset = source->pos;
+            int num_fields = csv_mmap_next_row(source);
+            if (num_fields < 0) {
+              throw std::runtime_error("Error parsing csv file: " + path);
+            }
+            if (num_fields == 0) {
+              more = false;
+              break;
+            }
+            if (num_fields == 1 && source->fields[0].len == 0) {
+              continue;
+            }
+            for (size_t i = 0; i < layout->fields.size(); i++) {
+              size_t field = layout->fields[i];
+              std::string_view text;
+              if (field < (size_t) num_fields) {
+                text = std::string_view(source->fields[field].data, source->fields[field].len);
+              }
+              candidates.get_column(layout->ordinals[i]).append_text(text);
+            }
+            candidates.set_size(candidates.size() + 1);
+            offsets.push_back(offset);
+          }
+
+          selection.resize(candidates.size());
+          for (size_t i = 0; i < selection.size(); i++) {
+            selection[i] = (uint32_t) i;
+          }
+          layout->filter->filter(candidates, selection);
+          for (uint32_t row : selection) {
+            for (size_t ordinal : layout->ordinals) {
+              batch.get_column(ordinal).append_from(candidates.get_column(ordinal), row);
+            }
+            row_view.pos = offsets[row];
+            int num_fields = csv_mmap_next_row(&row_view);
+            fields.clear();
+            for (int i = 0; i < num_fields; i++) {
+              fields.emplace_back(row_view.fields[i].data, row_view.fields[i].len);
+            }
+            append_csv_row(batch, fields, layout->other_fields);
+          }
+          return more;
+        }
+
+      private:
+        csv_mmap* source;
+        std::shared_ptr<const FilterLayout> layout;
+        string path;
+        // Second reader over the same bytes, for splitting passing rows again
+        csv_mmap row_view;
+        RowBatch candidates;
+        vector<size_t> offsets;
+        SelectionVector selection;
+        vector<std::string_view> fields;
+    };
+
+    size_t num_threads = 1;
+    bool preserve_order = true;
+    std::unique_ptr<ThreadPool> pool;
+    vector<Chunk> chunks;
+    size_t next_chunk = 0;
+    vector<Chunk> morsels;
+    const size_t morsel_size = 1 << 18;
+    // Bounded so a large file is never parsed much ahead of the consumer
+    std::deque<std::future<vector<RowBatch>>> chunks_in_flight;
+    vector<RowBatch> parsed_batches;
+    size_t parsed_position = 0;
+    const size_t min_chunk_size = 1 << 20;
+    unordered_map<string, ColumnType> explicit_types;
+    unordered_map<string, bool> explicit_dictionary;
+    bool infer_types = true;
+    vector<string> projected_columns;
+    // Output ordinal of each CSV field, -1 for fields that are skipped
+    std::shared_ptr<const vector<int>> field_map;
+    const size_t type_sample_rows = 1000;
+    ExprPtr filter;
+    std::shared_ptr<const FilterLayout> filter_layout;
+    unique_ptr<FilteredReader> filtered_reader;
+
+    // Regular files are memory mapped. Anything that cannot be mapped (pipes,
+    // /dev/stdin) falls back to a buffered csv_reader.
+    csv_mmap reader;
+    bool reader_open = false;
+    FILE* stream_fp = nullptr;
+    std::unique_ptr<csv_reader> stream_reader;
+    bool stream_done = false;
+    // Splits each streamed line in place, reusing one field array
+    csv_mmap line_view;
+    bool line_view_open = false;
+    vector<std::string_view> fields;
+    bool file_done = true;
+    SchemaPtr schema;
+    const unsigned int max_csv_line_size = 100000;
+    string file_path = ""; // should be absolute path
+
+    void open_csv_file() {
+      if (csv_mmap_open(&reader, this->file_path.c_str()) == 0) {
+        reader_open = true;
+      }
+      else {
+        open_csv_stream();
+      }
+      file_done = false;
+      process_csv_headers();
+      if (reader_open && num_threads > 1) {
+        split_into_chunks();
+        schedule_chunks();
+      } else if (reader_open && filter_layout != nullptr) {
+        filtered_reader = unique_ptr<FilteredReader>(new FilteredReader(&reader, filter_layout, file_path));
+      }
+    }
+
+    void split_into_chunks() {
+      size_t data_size = reader.size - reader.pos;
+      if (data_size == 0) {
+        return;
+      }
+      size_t num_chunks = std::max<size_t>(1, std::min(num_threads * 4, data_size / min_chunk_size));
+      chunks = split_at_rows(num_chunks, get_pool());
+      next_chunk = 0;
+      file_done = true;
+    }
+
+    // Cuts the rows after the header into about num_chunks ranges
+    vector<Chunk> split_at_rows(size_t num_chunks, ThreadPool& pool) {
+      vector<Chunk> ranges;
+      size_t data_start = reader.pos;
+      size_t data_size = reader.size - data_start;
+      if (data_size == 0) {
+        return ranges;
+      }
+      size_t chunk_size = data_size / num_chunks;
+      // Dispatch is chosen before any worker can race to initialize it
+      csv_simd_level();
+
+      // Quote parity up to each nominal split tells whether it lands inside a
+      // quoted field, so the quote counts are gathered in parallel first
+      vector<std::future<size_t>> quote_counts;
+      for (size_t i = 0; i < num_chunks; i++) {
+        size_t begin = data_start + i * chunk_size;
+        size_t end = (i + 1 == num_chunks) ? reader.size : begin + chunk_size;
+        const char* data = reader.data;
+        quote_counts.push_back(pool.submit([data, begin, end]() {
+          return csv_count_quotes(data + begin, end - begin);
+        }));
+      }
+
+      size_t quotes_before = 0;
+      size_t prev_start = data_start;
+      for (size_t i = 1; i <= num_chunks; i++) {
+        quotes_before += quote_counts[i - 1].get();
+        size_t start = reader.size;
+        if (i < num_chunks) {
+          start = csv_find_row_start(reader.data, reader.size, data_start + i * chunk_size, (int) (quotes_before & 1));
+        }
+        if (start > prev_start) {
+          ranges.push_back({prev_start, start});
+          prev_start = start;
+        }
+      }
+      return ranges;
+    }
+
+    ThreadPool& get_pool() {
+      if (pool == nullptr || pool->size() != num_threads) {
+        pool = std::unique_ptr<ThreadPool>(new ThreadPool(num_threads));
+      }
+      return *pool;
+    }
+
+    // Keeps up to two chunks per thread parsing ahead of the consumer
+    void schedule_chunks() {
+      while (next_chunk < chunks.size() && chunks_in_flight.size() < num_threads * 2) {
+        Chunk chunk = chunks[next_chunk++];
+        const char* data = reader.data;
+        SchemaPtr chunk_schema = schema;
+        std::shared_ptr<const vector<int>> chunk_field_map = field_map;
+        std::shared_ptr<const FilterLayout> chunk_filter = filter_layout;
+        string path = file_path;
+        chunks_in_flight.push_back(get_pool().submit([data, chunk, chunk_schema, chunk_field_map, chunk_filter, path]() {
+          return parse_csv_chunk(data + chunk.begin, chunk.end - chunk.begin, chunk_schema, *chunk_field_map,
+                                 chunk_filter, path);
+        }));
+      }
+    }
+
+    bool get_next_parallel_batch(RowBatch& batch) {
+      while (parsed_position >= parsed_batches.size()) {
+        if (chunks_in_flight.empty()) {
+          return false;
+        }
+        auto ready = chunks_in_flight.begin();
+        if (!preserve_order) {
+          // Take any finished chunk, only blocking on the oldest one
+          for (auto it = chunks_in_flight.begin(); it != chunks_in_flight.end(); it++) {
+            if (it->wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+              ready = it;
+              break;
+            }
+          }
+        }
+        std::future<vector<RowBatch>> result = std::move(*ready);
+        chunks_in_flight.erase(ready);
+        parsed_batches = result.get();
+        parsed_position = 0;
+        schedule_chunks();
+      }
+      std::swap(batch, parsed_batches[parsed_position++]);
+      return true;
+    }
+
+    // Runs on a pool thread, with its own reader over the chunk's bytes
+    static vector<RowBatch> parse_csv_chunk(const char* data, size_t size, SchemaPtr schema,
+        const vector<int>& field_map, std::shared_ptr<const FilterLayout> filter_layout, string path) {
+      vector<RowBatch> batches;
+      parse_csv_range(data, size, schema, field_map, filter_layout, path, [&batches](RowBatch& batch) {
+        batches.push_back(std::move(batch));
+      });
+      return batches;
+    }
+
+    // Parses the rows in [data, data + size), passing each batch to emit,
+    // which may take its contents
+    static void parse_csv_range(const char* data, size_t size, const SchemaPtr& schema, const vector<int>& field_map,
+        const std::shared_ptr<const FilterLayout>& filter_layout, const string& path,
+        const std::function<void(RowBatch&)>& emit) {
+      vector<std::string_view> fields;
+      RowBatch batch;
+      batch.reset(schema);
+      csv_mmap view;
+      csv_mmap_view(&view, data, size);
+      try {
+        if (filter_layout != nullptr) {
+          FilteredReader filtered(&view, filter_layout, path);
+          bool more = true;
+          while (more) {
+            more = filtered.read(batch);
+            if (batch.size() > 0) {
+              emit(batch);
+              batch.reset(schema);
+            }
+          }
+          csv_mmap_close(&view);
+          return;
+        }
+
+        int num_fields;
+        while ((num_fields = csv_mmap_next_row(&view)) != 0) {
+          if (num_fields < 0) {
+            throw std::runtime_error("Error parsing csv file: " + path);
+          }
+          fields.clear();
+          for (int i = 0; i < num_fields; i++) {
+            fields.emplace_back(view.fields[i].data, view.fields[i].len);
+          }
+          append_csv_row(batch, fields, field_map);
+          if (batch.is_full()) {
+            emit(batch);
+            batch.reset(schema);
+          }
+        }
+        if (batch.size() > 0) {
+          emit(batch);
+        }
+      } catch (...) {
+        csv_mmap_close(&view);
+        throw;
+      }
+      csv_mmap_close(&view);
+    }
+
+    void open_csv_stream() {
+      stream_fp = std::fopen(this->file_path.c_str(), "r");
+      if (stream_fp == nullptr) {
+        throw std::runtime_error("Failed to open csv file at path: " + this->file_path);
+      }
+      csv_mmap_view(&line_view, nullptr, 0);
+      line_view_open = true;
+      stream_reader = std::unique_ptr<csv_reader>(new csv_reader());
+      if (csv_reader_init(stream_reader.get(), stream_fp, max_csv_line_size) != 0) {
+        throw std::runtime_error("Failed to allocate csv reader for: " + this->file_path);
+      }
+      stream_done = false;
+    }
+
+    void close_csv_file() {
+      // Workers read straight from the mapping, so let them finish first
+      for (auto& in_flight : chunks_in_flight) {
+        in_flight.wait();
+      }
+      chunks_in_flight.clear();
+      chunks.clear();
+      morsels.clear();
+      filtered_reader = nullptr;
+      parsed_batches.clear();
+      parsed_position = 0;
+      if (reader_open) {
+        csv_mmap_close(&reader);
+        reader_open = false;
+      }
+      if (line_view_open) {
+        csv_mmap_close(&line_view);
+        line_view_open = false;
+      }
+      if (stream_reader != nullptr) {
+        csv_reader_free(stream_reader.get());
+        stream_reader = nullptr;
+      }
+      if (stream_fp != nullptr) {
+        std::fclose(stream_fp);
+        stream_fp = nullptr;
+      }
+      fields.clear();
+      file_done = true;
+    }
+
+    // Fills fields with the next row and returns how many there are, 0 at the
+    // end of the file. The views stay valid until the next call.
+    int read_csv_fields() {
+      fields.clear();
+      if (reader_open) {
+        int num_fields = csv_mmap_next_row(&reader);
+        if (num_fields < 0) {
+          throw std::runtime_error("Error parsing csv file: " + this->file_path);
+        }
+        for (int i = 0; i < num_fields; i++) {
+          fields.emplace_back(reader.fields[i].data, reader.fields[i].len);
+        }
+        return num_fields;
+      }
+
+      if (stream_done) {
+        return 0;
+      }
+      int done = 0;
+      int err = 0;
+      char* csv_line = csv_reader_next_line(stream_reader.get(), &done, &err);
+      if (csv_line == nullptr) {
+        throw std::runtime_error("Failed to process csv data: " + this->file_path);
+      }
+      // The last line may not be newline terminated
+      stream_done = done;
+      if (done && csv_line[0] == '\0') {
+        return 0;
+      }
+      // Fields are views into the reader's line buffer, nothing is allocated
+      // per field. A blank line is one empty field, like parse_csv gives.
+      line_view.data = csv_line;
+      line_view.size = strlen(csv_line);
+      line_view.pos = 0;
+      int num_fields = csv_mmap_next_row(&line_view);
+      if (num_fields < 0) {
+        throw std::runtime_error("Error parsing csv file: " + this->file_path);
+      }
+      if (num_fields == 0) {
+        fields.emplace_back();
+      }
+      for (int i = 0; i < num_fields; i++) {
+        fields.emplace_back(line_view.fields[i].data, line_view.fields[i].len);
+      }
+      return (int) fields.size();
+    }
+
+    // Appends the next row of the file to batch, if there is one
+    void read_csv_row(RowBatch& batch) {
+      int num_fields = read_csv_fields();
+      if (num_fields == 0) {
+        file_done = true;
+        return;
+      }
+      append_csv_row(batch, fields, *field_map);
+    }
+
+    static void append_csv_row(RowBatch& batch, const vector<std::string_view>& fields, const vector<int>& field_map) {
+      if (fields.size() == 1 && fields[0].empty()) {
+        // Blank line
+        return;
+      }
+
+      // Fields outside the projection are never parsed or copied
+      size_t num_fields = std::min(fields.size(), field_map.size());
+      for (size_t i = 0; i < num_fields; i++) {
+        if (field_map[i] >= 0) {
+          batch.get_column((size_t) field_map[i]).append_text(fields[i]);
+        }
+      }
+      if (num_fields < field_map.size()) {
+        // Short rows are padded so every row matches the header layout
+        for (size_t i = 0; i < batch.num_columns(); i++) {
+          if (batch.get_column(i).size() == batch.size()) {
+            batch.get_column(i).append_text("");
+          }
+        }
+      }
+      batch.set_size(batch.size() + 1);
+    }
+
+    void process_csv_headers() {
+      int num_fields = read_csv_fields();
+      if (num_fields == 0) {
+        throw std::runtime_error("CSV has no data at path: " + this->file_path);
+      }
+
+      vector<string> names;
+      for (int i = 0; i < num_fields; i++) {
+        names.push_back(string(fields[i]));
+      }
+      vector<bool> low_cardinality(names.size(), false);
+      vector<ColumnType> types = infer_column_types(names.size(), low_cardinality);
+
+      vector<string> output_columns = projected_columns.empty() ? names : projected_columns;
+      auto new_field_map = std::make_shared<vector<int>>(names.size(), -1);
+
+      // Built once here and shared by every row this scan produces
+      auto new_schema = std::make_shared<Schema>();
+      for (const auto& column : output_columns) {
+        auto field = std::find(names.begin(), names.end(), column);
+        if (field == names.end()) {
+          throw std::runtime_error("Column " + column + " not found in csv file: " + this->file_path);
+        }
+        size_t field_index = (size_t) (field - names.begin());
+        (*new_field_map)[field_index] = (int) new_schema->size();
+        auto it = explicit_types.find(column);
+        ColumnType type = it != explicit_types.end() ? it->second : types[field_index];
+        auto encode = explicit_dictionary.find(column);
+        bool use_dictionary = encode != explicit_dictionary.end() ? encode->second : low_cardinality[field_index];
+        new_schema->add_column(column, type,
+            type == ColumnType::STRING && use_dictionary ? std::make_shared<StringDictionary>() : nullptr);
+      }
+      schema = std::move(new_schema);
+      field_map = std::move(new_field_map);
+      filter_layout = nullptr;
+      if (filter != nullptr) {
+        filter_layout = build_filter_layout();
+      }
+    }
+
+    // Binds the filter here, before any worker can use it
+    std::shared_ptr<const FilterLayout> build_filter_layout() {
+      filter->bind(*schema);
+      auto layout = std::make_shared<FilterLayout>();
+      layout->filter = filter;
+      layout->other_fields = *field_map;
+      vector<string> columns;
+      filter->collect_columns(columns);
+      for (const auto& column : columns) {
+        size_t ordinal = (size_t) schema->get_ordinal(column);
+        if (std::find(layout->ordinals.begin(), layout->ordinals.end(), ordinal) != layout->ordinals.end()) {
+          continue;
+        }
+        size_t field = (size_t) (std::find(field_map->begin(), field_map->end(), (int) ordinal) - field_map->begin());
+        layout->fields.push_back(field);
+        layout->ordinals.push_back(ordinal);
+        layout->other_fields[field] = -1;
+      }
+      return layout;
+    }
+
+    // Picks the narrowest type every sampled non-empty value parses as, and
+    // flags the columns that repeat values enough to dictionary encode
+    vector<ColumnType> infer_column_types(size_t num_columns, vector<bool>& low_cardinality) {
+      vector<ColumnType> types(num_columns, ColumnType::STRING);
+      if (!infer_types || !reader_open) {
+        return types;
+      }
+      vector<std::unordered_set<string>> distinct_values(num_columns);
+      size_t sampled_rows = 0;
+      vector<bool> can_be_int(num_columns, true);
+      vector<bool> can_be_double(num_columns, true);
+      vector<bool> can_be_timestamp(num_columns, true);
+      vector<bool> seen_value(num_columns, false);
+
+      // Sample through a separate view so the scan position is untouched
+      csv_mmap sample;
+      csv_mmap_view(&sample, reader.data + reader.pos, reader.size - reader.pos);
+      int num_fields;
+      for (size_t row = 0; row < type_sample_rows && (num_fields = csv_mmap_next_row(&sample)) > 0; row++) {
+        sampled_rows++;
+        for (size_t i = 0; i < num_columns && i < (size_t) num_fields; i++) {
+          std::string_view text(sample.fields[i].data, sample.fields[i].len);
+          if (distinct_values[i].size() <= type_sample_rows / 4) {
+            distinct_values[i].emplace(text);
+          }
+          if (trim_spaces(text).empty()) {
+            continue;
+          }
+          seen_value[i] = true;
+          int64_t int_val;
+          double double_val;
+          can_be_int[i] = can_be_int[i] && parse_int64(text, int_val);
+          can_be_double[i] = can_be_double[i] && parse_double(text, double_val);
+          can_be_timestamp[i] = can_be_timestamp[i] && parse_timestamp(text, int_val);
+        }
+      }
+      size_t sample_end = reader.pos + sample.pos;
+      csv_mmap_close(&sample);
+
+      for (size_t i = 0; i < num_columns; i++) {
+        if (!seen_value[i]) {
+          continue;
+        }
+        if (can_be_int[i]) {
+          types[i] = ColumnType::INT64;
+        }
+        else if (can_be_double[i]) {
+          types[i] = ColumnType::DOUBLE;
+        }
+        else if (can_be_timestamp[i]) {
+          types[i] = ColumnType::TIMESTAMP;
+        }
+        else {
+          low_cardinality[i] = distinct_values[i].size() * 4 <= sampled_rows;
+        }
+      }
+      widen_to_fit(types, sample_end);
+      return types;
+    }
+
+    // Widens the inferred types until every row from offset on fits them. The
+    // rows are checked on the scan's threads when it has more than one.
+    void widen_to_fit(vector<ColumnType>& types, size_t offset) {
+      if (offset >= reader.size || std::all_of(types.begin(), types.end(), [](ColumnType type) {
+            return type == ColumnType::STRING;
+          })) {
+        return;
+      }
+      if (num_threads == 1) {
+        widen_range(reader.data + offset, reader.size - offset, types);
+        return;
+      }
+      // The ranges also cover the sampled rows, which always fit
+      vector<std::future<vector<ColumnType>>> checks;
+      for (const Chunk& range : split_at_rows(num_threads, get_pool())) {
+        const char* data = reader.data;
+        checks.push_back(get_pool().submit([data, range, types]() {
+          vector<ColumnType> range_types = types;
+          widen_range(data + range.begin, range.end - range.begin, range_types);
+          return range_types;
+        }));
+      }
+      for (auto& check : checks) {
+        vector<ColumnType> range_types = check.get();
+        for (size_t i = 0; i < types.size(); i++) {
+          types[i] = wider_type(types[i], range_types[i]);
+        }
+      }
+    }
+
+    static ColumnType wider_type(ColumnType a, ColumnType b) {
+      if (a == b) {
+        return a;
+      }
+      bool numbers = (a == ColumnType::INT64 || a == ColumnType::DOUBLE) && (b == ColumnType::INT64 || b == ColumnType::DOUBLE);
+      return numbers ? ColumnType::DOUBLE : ColumnType::STRING;
+    }
+
+    static void widen_range(const char* data, size_t size, vector<ColumnType>& types) {
+      csv_mmap view;
+      csv_mmap_view(&view, data, size);
+      size_t typed_columns = 0;
+      for (ColumnType type : types) {
+        typed_columns += type != ColumnType::STRING;
+      }
+      int num_fields;
+      while (typed_columns > 0 && (num_fields = csv_mmap_next_row(&view)) > 0) {
+        for (size_t i = 0; i < types.size() && i < (size_t) num_fields; i++) {
+          if (types[i] == ColumnType::STRING) {
+            continue;
+          }
+          std::string_view text(view.fields[i].data, view.fields[i].len);
+          int64_t int_val;
+          double double_val;
+          bool fits = trim_spaces(text).empty();
+          switch (types[i]) {
+            case ColumnType::INT64:
+              fits = fits || parse_int64(text, int_val);
+              if (!fits && parse_double(text, double_val)) {
+                types[i] = ColumnType::DOUBLE;
+                fits = true;
+              }
+              break;
+            case ColumnType::DOUBLE:
+              fits = fits || parse_double(text, double_val);
+              break;
+            default:
+              fits = fits || parse_timestamp(text, int_val);
+          }
+          if (!fits) {
+            types[i] = ColumnType::STRING;
+            typed_columns--;
+          }
+        }
+      }
+      csv_mmap_close(&view);
+    }
+};
+
+/**
+ * Binary columnar table files, written by ColumnarWriter and read by
+ * ColumnarScan. All integers are little endian.
+ *
+ *   "BDBCOL01"
+ *   column segments, each starting on an 8 byte boundary
+ *   footer: the schema, then for each row group its row count and, per
+ *           column, the segment's offset, size, encoding and min/max
+ *   u64 footer offset, "BDBCOL01"
+ *
+ * Segment encodings:
+ *   PLAIN  int64 / double: the raw array
+ *          string: u32 offsets[n + 1], then the bytes
+ *   DICT   string only: u32 dict_size, u32 offsets[dict_size + 1], the
+ *          dictionary bytes padded to 4, then u32 codes[n]
+ *   NULLABLE  int64 / double with nulls: the raw array, then u8 nulls[n]
+ *
+ * Min/max cover the non-null values; a segment of only nulls has none.
+ */
+const char COLUMNAR_MAGIC[8] = {'B', 'D', 'B', 'C', 'O', 'L', '0', '1'};
+const size_t COLUMNAR_ROW_GROUP_SIZE = 64 * BATCH_SIZE;
+
+enum class ColumnEncoding : uint8_t { PLAIN = 0, DICT = 1, NULLABLE = 2 };
+
+struct ColumnChunkMeta {
+  uint64_t offset = 0;
+  uint64_t size = 0;
+  ColumnEncoding encoding = ColumnEncoding::PLAIN;
+  bool has_stats = false;
+  Value min;
+  Value max;
+};
+
+struct RowGroupMeta {
+  uint64_t num_rows = 0;
+  vector<ColumnChunkMeta> columns;
+};
+
+/**
+ * Drains an iterator into a columnar file, one row group at a time.
+ */
+class ColumnarWriter {
+  public:
+    ColumnarWriter(string file_path) : file_path(file_path) {}
+
+    ~ColumnarWriter() {
+      if (fp != nullptr) {
+        std::fclose(fp);
+      }
+    }
+
+    // Inits, drains and closes input. Returns the number of rows written.
+    uint64_t write(Iterator& input) {
+      fp = std::fopen(file_path.c_str(), "wb");
+      if (fp == nullptr) {
+        throw std::runtime_error("Failed to open columnar file for writing: " + file_path);
+      }
+      file_pos = 0;
+      total_rows = 0;
+      row_groups.clear();
+      write_bytes(COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC));
+
+      input.init();
+      RowBatch batch;
+      while (input.get_next_batch(batch)) {
+        if (schema == nullptr) {
+          schema = batch.get_schema();
+          start_row_group();
+        }
+        for (size_t i = 0; i < pending.size(); i++) {
+          pending[i].append_all(batch.get_column(i));
+        }
+        pending_rows += batch.size();
+        if (pending_rows >= COLUMNAR_ROW_GROUP_SIZE) {
+          flush_row_group();
+        }
+      }
+      input.close();
+      if (schema == nullptr) {
+        std::fclose(fp);
+        fp = nullptr;
+        throw std::runtime_error("Nothing to write to columnar file: " + file_path);
+      }
+      flush_row_group();
+      write_footer();
+
+      if (std::fclose(fp) != 0) {
+        fp = nullptr;
+        throw std::runtime_error("Failed to write columnar file: " + file_path);
+      }
+      fp = nullptr;
+      return total_rows;
+    }
+
+  private:
+    string file_path;
+    FILE* fp = nullptr;
+    uint64_t file_pos = 0;
+    uint64_t total_rows = 0;
+    SchemaPtr schema;
+    vector<ColumnVector> pending;
+    size_t pending_rows = 0;
+    vector<RowGroupMeta> row_groups;
+
+    void write_bytes(const void* data, size_t size) {
+      if (size > 0 && std::fwrite(data, 1, size, fp) != size) {
+        throw std::runtime_error("Failed to write columnar file: " + file_path);
+      }
+      file_pos += size;
+    }
+
+    template <typename T>
+    void write_value(T val) {
+      write_bytes(&val, sizeof(T));
+    }
+
+    void pad_to(size_t alignment) {
+      static const char zeros[8] = {0};
+      write_bytes(zeros, (alignment - file_pos % alignment) % alignment);
+    }
+
+    void write_string(const string& val) {
+      write_value<uint32_t>((uint32_t) val.size());
+      write_bytes(val.data(), val.size());
+    }
+
+    void start_row_group() {
+      pending.clear();
+      for (const auto& column : schema->get_columns()) {
+        pending.push_back(ColumnVector(column.type, column.dictionary));
+      }
+      pending_rows = 0;
+    }
+
+    void flush_row_group() {
+      if (pending_rows == 0) {
+        return;
+      }
+      RowGroupMeta group;
+      group.num_rows = pending_rows;
+      for (const auto& column : pending) {
+        group.columns.push_back(write_segment(column));
+      }
+      row_groups.push_back(std::move(group));
+      total_rows += pending_rows;
+      start_row_group();
+    }
+
+    ColumnChunkMeta write_segment(const ColumnVector& column) {
+      pad_to(8);
+      ColumnChunkMeta meta;
+      meta.offset = file_pos;
+      size_t num_rows = column.size();
+      meta.has_stats = num_rows > 0;
+
+      switch (column.get_type()) {
+        case ColumnType::INT64:
+        case ColumnType::TIMESTAMP: {
+          const vector<int64_t>& ints = column.get_ints();
+          if (column.has_nulls()) {
+            meta.has_stats = numeric_bounds(column, ints, meta);
+          } else if (meta.has_stats) {
+            auto bounds = std::minmax_element(ints.begin(), ints.end());
+            meta.min = Value::make_int(*bounds.first);
+            meta.max = Value::make_int(*bounds.second);
+          }
+          write_bytes(ints.data(), ints.size() * sizeof(int64_t));
+          write_nulls(column, meta);
+          break;
+        }
+        case ColumnType::DOUBLE: {
+          const vector<double>& doubles = column.get_doubles();
+          if (column.has_nulls()) {
+            meta.has_stats = numeric_bounds(column, doubles, meta);
+          } else if (meta.has_stats) {
+            auto bounds = std::minmax_element(doubles.begin(), doubles.end());
+            meta.min = Value::make_double(*bounds.first);
+            meta.max = Value::make_double(*bounds.second);
+          }
+          write_bytes(doubles.data(), doubles.size() * sizeof(double));
+          write_nulls(column, meta);
+          break;
+        }
+        default: {
+          vector<std::string_view> strings;
+          strings.reserve(column.size());
+          for (size_t row = 0; row < column.size(); row++) {
+            strings.push_back(column.get_string(row));
+          }
+          write_string_segment(strings, meta);
+        }
+      }
+      meta.size = file_pos - meta.offset;
+      return meta;
+    }
+
+    // Bounds of the non-null values, false if there are none
+    template <typename T>
+    static bool numeric_bounds(const ColumnVector& column, const vector<T>& vals, ColumnChunkMeta& meta) {
+      bool found = false;
+      T min = T();
+      T max = T();
+      for (size_t row = 0; row < vals.size(); row++) {
+        if (column.is_null(row)) {
+          continue;
+        }
+        min = found ? std::min(min, vals[row]) : vals[row];
+        max = found ? std::max(max, vals[row]) : vals[row];
+        found = true;
+      }
+      if (found) {
+        meta.min = column.get_type() == ColumnType::DOUBLE ? Value::make_double((double) min) : Value::make_int((int64_t) min);
+        meta.max = column.get_type() == ColumnType::DOUBLE ? Value::make_double((double) max) : Value::make_int((int64_t) max);
+      }
+      return found;
+    }
+
+    void write_nulls(const ColumnVector& column, ColumnChunkMeta& meta) {
+      if (!column.has_nulls()) {
+        return;
+      }
+      meta.encoding = ColumnEncoding::NULLABLE;
+      vector<uint8_t> nulls = column.get_nulls();
+      nulls.resize(column.size(), 0);
+      write_bytes(nulls.data(), nulls.size());
+    }
+
+    // Low-cardinality columns (at most one distinct value per four rows) are
+    // dictionary encoded, everything else is stored plain
+    void write_string_segment(const vector<std::string_view>& strings, ColumnChunkMeta& meta) {
+      unordered_map<std::string_view, uint32_t> codes;
+      vector<std::string_view> dictionary;
+      bool use_dict = true;
+      for (const auto& val : strings) {
+        if (codes.emplace(val, (uint32_t) dictionary.size()).second) {
+          dictionary.push_back(val);
+          if (dictionary.size() > strings.size() / 4) {
+            use_dict = false;
+            break;
+          }
+        }
+      }
+      if (meta.has_stats) {
+        auto bounds = std::minmax_element(strings.begin(), strings.end());
+        meta.min = Value(string(*bounds.first));
+        meta.max = Value(string(*bounds.second));
+      }
+
+      const vector<std::string_view>& values = use_dict ? dictionary : strings;
+      meta.encoding = use_dict ? ColumnEncoding::DICT : ColumnEncoding::PLAIN;
+      if (use_dict) {
+        write_value<uint32_t>((uint32_t) dictionary.size());
+      }
+      uint32_t offset = 0;
+      write_value<uint32_t>(offset);
+      for (const auto& val : values) {
+        offset += (uint32_t) val.size();
+        write_value<uint32_t>(offset);
+      }
+      for (const auto& val : values) {
+        write_bytes(val.data(), val.size());
+      }
+      if (use_dict) {
+        pad_to(4);
+        for (const auto& val : strings) {
+          write_value<uint32_t>(codes[val]);
+        }
+      }
+    }
+
+    void write_stat(ColumnType type, const Value& val) {
+      if (type == ColumnType::STRING) {
+        write_string(val.as_string());
+      }
+      else if (type == ColumnType::DOUBLE) {
+        write_value<double>(val.as_double());
+      }
+      else {
+        write_value<int64_t>(val.as_int());
+      }
+    }
+
+    void write_footer() {
+      pad_to(8);
+      uint64_t footer_offset = file_pos;
+      write_value<uint32_t>((uint32_t) schema->size());
+      for (const auto& column : schema->get_columns()) {
+        write_value<uint8_t>((uint8_t) column.type);
+        write_string(column.name);
+      }
+      write_value<uint32_t>((uint32_t) row_groups.size());
+      for (const auto& group : row_groups) {
+        write_value<uint64_t>(group.num_rows);
+        for (size_t i = 0; i < group.columns.size(); i++) {
+          const ColumnChunkMeta& meta = group.columns[i];
+          write_value<uint64_t>(meta.offset);
+          write_value<uint64_t>(meta.size);
+          write_value<uint8_t>((uint8_t) meta.encoding);
+          write_value<uint8_t>(meta.has_stats ? 1 : 0);
+          if (meta.has_stats) {
+            write_stat(schema->get_column(i).type, meta.min);
+            write_stat(schema->get_column(i).type, meta.max);
+          }
+        }
+      }
+      write_value<uint64_t>(footer_offset);
+      write_bytes(COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC));
+    }
+};
+
+// Converts a CSV file, with its inferred column types, to the columnar format
+uint64_t convert_csv_to_columnar(const string& csv_path, const string& columnar_path) {
+  FileScan scan(csv_path);
+  ColumnarWriter writer(columnar_path);
+  return writer.write(scan);
+}
+
+/**
+ * Reads a file written by ColumnarWriter through a read-only mapping. Values
+ * are copied straight from the mapped segments into the batch columns, no
+ * parsing involved.
+ */
+class ColumnarScan : public BatchIterator {
+  public:
+
+    ColumnarScan() {}
+
+    ColumnarScan(string file_path) : file_path(file_path) {}
+
+    ~ColumnarScan() {
+      unmap_file();
+    }
+
+    void init() {
+      cout << "Columnar scan Init method" << endl;
+      BatchIterator::init();
+      unmap_file();
+      map_file();
+      read_footer();
+      curr_group = 0;
+      row_in_group = 0;
+      skipped_row_groups = 0;
+      if (filter != nullptr) {
+        filter->bind(*schema);
+      }
+    }
+
+    void close() {
+      cout << "Columnar Scan Closed Called" << endl;
+      BatchIterator::close();
+      unmap_file();
+      row_groups.clear();
+      morsels.clear();
+      schema = nullptr;
+    }
+
+    bool get_next_batch(RowBatch& batch) {
+      while (curr_group < row_groups.size()) {
+        if (row_in_group == 0 && filter != nullptr && !filter->might_match(zone_maps(row_groups[curr_group]))) {
+          skipped_row_groups++;
+          row_in_group = row_groups[curr_group].num_rows;
+        }
+        if (row_in_group < row_groups[curr_group].num_rows) {
+          break;
+        }
+        curr_group++;
+        row_in_group = 0;
+      }
+      if (curr_group >= row_groups.size()) {
+        return false;
+      }
+      const RowGroupMeta& group = row_groups[curr_group];
+      size_t num_rows = (size_t) std::min<uint64_t>(BATCH_SIZE, group.num_rows - row_in_group);
+      if (code_maps_group != curr_group) {
+        code_maps.assign(schema->size(), vector<uint32_t>());
+        code_maps_group = curr_group;
+      }
+      batch.reset(schema);
+      for (size_t i = 0; i < schema->size(); i++) {
+        decode_rows(group.columns[file_columns[i]], (size_t) group.num_rows, (size_t) row_in_group,
+                    batch.get_column(i), num_rows, code_maps[i]);
+      }
+      batch.set_size(num_rows);
+      row_in_group += num_rows;
+      return true;
+    }
+
+    void set_projection(const vector<string>& columns) {
+      projected_columns = columns;
+    }
+
+    bool push_down_projection(const vector<string>& columns) {
+      set_projection(columns);
+      return true;
+    }
+
+    // Row groups whose min/max statistics rule the filter out are skipped
+    bool push_down_filter(const ExprPtr& filter) {
+      this->filter = filter;
+      return true;
+    }
+
+    size_t get_skipped_row_groups() const {
+      return skipped_row_groups;
+    }
+
+    // Morsels are runs of up to MORSEL_ROWS rows of one row group. Groups
+    // the filter's zone maps rule out get no morsels at all.
+    bool split_into_morsels(ThreadPool& pool, SchemaPtr& schema, size_t& num_morsels) {
+      morsels.clear();
+      for (size_t g = 0; g < row_groups.size(); g++) {
+        if (filter != nullptr && !filter->might_match(zone_maps(row_groups[g]))) {
+          skipped_row_groups++;
+          continue;
+        }
+        for (uint64_t first = 0; first < row_groups[g].num_rows; first += MORSEL_ROWS) {
+          morsels.push_back({g, first, std::min<uint64_t>(MORSEL_ROWS, row_groups[g].num_rows - first)});
+        }
+      }
+      schema = this->schema;
+      num_morsels = morsels.size();
+      return true;
+    }
+
+    void read_morsel(size_t morsel, const std::function<void(RowBatch&)>& emit) {
+      const Morsel& range = morsels[morsel];
+      const RowGroupMeta& group = row_groups[range.group];
+      vector<vector<uint32_t>> morsel_code_maps(schema->size());
+      RowBatch batch;
+      for (uint64_t first = range.first; first < range.first + range.num_rows; first += BATCH_SIZE) {
+        size_t num_rows = (size_t) std::min<uint64_t>(BATCH_SIZE, range.first + range.num_rows - first);
+        batch.reset(schema);
+        for (size_t i = 0; i < schema->size(); i++) {
+          decode_rows(group.columns[file_columns[i]], (size_t) group.num_rows, (size_t) first,
+                      batch.get_column(i), num_rows, morsel_code_maps[i]);
+        }
+        batch.set_size(num_rows);
+        emit(batch);
+      }
+    }
+
+    const SchemaPtr& get_schema() const {
+      return schema;
+    }
+
+    // Column chunks in each row group are in file column order, see
+    // get_file_column for the file column behind an output ordinal
+    const vector<RowGroupMeta>& get_row_groups() const {
+      return row_groups;
+    }
+
+    size_t get_file_column(size_t ordinal) const {
+      return file_columns[ordinal];
+    }
+
+  private:
+    struct Morsel {
+      size_t group;
+      uint64_t first;
+      uint64_t num_rows;
+    };
+
+    static constexpr uint64_t MORSEL_ROWS = 16 * BATCH_SIZE;
+
+    vector<string> projected_columns;
+    // File column index of each output ordinal, only these are decoded
+    vector<size_t> file_columns;
+    string file_path = "";
+    const char* data = nullptr;
+    size_t size = 0;
+    SchemaPtr schema;
+    vector<RowGroupMeta> row_groups;
+    size_t curr_group = 0;
+    uint64_t row_in_group = 0;
+    ExprPtr filter;
+    size_t skipped_row_groups = 0;
+    // Scan dictionary code of each file dictionary code, per output ordinal,
+    // for the row group code_maps_group
+    vector<vector<uint32_t>> code_maps;
+    size_t code_maps_group = SIZE_MAX;
+    vector<Morsel> morsels;
+
+    // Statistics of the group's chunks, by output ordinal
+    vector<ZoneMap> zone_maps(const RowGroupMeta& group) const {
+      vector<ZoneMap> zones(file_columns.size());
+      for (size_t i = 0; i < file_columns.size(); i++) {
+        const ColumnChunkMeta& meta = group.columns[file_columns[i]];
+        zones[i].has_stats = meta.has_stats;
+        zones[i].min = meta.min;
+        zones[i].max = meta.max;
+      }
+      return zones;
+    }
+
+    void map_file() {
+      int fd = open(file_path.c_str(), O_RDONLY);
+      if (fd < 0) {
+        throw std::runtime_error("Failed to open columnar file at path: " + file_path);
+      }
+      struct stat st;
+      if (fstat(fd, &st) != 0 || st.st_size < (off_t) (2 * sizeof(COLUMNAR_MAGIC) + sizeof(uint64_t))) {
+        ::close(fd);
+        throw std::runtime_error("Not a columnar file: " + file_path);
+      }
+      void* map = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (map == MAP_FAILED) {
+        throw std::runtime_error("Failed to map columnar file: " + file_path);
+      }
+      data = (const char*) map;
+      size = (size_t) st.st_size;
+    }
+
+    void unmap_file() {
+      if (data != nullptr) {
+        munmap((void*) data, size);
+        data = nullptr;
+        size = 0;
+      }
+    }
+
+    // Bounds-checked little reader over the footer
+    struct FooterReader {
+      const char* pos;
+      const char* end;
+      const string& path;
+
+      template <typename T>
+      T read() {
+        T val;
+        check(sizeof(T));
+        memcpy(&val, pos, sizeof(T));
+        pos += sizeof(T);
+        return val;
+      }
+
+      string read_string() {
+        uint32_t len = read<uint32_t>();
+        check(len);
+        string val(pos, len);
+        pos += len;
+        return val;
+      }
+
+      void check(size_t len) {
+        if ((size_t) (end - pos) < len) {
+          throw std::runtime_error("Corrupt columnar file footer: " + path);
+        }
+      }
+    };
+
+    Value read_stat(FooterReader& footer, ColumnType type) {
+      if (type == ColumnType::STRING) {
+        return Value(footer.read_string());
+      }
+      if (type == ColumnType::DOUBLE) {
+        return Value::make_double(footer.read<double>());
+      }
+      int64_t val = footer.read<int64_t>();
+      return type == ColumnType::TIMESTAMP ? Value::make_timestamp(val) : Value::make_int(val);
+    }
+
+    void read_footer() {
+      const char* tail = data + size - sizeof(COLUMNAR_MAGIC);
+      if (memcmp(data, COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC)) != 0 ||
+          memcmp(tail, COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC)) != 0) {
+        throw std::runtime_error("Not a columnar file: " + file_path);
+      }
+      uint64_t footer_offset;
+      memcpy(&footer_offset, tail - sizeof(uint64_t), sizeof(uint64_t));
+      if (footer_offset >= size) {
+        throw std::runtime_error("Corrupt columnar file footer: " + file_path);
+      }
+      FooterReader footer{data + footer_offset, tail - sizeof(uint64_t), file_path};
+
+      vector<Column> columns;
+      uint32_t num_columns = footer.read<uint32_t>();
+      for (uint32_t i = 0; i < num_columns; i++) {
+        ColumnType type = (ColumnType) footer.read<uint8_t>();
+        columns.push_back(Column{footer.read_string(), type});
+      }
+
+      row_groups.clear();
+      uint32_t num_groups = footer.read<uint32_t>();
+      for (uint32_t g = 0; g < num_groups; g++) {
+        RowGroupMeta group;
+        group.num_rows = footer.read<uint64_t>();
+        for (uint32_t i = 0; i < num_columns; i++) {
+          ColumnChunkMeta meta;
+          meta.offset = footer.read<uint64_t>();
+          meta.size = footer.read<uint64_t>();
+          meta.encoding = (ColumnEncoding) footer.read<uint8_t>();
+          meta.has_stats = footer.read<uint8_t>() != 0;
+          if (meta.has_stats) {
+            meta.min = read_stat(footer, columns[i].type);
+            meta.max = read_stat(footer, columns[i].type);
+          }
+          if (meta.offset + meta.size > footer_offset) {
+            throw std::runtime_error("Corrupt columnar segment offset: " + file_path);
+          }
+          group.columns.push_back(std::move(meta));
+        }
+        row_groups.push_back(std::move(group));
+      }
+
+      // String columns the writer dictionary encoded in any row group stay
+      // encoded in memory, with one dictionary for the whole scan
+      auto new_schema = std::make_shared<Schema>();
+      for (uint32_t i = 0; i < num_columns; i++) {
+        bool any_dict = false;
+        for (const auto& group : row_groups) {
+          any_dict = any_dict || group.columns[i].encoding == ColumnEncoding::DICT;
+        }
+        new_schema->add_column(columns[i].name, columns[i].type,
+            columns[i].type == ColumnType::STRING && any_dict ? std::make_shared<StringDictionary>() : nullptr);
+      }
+      code_maps.clear();
+      code_maps_group = SIZE_MAX;
+
+      file_columns.clear();
+      if (projected_columns.empty()) {
+        for (size_t i = 0; i < new_schema->size(); i++) {
+          file_columns.push_back(i);
+        }
+        schema = std::move(new_schema);
+        return;
+      }
+      auto projected_schema = std::make_shared<Schema>();
+      for (const auto& column : projected_columns) {
+        int ordinal = new_schema->get_ordinal(column);
+        if (ordinal < 0) {
+          throw std::runtime_error("Column " + column + " not found in columnar file: " + file_path);
+        }
+        file_columns.push_back((size_t) ordinal);
+        const Column& file_column = new_schema->get_column((size_t) ordinal);
+        projected_schema->add_column(column, file_column.type, file_column.dictionary);
+      }
+      schema = std::move(projected_schema);
+    }
+
+    uint32_t read_u32(const char* pos) const {
+      uint32_t val;
+      memcpy(&val, pos, sizeof(val));
+      return val;
+    }
+
+    // Appends num_rows values of the segment, starting at row first. Only
+    // reads the mapping, so morsels can decode on several threads.
+    void decode_rows(const ColumnChunkMeta& meta, size_t group_rows, size_t first, ColumnVector& column,
+                     size_t num_rows, vector<uint32_t>& code_map) const {
+      const char* segment = data + meta.offset;
+      size_t first_row = column.size();
+      switch (column.get_type()) {
+        case ColumnType::INT64:
+        case ColumnType::TIMESTAMP:
+          column.append_ints(segment + first * sizeof(int64_t), num_rows);
+          break;
+        case ColumnType::DOUBLE:
+          column.append_doubles(segment + first * sizeof(double), num_rows);
+          break;
+        default:
+          break;
+      }
+      if (column.get_type() != ColumnType::STRING) {
+        if (meta.encoding == ColumnEncoding::NULLABLE) {
+          // Both value types are 8 bytes wide
+          const uint8_t* nulls = (const uint8_t*) segment + group_rows * sizeof(int64_t);
+          column.set_nulls(first_row, nulls + first, num_rows);
+        }
+        return;
+      }
+
+      if (meta.encoding == ColumnEncoding::PLAIN) {
+        const char* bytes = segment + (group_rows + 1) * sizeof(uint32_t);
+        for (size_t row = first; row < first + num_rows; row++) {
+          uint32_t begin = read_u32(segment + row * sizeof(uint32_t));
+          uint32_t end = read_u32(segment + (row + 1) * sizeof(uint32_t));
+          column.append_string(std::string_view(bytes + begin, end - begin));
+        }
+        return;
+      }
+
+      uint32_t dict_size = read_u32(segment);
+      const char* offsets = segment + sizeof(uint32_t);
+      const char* bytes = offsets + (dict_size + 1) * sizeof(uint32_t);
+      size_t bytes_end = (size_t) (bytes - data) + read_u32(offsets + dict_size * sizeof(uint32_t));
+      const char* codes = data + ((bytes_end + 3) & ~(size_t) 3);
+      size_t row = first;
+      if (column.is_dictionary_encoded()) {
+        // Intern the segment's dictionary once, then rows are a code lookup.
+        // Values a full scan dictionary has no room for map to UINT32_MAX.
+        if (code_map.empty()) {
+          StringDictionary& dictionary = *column.get_dictionary();
+          code_map.reserve(dict_size);
+          for (uint32_t code = 0; code < dict_size; code++) {
+            uint32_t begin = read_u32(offsets + code * sizeof(uint32_t));
+            uint32_t end = read_u32(offsets + (code + 1) * sizeof(uint32_t));
+            uint32_t mapped;
+            bool interned = dictionary.try_intern(std::string_view(bytes + begin, end - begin), mapped);
+            code_map.push_back(interned ? mapped : UINT32_MAX);
+          }
+        }
+        for (; row < first + num_rows; row++) {
+          uint32_t mapped = code_map[read_u32(codes + row * sizeof(uint32_t))];
+          if (mapped == UINT32_MAX) {
+            // The column decodes itself to plain strings on the next append
+            break;
+          }
+          column.append_code(mapped);
+        }
+      }
+      for (; row < first + num_rows; row++) {
+        uint32_t code = read_u32(codes + row * sizeof(uint32_t));
+        uint32_t begin = read_u32(offsets + code * sizeof(uint32_t));
+        uint32_t end = read_u32(offsets + (code + 1) * sizeof(uint32_t));
+        column.append_string(std::string_view(bytes + begin, end - begin));
+      }
+    }
+};
+
+string default_spill_directory() {
+  const char* tmpdir = getenv("TMPDIR");
+  return tmpdir != nullptr && tmpdir[0] != '\0' ? tmpdir : "/tmp";
+}
+
+/**
+ * Temporary file of RowBatches that all share one schema, used by operators
+ * that run out of memory. The file is unlinked as soon as it is created, so
+ * it disappears when closed even if the process dies.
+ *
+ * Each batch is stored as its row count followed by every column: fixed
+ * width values as raw arrays followed by a uint32 count and that many null
+ * flags, strings as an array of uint32 lengths followed by the bytes.
+ */
+class SpillFile {
+  public:
+    SpillFile(const string& directory) {
+      string path = directory + "/db_spill_XXXXXX";
+      vector<char> path_buf(path.begin(), path.end());
+      path_buf.push_back('\0');
+      int fd = mkstemp(path_buf.data());
+      if (fd < 0) {
+        throw std::runtime_error("Failed to create spill file in " + directory);
+      }
+      unlink(path_buf.data());
+      fp = fdopen(fd, "w+b");
+      if (fp == nullptr) {
+        close(fd);
+        throw std::runtime_error("Failed to open spill file in " + directory);
+      }
+    }
+
+    ~SpillFile() {
+      std::fclose(fp);
+    }
+
+    SpillFile(const SpillFile&) = delete;
+    SpillFile& operator=(const SpillFile&) = delete;
+
+    const SchemaPtr& get_schema() const {
+      return schema;
+    }
+
+    void set_schema(SchemaPtr schema) {
+      this->schema = std::move(schema);
+    }
+
+    uint64_t num_rows() const {
+      return total_rows;
+    }
+
+    uint64_t num_bytes() const {
+      return total_bytes;
+    }
+
+    void write_batch(const RowBatch& batch) {
+      if (batch.size() == 0) {
+        return;
+      }
+      if (schema == nullptr) {
+        schema = batch.get_schema();
+      }
+      write_value<uint32_t>((uint32_t) batch.size());
+      for (size_t i = 0; i < batch.num_columns(); i++) {
+        const ColumnVector& column = batch.get_column(i);
+        switch (column.get_type()) {
+          case ColumnType::INT64:
+          case ColumnType::TIMESTAMP:
+            write_bytes(column.get_ints().data(), batch.size() * sizeof(int64_t));
+            break;
+          case ColumnType::DOUBLE:
+            write_bytes(column.get_doubles().data(), batch.size() * sizeof(double));
+            break;
+          default: {
+            lengths.resize(batch.size());
+            for (size_t r = 0; r < batch.size(); r++) {
+              lengths[r] = (uint32_t) column.get_string(r).size();
+            }
+            write_bytes(lengths.data(), lengths.size() * sizeof(uint32_t));
+            for (size_t r = 0; r < batch.size(); r++) {
+              std::string_view val = column.get_string(r);
+              write_bytes(val.data(), val.size());
+            }
+          }
+        }
+        if (column.get_type() != ColumnType::STRING) {
+          size_t num_flags = std::min(column.get_nulls().size(), batch.size());
+          write_value<uint32_t>((uint32_t) num_flags);
+          write_bytes(column.get_nulls().data(), num_flags);
+        }
+      }
+      total_rows += batch.size();
+    }
+
+    // Switches from writing to reading from the first batch
+    void rewind() {
+      if (std::fflush(fp) != 0 || std::fseek(fp, 0, SEEK_SET) != 0) {
+        throw std::runtime_error("Failed to rewind spill file");
+      }
+      read_bytes_left = total_bytes;
+    }
+
+    bool read_batch(RowBatch& batch) {
+      if (read_bytes_left == 0) {
+        return false;
+      }
+      uint32_t batch_rows = read_value<uint32_t>();
+      batch.reset(schema);
+      for (size_t i = 0; i < batch.num_columns(); i++) {
+        ColumnVector& column = batch.get_column(i);
+        switch (column.get_type()) {
+          case ColumnType::INT64:
+          case ColumnType::TIMESTAMP:
+            read_bytes(batch_rows * sizeof(int64_t));
+            column.append_ints(buffer.data(), batch_rows);
+            break;
+          case ColumnType::DOUBLE:
+            read_bytes(batch_rows * sizeof(double));
+            column.append_doubles(buffer.data(), batch_rows);
+            break;
+          default: {
+            read_bytes(batch_rows * sizeof(uint32_t));
+            lengths.resize(batch_rows);
+            memcpy(lengths.data(), buffer.data(), batch_rows * sizeof(uint32_t));
+            size_t string_bytes = 0;
+            for (uint32_t len : lengths) {
+              string_bytes += len;
+            }
+            read_bytes(string_bytes);
+            const char* data = buffer.data();
+            for (uint32_t len : lengths) {
+              column.append_string(std::string_view(data, len));
+              data += len;
+            }
+          }
+        }
+        if (column.get_type() != ColumnType::STRING) {
+          uint32_t num_flags = read_value<uint32_t>();
+          read_bytes(num_flags);
+          column.set_nulls(0, (const uint8_t*) buffer.data(), num_flags);
+        }
+      }
+      batch.set_size(batch_rows);
+      return true;
+    }
+
+  private:
+    FILE* fp = nullptr;
+    SchemaPtr schema;
+    uint64_t total_rows = 0;
+    uint64_t total_bytes = 0;
+    uint64_t read_bytes_left = 0;
+    vector<uint32_t> lengths;
+    vector<char> buffer;
+
+    void write_bytes(const void* data, size_t size) {
+      if (size > 0 && std::fwrite(data, 1, size, fp) != size) {
+        throw std::runtime_error("Failed to write spill file");
+      }
+      total_bytes += size;
+    }
+
+    template <typename T>
+    void write_value(T val) {
+      write_bytes(&val, sizeof(T));
+    }
+
+    // Reads into buffer
+    void read_bytes(size_t size) {
+      buffer.resize(size);
+      if (size > read_bytes_left || (size > 0 && std::fread(buffer.data(), 1, size, fp) != size)) {
+        throw std::runtime_error("Spill file is truncated");
+      }
+      read_bytes_left -= size;
+    }
+
+    template <typename T>
+    T read_value() {
+      read_bytes(sizeof(T));
+      T val;
+      memcpy(&val, buffer.data(), sizeof(T));
+      return val;
+    }
+};
+
+/**
+ * Splits rows across num_partitions spill files by the hash of their key
+ * columns. Different seeds give unrelated splits, so a partition that is
+ * still too big can be split again with the next seed.
+ */
+class SpillPartitioner {
+  public:
+    SpillPartitioner(size_t num_partitions, uint64_t seed, const string& directory)
+      : seed(seed), buffers(num_partitions) {
+      for (size_t i = 0; i < num_partitions; i++) {
+        files.push_back(std::make_shared<SpillFile>(directory));
+      }
+    }
+
+    void add(const RowBatch& batch, const vector<size_t>& key_ordinals) {
+      batch.hash_columns(key_ordinals, hashes);
+      for (size_t i = 0; i < batch.size(); i++) {
+        RowBatch& buffer = buffers[partition_of(hashes[i])];
+        if (buffer.get_schema() != batch.get_schema()) {
+          flush(buffer);
+          buffer.reset(batch.get_schema());
+        }
+        buffer.append_row_from(batch, i);
+        if (buffer.is_full()) {
+          flush(buffer);
+        }
+      }
+    }
+
+    // Flushes the buffered rows and rewinds every file for reading
+    vector<std::shared_ptr<SpillFile>> finish(const SchemaPtr& schema) {
+      for (size_t i = 0; i < files.size(); i++) {
+        flush(buffers[i]);
+        if (files[i]->get_schema() == nullptr) {
+          files[i]->set_schema(schema);
+        }
+        files[i]->rewind();
+      }
+      return std::move(files);
+    }
+
+  private:
+    uint64_t seed;
+    vector<RowBatch> buffers;
+    vector<std::shared_ptr<SpillFile>> files;
+    vector<uint64_t> hashes;
+
+    size_t partition_of(uint64_t hash) const {
+      return (size_t) (mix_hash(hash ^ seed) % buffers.size());
+    }
+
+    void flush(RowBatch& buffer) {
+      if (buffer.size() == 0) {
+        return;
+      }
+      files[&buffer - buffers.data()]->write_batch(buffer);
+      buffer.clear();
+    }
+};
+
+// Reads back the batches of a spill file
+class SpillScan : public BatchIterator {
+  public:
+    SpillScan(std::shared_ptr<SpillFile> file) : file(std::move(file)) {}
+
+    void init() {
+      BatchIterator::init();
+      file->rewind();
+    }
+
+    bool get_next_batch(RowBatch& batch) {
+      return file->read_batch(batch);
+    }
+
+  private:
+    std::shared_ptr<SpillFile> file;
+};
+
+/**
+ * K-way merge of spill files whose rows are each already ordered by
+ * compare. The current row of every file sits at a leaf of a loser tree, so
+ * producing a row costs about log2(k) comparisons. Ties go to the file that
+ * was added first.
+ */
+class SortedRunMerger {
+  public:
+    using RowComparator = std::function<int(const RowBatch&, size_t, const RowBatch&, size_t)>;
+
+    SortedRunMerger(vector<std::shared_ptr<SpillFile>> runs, RowComparator compare)
+      : compare(std::move(compare)), cursors(runs.size()), tree(runs.size()) {
+      for (size_t i = 0; i < runs.size(); i++) {
+        cursors[i].file = std::move(runs[i]);
+        cursors[i].file->rewind();
+        advance(cursors[i]);
+      }
+      if (!cursors.empty()) {
+        tree[0] = build(1);
+      }
+    }
+
+    // Appends up to a full batch of merged rows, false once every run is done
+    bool next_batch(RowBatch& batch) {
+      if (cursors.empty() || cursors[tree[0]].done) {
+        return false;
+      }
+      batch.reset(cursors[tree[0]].batch.get_schema());
+      while (!batch.is_full() && !cursors[tree[0]].done) {
+        size_t winner = tree[0];
+        RunCursor& cursor = cursors[winner];
+        if (cursor.batch.get_schema() != batch.get_schema()) {
+          break;
+        }
+        batch.append_row_from(cursor.batch, cursor.row);
+        advance(cursor);
+        replay(winner);
+      }
+      return batch.size() > 0;
+    }
+
+  private:
+    struct RunCursor {
+      std::shared_ptr<SpillFile> file;
+      RowBatch batch;
+      size_t row = 0;
+      bool started = false;
+      bool done = false;
+    };
+
+    RowComparator compare;
+    vector<RunCursor> cursors;
+    // tree[0] is the overall winner, tree[1..k) the loser of each match.
+    // Leaves are the implicit nodes k..2k-1, one per run.
+    vector<size_t> tree;
+
+    void advance(RunCursor& cursor) {
+      if (cursor.started) {
+        cursor.row++;
+      }
+      cursor.started = true;
+      while (!cursor.done && cursor.row >= cursor.batch.size()) {
+        cursor.done = !cursor.file->read_batch(cursor.batch);
+        cursor.row = 0;
+      }
+    }
+
+    // Exhausted runs lose to everything
+    bool beats(size_t a, size_t b) const {
+      const RunCursor& x = cursors[a];
+      const RunCursor& y = cursors[b];
+      if (x.done || y.done) {
+        return !x.done && (y.done || a < b);
+      }
+      int cmp = compare(x.batch, x.row, y.batch, y.row);
+      return cmp < 0 || (cmp == 0 && a < b);
+    }
+
+    size_t build(size_t node) {
+      if (node >= cursors.size()) {
+        return node - cursors.size();
+      }
+      size_t left = build(2 * node);
+      size_t right = build(2 * node + 1);
+      bool left_wins = beats(left, right);
+      tree[node] = left_wins ? right : left;
+      return left_wins ? left : right;
+    }
+
+    // Replays the matches on the path from a leaf whose row changed
+    void replay(size_t winner) {
+      for (size_t node = (winner + cursors.size()) / 2; node >= 1; node /= 2) {
+        if (beats(tree[node], winner)) {
+          std::swap(tree[node], winner);
+        }
+      }
+      tree[0] = winner;
+    }
+};
+
+/**
+ * Open addressing hash table of distinct key tuples. Keys are copied into
+ * typed columns and numbered from 0 in insertion order; the table itself
+ * only holds those numbers and probes linearly.
+ */
+class GroupTable {
+  public:
+    GroupTable() {}
+
+    // Key columns given a dictionary compare and hash input keys that share
+    // it by code
+    void reset(const vector<ColumnType>& key_types, const vector<std::shared_ptr<StringDictionary>>& dictionaries = {}) {
+      key_columns.clear();
+      for (size_t i = 0; i < key_types.size(); i++) {
+        key_columns.push_back(ColumnVector(key_types[i], i < dictionaries.size() ? dictionaries[i] : nullptr));
+      }
+      hashes.clear();
+      num_groups = 0;
+      slots.assign(64, 0);
+      slot_mask = slots.size() - 1;
+    }
+
+    size_t size() const {
+      return num_groups;
+    }
+
+    const ColumnVector& get_key_column(size_t ordinal) const {
+      return key_columns[ordinal];
+    }
+
+    uint64_t get_hash(uint32_t group) const {
+      return hashes[group];
+    }
+
+    // Returns the group of the key in row of keys, or -1 if it is not here
+    int64_t find(const vector<const ColumnVector*>& keys, size_t row, uint64_t hash) const {
+      uint64_t slot = hash & slot_mask;
+      while (slots[slot] != 0) {
+        uint32_t group = slots[slot] - 1;
+        if (hashes[group] == hash && keys_equal(group, keys, row)) {
+          return group;
+        }
+        slot = (slot + 1) & slot_mask;
+      }
+      return -1;
+    }
+
+    size_t memory_usage() const {
+      size_t bytes = hashes.size() * sizeof(uint64_t) + slots.size() * sizeof(uint32_t);
+      for (const auto& column : key_columns) {
+        bytes += column.memory_usage();
+      }
+      return bytes;
+    }
+
+    // Returns the group of the key in row of keys, adding it if it is new.
+    // hash must come from the key values alone, see RowBatch::hash_columns.
+    uint32_t find_or_insert(const vector<const ColumnVector*>& keys, size_t row, uint64_t hash, bool& inserted) {
+      uint64_t slot = hash & slot_mask;
+      while (slots[slot] != 0) {
+        uint32_t group = slots[slot] - 1;
+        if (hashes[group] == hash && keys_equal(group, keys, row)) {
+          inserted = false;
+          return group;
+        }
+        slot = (slot + 1) & slot_mask;
+      }
+
+      uint32_t group = (uint32_t) num_groups++;
+      for (size_t k = 0; k < key_columns.size(); k++) {
+        key_columns[k].append_from(*keys[k], row);
+      }
+      hashes.push_back(hash);
+      slots[slot] = group + 1;
+      inserted = true;
+      // Grow at half full to keep probe sequences short
+      if (num_groups * 2 > slots.size()) {
+        grow();
+      }
+      return group;
+    }
+
+  private:
+    vector<ColumnVector> key_columns;
+    vector<uint64_t> hashes;
+    size_t num_groups = 0;
+    // Group number + 1 per slot, 0 for empty
+    vector<uint32_t> slots;
+    uint64_t slot_mask = 0;
+
+    bool keys_equal(uint32_t group, const vector<const ColumnVector*>& keys, size_t row) const {
+      for (size_t k = 0; k < key_columns.size(); k++) {
+        if (key_columns[k].compare(group, *keys[k], row) != 0) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    void grow() {
+      slots.assign(slots.size() * 2, 0);
+      slot_mask = slots.size() - 1;
+      for (uint32_t group = 0; group < num_groups; group++) {
+        uint64_t slot = hashes[group] & slot_mask;
+        while (slots[slot] != 0) {
+          slot = (slot + 1) & slot_mask;
+        }
+        slots[slot] = group + 1;
+      }
+    }
+};
+
+class Select : public BatchIterator {
+  public:
+
+    void init() {
+      cout << "Select Node Inited" << endl;
+      filter_pushed = expression != nullptr && !inputs.empty() && inputs[0]->push_down_filter(expression);
+      bound_schema = nullptr;
+      BatchIterator::init();
+    }
+
+    void close() {
+      cout <<  "Select Node closed" << endl;
+      BatchIterator::close();
+    }
+
+    void set_predicate(bool (*predicate) (const std::unique_ptr<RowTuple>&)) {
+      this->predicate = predicate;
+      expression = nullptr;
+    }
+
+    // Expressions are evaluated a batch at a time and offered to the input
+    void set_predicate(ExprPtr expression) {
+      this->expression = std::move(expression);
+      predicate = nullptr;
+    }
+    
+    bool get_next_batch(RowBatch& batch) {
+      if (inputs.empty() || (predicate == nullptr && expression == nullptr)) {
+        return false;
+      }
+      if (expression != nullptr) {
+        return filter_next_batch(batch);
+      }
+      std::unique_ptr<Iterator>& input = inputs[0];
+      // One scratch tuple is refilled per row instead of allocating a new one
+      if (scratch_tuple == nullptr) {
+        scratch_tuple = std::unique_ptr<RowTuple>(new RowTuple());
+      }
+
+      while (input->get_next_batch(input_batch)) {
+        batch.reset(input_batch.get_schema());
+        for (size_t i = 0; i < input_batch.size(); i++) {
+          input_batch.load_row(i, *scratch_tuple);
+          if (predicate(scratch_tuple)) {
+            batch.append_row_from(input_batch, i);
+          }
+        }
+        if (batch.size() > 0) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // The expression is bound here, before any worker runs its stage
+    unique_ptr<PipelineStage> make_pipeline_stage(const SchemaPtr& input_schema, SchemaPtr& output_schema) {
+      output_schema = input_schema;
+      if (expression != nullptr) {
+        expression->bind(*input_schema);
+        bound_schema = input_schema;
+      }
+      return unique_ptr<PipelineStage>(new FilterStage(predicate, expression));
+    }
+    
+  private:
+    class FilterStage : public PipelineStage {
+      public:
+        FilterStage(bool (*predicate) (const std::unique_ptr<RowTuple>&), ExprPtr expression)
+          : predicate(predicate), expression(std::move(expression)) {}
+
+        void process(RowBatch& batch) {
+          if (expression != nullptr) {
+            selection.resize(batch.size());
+            for (size_t i = 0; i < selection.size(); i++) {
+              selection[i] = (uint32_t) i;
+            }
+            expression->filter(batch, selection);
+          } else {
+            // Like get_next_batch, no predicate at all passes no rows
+            if (scratch_tuple == nullptr) {
+              scratch_tuple = std::unique_ptr<RowTuple>(new RowTuple());
+            }
+            selection.clear();
+            for (size_t i = 0; predicate != nullptr && i < batch.size(); i++) {
+              batch.load_row(i, *scratch_tuple);
+              if (predicate(scratch_tuple)) {
+                selection.push_back((uint32_t) i);
+              }
+            }
+          }
+          if (selection.size() == batch.size()) {
+            return;
+          }
+          output.reset(batch.get_schema());
+          output.append_selected(batch, selection);
+          std::swap(batch, output);
+        }
+
+      private:
+        bool (*predicate) (const std::unique_ptr<RowTuple>&);
+        ExprPtr expression;
+        SelectionVector selection;
+        RowBatch output;
+        std::unique_ptr<RowTuple> scratch_tuple;
+    };
+
+    bool (*predicate) (const std::unique_ptr<RowTuple>&) = nullptr;
+    ExprPtr expression;
+    bool filter_pushed = false;
+    SchemaPtr bound_schema;
+    SelectionVector selection;
+    RowBatch input_batch;
+    std::unique_ptr<RowTuple> scratch_tuple;
+
+    bool filter_next_batch(RowBatch& batch) {
+      while (inputs[0]->get_next_batch(input_batch)) {
+        if (input_batch.get_schema() != bound_schema) {
+          // An input that took the filter already bound it, and may be using
+          // it on other threads, so it is only rebound if the schema changes
+          if (!filter_pushed || bound_schema != nullptr) {
+            expression->bind(*input_batch.get_schema());
+          }
+          bound_schema = input_batch.get_schema();
+        }
+        selection.resize(input_batch.size());
+        for (size_t i = 0; i < selection.size(); i++) {
+          selection[i] = (uint32_t) i;
+        }
+        expression->filter(input_batch, selection);
+        if (selection.size() == input_batch.size()) {
+          // Every row passed, hand over the whole batch
+          std::swap(batch, input_batch);
+          return true;
+        }
+        if (!selection.empty()) {
+          batch.reset(input_batch.get_schema());
+          batch.append_selected(input_batch, selection);
+          return true;
+        }
+      }
+      return false;
+    }
+};
+
+class Count : public BatchIterator {
+  public:
+
+    Count() {}
+
+    Count(string alias) : result_alias(alias) {}
+
+    void init() {
+      cout << "Initializing Count Node" << endl;
+      BatchIterator::init();
+      num_records = 0;
+      emitted = false;
+    }
+
+    void close() {
+      cout << "Closing Count Node" << endl;
+      BatchIterator::close();
+    }
+
+    void set_result_alias(const string& alias) {
+      this->result_alias = alias;
+    }
+
+    bool set_pipeline(size_t input, std::shared_ptr<Pipeline> pipeline) {
+      this->pipeline = input == 0 ? std::move(pipeline) : nullptr;
+      return this->pipeline != nullptr;
+    }
+
+    bool get_next_batch(RowBatch& batch) {
+      if (inputs.empty() || emitted) {
+        return false;
+      }
+
+      if (pipeline != nullptr && pipeline->open() != nullptr) {
+        vector<long> worker_records(pipeline->num_workers(), 0);
+        pipeline->run([&worker_records](size_t worker, RowBatch& input_batch) {
+          worker_records[worker] += input_batch.size();
+        });
+        for (long records : worker_records) {
+          num_records += records;
+        }
+      } else {
+        unique_ptr<Iterator>& input = inputs[0];
+        while (input->get_next_batch(input_batch)) {
+          num_records += input_batch.size();
+        }
+      }
+
+      auto result_schema = std::make_shared<Schema>(vector<Column>{{result_alias, ColumnType::INT64}});
+      batch.reset(std::move(result_schema));
+      batch.append_row(RowTuple(batch.get_schema(), {Value::make_int(num_records)}));
+      emitted = true;
+      return true;
+    }
+
+  private:
+    long num_records = 0;
+    bool emitted = false;
+    string result_alias = "Count";
+    RowBatch input_batch;
+    std::shared_ptr<Pipeline> pipeline;
+};
+
+class Average : public BatchIterator {
+  // Don't forget... need to take in column name
+  public:
+    Average() {}
+    Average(const string& alias) : result_alias(alias) {}
+
+    void init() {
+      cout <<  "Initing Average Iterator" << endl;
+      BatchIterator::init();
+      total_count = 0;
+      running_sum = 0.0;
+      emitted = false;
+    }
+    void close() {
+      cout << "Closing Average Iterator" << endl;
+      BatchIterator::close();
+    }
+
+    void set_result_alias(const string& alias) {
+      result_alias = alias;
+    }
+
+    void set_col_to_avg(const string& col_name) {
+      this->column_to_avg = col_name;
+    }
+
+    bool get_next_batch(RowBatch& batch) {
+      if (inputs.empty() || column_to_avg == "") {
+        cout << "Average: Either inputs or target col name not set" << endl;
+        return false;
+      }
+      if (emitted) {
+        return false;
+      }
+
+      unique_ptr<Iterator>& input = inputs[0];
+
+      while (input->get_next_batch(input_batch)) {
+        // Resolve the column once per input schema, then index directly
+        if (input_batch.get_schema() != avg_schema) {
+          avg_schema = input_batch.get_schema();
+          avg_ordinal = avg_schema == nullptr ? -1 : avg_schema->get_ordinal(this->column_to_avg);
+        }
+        if (avg_ordinal < 0) {
+          // Assuming that all or none of the tuples contain the column to sort on 
+          // Revisit this logic if necessary
+          cout << "Average: No value in row_tuple matching key: " << this->column_to_avg << endl;
+          return false;
+        }
+        accumulate(input_batch.get_column((size_t) avg_ordinal));
+      }
+      double avg = total_count == 0 ? 0.0 : ((running_sum)/((double) total_count));
+
+      auto result_schema = std::make_shared<Schema>(vector<Column>{{result_alias, ColumnType::DOUBLE}});
+      batch.reset(std::move(result_schema));
+      batch.append_row(RowTuple(batch.get_schema(), {Value::make_double(avg)}));
+      emitted = true;
+      return true;
+    }
+
+  private:
+    string result_alias = "Average";
+    string column_to_avg = "";
+    long total_count;
+    double running_sum; // TODO guard against overflow
+    bool emitted = false;
+    SchemaPtr avg_schema;
+    int avg_ordinal = -1;
+    RowBatch input_batch;
+
+    // Nulls are left out of both the sum and the count
+    void accumulate(const ColumnVector& column) {
+      if (column.has_nulls()) {
+        for (size_t row = 0; row < column.size(); row++) {
+          if (!column.is_null(row)) {
+            running_sum += column.get(row).as_double();
+            total_count++;
+          }
+        }
+        return;
+      }
+      switch (column.get_type()) {
+        case ColumnType::INT64:
+        case ColumnType::TIMESTAMP:
+          for (int64_t val : column.get_ints()) {
+            running_sum += (double) val;
+          }
+          total_count += column.size();
+          break;
+        case ColumnType::DOUBLE:
+          for (double val : column.get_doubles()) {
+            running_sum += val;
+          }
+          total_count += column.size();
+          break;
+        default:
+          // Empty strings are missing values, like nulls
+          for (size_t row = 0; row < column.size(); row++) {
+            double val;
+            if (parse_numeric_field(column.get_string(row), column_to_avg, val)) {
+              running_sum += val;
+              total_count++;
+            }
+          }
+      }
+    }
+};
+
+/**
+ * Drops duplicate rows. By default the input has to be sorted, so that
+ * duplicates are adjacent. With set_use_hash(true) any input works: every
+ * distinct row is kept in a GroupTable and rows are passed on the first time
+ * they are seen.
+ *
+ * A memory budget caps that table. Once it is reached, rows already in the
+ * table are still dropped but new ones are hash partitioned to spill files.
+ * Those partitions share no rows with the table or with each other, so each
+ * is deduplicated on its own afterwards, spilling again if need be.
+ */
+class Distinct : public BatchIterator {
+  // Note, without set_use_hash input needs to be in sorted order for this operator to work
+  public:
+    Distinct() {}
+
+    void init() {
+      cout << "Initing Distinct Node" << endl;
+      BatchIterator::init();
+      last_row.clear();
+      input_schema = nullptr;
+      input_done = false;
+      partitioner.reset();
+      partitions.clear();
+      next_partition = 0;
+      partition_distinct.reset();
+    }
+
+    void close() {
+      cout << "Closing Distinct Node" << endl;
+      BatchIterator::close();
+      seen_rows.reset({});
+      partitioner.reset();
+      partitions.clear();
+      partition_distinct.reset();
+    }
+
+    void set_use_hash(bool use_hash) {
+      this->use_hash = use_hash;
+    }
+
+    // Bytes for distinct rows in hash mode before spilling, 0 for no limit
+    void set_memory_budget(size_t bytes) {
+      memory_budget = bytes;
+    }
+
+    void set_spill_directory(const string& directory) {
+      spill_directory = directory;
+    }
+
+    bool get_next_batch(RowBatch& batch) {
+      if (inputs.empty()) {
+        return false;
+      }
+      if (use_hash) {
+        return get_next_hashed_batch(batch);
+      }
+      std::unique_ptr<Iterator>& input = inputs[0];
+
+      while (input->get_next_batch(input_batch)) {
+        batch.reset(input_batch.get_schema());
+        for (size_t i = 0; i < input_batch.size(); i++) {
+          // Sorted input means duplicates are adjacent, so only compare
+          // against the last row we let through
+          if (last_row.size() == 0 || last_row.compare_rows(0, input_batch, i) != 0) {
+            batch.append_row_from(input_batch, i);
+            last_row.reset(input_batch.get_schema());
+            last_row.append_row_from(input_batch, i);
+          }
+        }
+        if (batch.size() > 0) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+  private:
+    static constexpr size_t MAX_SPILL_DEPTH = 4;
+
+    RowBatch input_batch;
+    RowBatch last_row;
+
+    bool use_hash = false;
+    size_t memory_budget = 0;
+    string spill_directory = default_spill_directory();
+    size_t depth = 0;
+    SchemaPtr input_schema;
+    vector<size_t> all_columns;
+    GroupTable seen_rows;
+    vector<uint64_t> hashes;
+    bool input_done = false;
+    // Set once the budget is reached
+    unique_ptr<SpillPartitioner> partitioner;
+    RowBatch spill_batch;
+    vector<std::shared_ptr<SpillFile>> partitions;
+    size_t next_partition = 0;
+    unique_ptr<Iterator> partition_distinct;
+
+    bool get_next_hashed_batch(RowBatch& batch) {
+      while (!input_done) {
+        if (!inputs[0]->get_next_batch(input_batch)) {
+          input_done = true;
+          if (partitioner != nullptr) {
+            partitions = partitioner->finish(input_schema);
+            partitioner.reset();
+          }
+          break;
+        }
+        if (input_batch.get_schema() != input_schema) {
+          if (input_schema != nullptr) {
+            throw std::runtime_error("Distinct input changed schema");
+          }
+          start_hashing(input_batch.get_schema());
+        }
+        batch.reset(input_schema);
+        add_rows(batch);
+        if (batch.size() > 0) {
+          return true;
+        }
+      }
+
+      while (true) {
+        if (partition_distinct != nullptr) {
+          if (partition_distinct->get_next_batch(batch)) {
+            return true;
+          }
+          partition_distinct->close();
+          partition_distinct.reset();
+        }
+        if (next_partition >= partitions.size()) {
+          return false;
+        }
+        std::shared_ptr<SpillFile>& partition = partitions[next_partition++];
+        if (partition->num_rows() == 0) {
+          continue;
+        }
+        Distinct* child = new Distinct();
+        child->use_hash = true;
+        child->memory_budget = memory_budget;
+        child->spill_directory = spill_directory;
+        child->depth = depth + 1;
+        child->append_input(unique_ptr<Iterator>(new SpillScan(partition)));
+        partition_distinct.reset(child);
+        partition_distinct->init();
+      }
+    }
+
+    void start_hashing(const SchemaPtr& schema) {
+      input_schema = schema;
+      all_columns.clear();
+      vector<ColumnType> types;
+      vector<std::shared_ptr<StringDictionary>> dictionaries;
+      for (size_t i = 0; i < schema->size(); i++) {
+        all_columns.push_back(i);
+        types.push_back(schema->get_column(i).type);
+        dictionaries.push_back(schema->get_column(i).dictionary);
+      }
+      seen_rows.reset(types, dictionaries);
+    }
+
+    // Appends the rows of input_batch not seen before to batch
+    void add_rows(RowBatch& batch) {
+      input_batch.hash_columns(all_columns, hashes);
+      vector<const ColumnVector*> columns;
+      for (size_t i = 0; i < input_batch.num_columns(); i++) {
+        columns.push_back(&input_batch.get_column(i));
+      }
+
+      if (partitioner != nullptr) {
+        spill_batch.reset(input_schema);
+        for (size_t i = 0; i < input_batch.size(); i++) {
+          if (seen_rows.find(columns, i, hashes[i]) < 0) {
+            spill_batch.append_row_from(input_batch, i);
+          }
+        }
+        partitioner->add(spill_batch, all_columns);
+        return;
+      }
+
+      for (size_t i = 0; i < input_batch.size(); i++) {
+        bool inserted;
+        seen_rows.find_or_insert(columns, i, hashes[i], inserted);
+        if (inserted) {
+          batch.append_row_from(input_batch, i);
+        }
+      }
+      if (memory_budget > 0 && depth < MAX_SPILL_DEPTH && seen_rows.memory_usage() > memory_budget) {
+        partitioner.reset(new SpillPartitioner(16, 0x9e3779b97f4a7c15ULL * (depth + 1), spill_directory));
+      }
+    }
+};
+
+struct SortKey {
+  string column;
+  bool ascending = true;
+};
+
+// Sort keys resolved to ordinals of one schema. No keys means every column
+// ascending, in schema order.
+struct SortOrder {
+  vector<size_t> ordinals;
+  vector<bool> descending;
+
+  static SortOrder resolve(const Schema& schema, const vector<SortKey>& keys) {
+    SortOrder order;
+    for (const auto& key : keys) {
+      int ordinal = schema.get_ordinal(key.column);
+      if (ordinal < 0) {
+        throw std::runtime_error("Sort column not found: " + key.column);
+      }
+      order.ordinals.push_back((size_t) ordinal);
+      order.descending.push_back(!key.ascending);
+    }
+    if (keys.empty()) {
+      for (size_t i = 0; i < schema.size(); i++) {
+        order.ordinals.push_back(i);
+        order.descending.push_back(false);
+      }
+    }
+    return order;
+  }
+
+  int compare(const RowBatch& a_batch, size_t a_row, const RowBatch& b_batch, size_t b_row) const {
+    for (size_t k = 0; k < ordinals.size(); k++) {
+      int cmp = a_batch.get_column(ordinals[k]).compare(a_row, b_batch.get_column(ordinals[k]), b_row);
+      if (cmp != 0) {
+        return descending[k] ? -cmp : cmp;
+      }
+    }
+    return 0;
+  }
+};
+
+// Note right now sort criteria is being passed in
+// Rows are ordered by their sort keys, or by every column when there are none.
+// The keys of each row are encoded once into a byte string whose memcmp
+// order is the sort order, so comparisons never look at Values.
+// With a memory budget set, input that does not fit is cut into sorted runs
+// on disk which are then merged, merge_fan_out runs at a time.
+class Sort : public BatchIterator {
+  public:
+    Sort() {}
+    Sort(string sort_col) : sort_keys({{sort_col, true}}) {}
+    Sort(vector<SortKey> sort_keys) : sort_keys(std::move(sort_keys)) {}
+
+    void init() {
+      BatchIterator::init();
+      iterator_position = 0;
+      sort_schema = nullptr;
+      runs.clear();
+      merger.reset();
+      get_unsorted_input();
+      sort_input();
+      if (!runs.empty()) {
+        merge_runs();
+      }
+    }
+
+    void close() {
+      BatchIterator::close();
+      iterator_position = 0;
+      input_batches.clear();
+      sorted_order.clear();
+      key_buffers.clear();
+      runs.clear();
+      merger.reset();
+    }
+
+    void set_sort_column(string col_to_sort) {
+      this->sort_keys = {{col_to_sort, true}};
+    }
+
+    void set_sort_keys(vector<SortKey> sort_keys) {
+      this->sort_keys = std::move(sort_keys);
+    }
+
+    // Sorts on num_threads threads: each thread sorts a slice of the rows,
+    // then the slices are merged pairwise in parallel
+    void set_parallelism(size_t num_threads) {
+      this->num_threads = std::max<size_t>(num_threads, 1);
+    }
+
+    // Bytes of rows to buffer before spilling a sorted run, 0 for no limit
+    void set_memory_budget(size_t bytes) {
+      memory_budget = bytes;
+    }
+
+    // Number of runs merged at once, more runs take extra merge passes
+    void set_merge_fan_out(size_t fan_out) {
+      merge_fan_out = std::max<size_t>(fan_out, 2);
+    }
+
+    void set_spill_directory(const string& directory) {
+      spill_directory = directory;
+    }
+
+    /**
+     * Pipeline workers each collect the batches of their morsels, then the
+     * collected rows are sorted on every worker of the pipeline's pool as
+     * with set_parallelism. A sort with a memory budget reads its input in
+     * order, so it can cut runs as it goes.
+     */
+    bool set_pipeline(size_t input, std::shared_ptr<Pipeline> pipeline) {
+      this->pipeline = input == 0 && memory_budget == 0 ? std::move(pipeline) : nullptr;
+      return this->pipeline != nullptr;
+    }
+
+    bool get_next_batch(RowBatch& batch) {
+      if (merger != nullptr) {
+        return merger->next_batch(batch);
+      }
+      if (iterator_position >= sorted_order.size()) {
+        return false;
+      }
+      batch.reset(input_batches[0].get_schema());
+      while (!batch.is_full() && iterator_position < sorted_order.size()) {
+        const RowRef& ref = sorted_order[iterator_position++];
+        batch.append_row_from(input_batches[ref.batch], ref.row);
+      }
+      return true;
+    }
+
+  private:
+    // Position of a row inside input_batches
+    struct RowRef {
+      uint32_t batch;
+      uint32_t row;
+    };
+
+    // A row's normalized key lives in key_buffers[ref.batch] at offset. Its
+    // first 8 bytes are copied into prefix, which settles most comparisons.
+    struct SortEntry {
+      uint64_t prefix;
+      uint32_t offset;
+      uint32_t length;
+      RowRef ref;
+    };
+
+    // Below this many rows a single thread sorts faster than the handoff
+    static constexpr size_t MIN_PARALLEL_SORT_ROWS = 16 * BATCH_SIZE;
+
+    std::vector<RowBatch> input_batches;
+    size_t buffered_rows = 0;
+    std::vector<RowRef> sorted_order;
+    vector<SortKey> sort_keys;
+    size_t iterator_position;
+    SchemaPtr sort_schema;
+    SortOrder sort_order;
+    vector<vector<uint8_t>> key_buffers;
+
+    size_t num_threads = 1;
+    std::unique_ptr<ThreadPool> pool;
+    std::shared_ptr<Pipeline> pipeline;
+
+    size_t memory_budget = 0;
+    size_t merge_fan_out = 16;
+    string spill_directory = default_spill_directory();
+    vector<std::shared_ptr<SpillFile>> runs;
+    unique_ptr<SortedRunMerger> merger;
+
+    ThreadPool& get_pool() {
+      if (pipeline != nullptr) {
+        return pipeline->get_pool();
+      }
+      if (pool == nullptr || pool->size() != num_threads) {
+        pool = std::unique_ptr<ThreadPool>(new ThreadPool(num_threads));
+      }
+      return *pool;
+    }
+
+    // A pipeline sorts on all of its workers
+    size_t sort_threads() const {
+      return pipeline != nullptr ? pipeline->num_workers() : num_threads;
+    }
+
+    void get_unsorted_input() {
+      buffered_rows = 0;
+      if (pipeline != nullptr && pipeline->open() != nullptr) {
+        vector<vector<RowBatch>> local_batches(pipeline->num_workers());
+        pipeline->run([&local_batches](size_t worker, RowBatch& batch) {
+          local_batches[worker].push_back(std::move(batch));
+        });
+        for (auto& batches : local_batches) {
+          for (auto& batch : batches) {
+            buffered_rows += batch.size();
+            input_batches.push_back(std::move(batch));
+          }
+        }
+        return;
+      }
+
+      std::unique_ptr<Iterator>& input = inputs[0];
+      RowBatch curr_batch;
+      size_t buffered_bytes = 0;
+      buffered_rows = 0;
+
+      while (input->get_next_batch(curr_batch)) {
+        buffered_rows += curr_batch.size();
+        buffered_bytes += curr_batch.memory_usage();
+        input_batches.push_back(std::move(curr_batch));
+        curr_batch = RowBatch();
+
+        if (memory_budget > 0 && buffered_bytes + buffered_rows * sizeof(SortEntry) > memory_budget) {
+          sort_input();
+          spill_run();
+          buffered_bytes = 0;
+        }
+      }
+      if (!runs.empty() && buffered_rows > 0) {
+        // The tail becomes one more run so every row goes through the merge
+        sort_input();
+        spill_run();
+      }
+    }
+
+    // Resolves the key columns to ordinals once instead of per comparison
+    void resolve_sort_keys(const SchemaPtr& schema) {
+      if (schema == sort_schema) {
+        return;
+      }
+      sort_schema = schema;
+      sort_order = SortOrder::resolve(*schema, sort_keys);
+    }
+
+    bool entry_less(const SortEntry& a, const SortEntry& b) const {
+      if (a.prefix != b.prefix) {
+        return a.prefix < b.prefix;
+      }
+      // Keys are prefix free, so equal prefixes with a key of at most 8
+      // bytes means equal keys
+      size_t common = std::min(a.length, b.length);
+      if (common > 8) {
+        int cmp = memcmp(key_buffers[a.ref.batch].data() + a.offset + 8,
+            key_buffers[b.ref.batch].data() + b.offset + 8, common - 8);
+        if (cmp != 0) {
+          return cmp < 0;
+        }
+      }
+      return a.length < b.length;
+    }
+
+    void encode_keys(uint32_t batch_index, SortEntry* out) {
+      const RowBatch& batch = input_batches[batch_index];
+      vector<uint8_t>& buffer = key_buffers[batch_index];
+      buffer.clear();
+      for (uint32_t i = 0; i < batch.size(); i++) {
+        size_t offset = buffer.size();
+        for (size_t k = 0; k < sort_order.ordinals.size(); k++) {
+          batch.get_column(sort_order.ordinals[k]).append_sort_key(i, sort_order.descending[k], buffer);
+        }
+        uint64_t prefix = 0;
+        for (size_t b = 0; b < 8; b++) {
+          prefix = (prefix << 8) | (offset + b < buffer.size() ? buffer[offset + b] : 0);
+        }
+        out[i] = {prefix, (uint32_t) offset, (uint32_t) (buffer.size() - offset), {batch_index, i}};
+      }
+    }
+
+    // NOTE, assuming that all RowTuples have same columns
+    // Sorts references to the buffered rows rather than moving the rows
+    void sort_input() {
+      sorted_order.clear();
+      if (buffered_rows == 0) {
+        return;
+      }
+      resolve_sort_keys(input_batches[0].get_schema());
+
+      vector<SortEntry> entries(buffered_rows);
+      vector<size_t> batch_starts;
+      size_t start = 0;
+      for (const auto& batch : input_batches) {
+        batch_starts.push_back(start);
+        start += batch.size();
+      }
+      key_buffers.assign(input_batches.size(), vector<uint8_t>());
+
+      bool parallel = sort_threads() > 1 && buffered_rows >= MIN_PARALLEL_SORT_ROWS;
+      if (parallel) {
+        vector<std::future<void>> tasks;
+        for (size_t t = 0; t < sort_threads(); t++) {
+          tasks.push_back(get_pool().submit([this, t, &entries, &batch_starts]() {
+            for (size_t b = t; b < input_batches.size(); b += sort_threads()) {
+              encode_keys((uint32_t) b, entries.data() + batch_starts[b]);
+            }
+          }));
+        }
+        wait_for_all(tasks);
+        parallel_sort(entries);
+      } else {
+        for (size_t b = 0; b < input_batches.size(); b++) {
+          encode_keys((uint32_t) b, entries.data() + batch_starts[b]);
+        }
+        std::sort(entries.begin(), entries.end(),
+            [this](const SortEntry& a, const SortEntry& b) { return entry_less(a, b); });
+      }
+
+      sorted_order.reserve(entries.size());
+      for (const auto& entry : entries) {
+        sorted_order.push_back(entry.ref);
+      }
+    }
+
+    // Sorts sort_threads() slices concurrently, then merges neighbouring
+    // slices in parallel rounds until one remains
+    void parallel_sort(vector<SortEntry>& entries) {
+      auto less = [this](const SortEntry& a, const SortEntry& b) { return entry_less(a, b); };
+      vector<size_t> bounds;
+      for (size_t t = 0; t <= sort_threads(); t++) {
+        bounds.push_back(entries.size() * t / sort_threads());
+      }
+
+      vector<std::future<void>> tasks;
+      for (size_t t = 0; t < sort_threads(); t++) {
+        tasks.push_back(get_pool().submit([&entries, &bounds, t, less]() {
+          std::sort(entries.begin() + bounds[t], entries.begin() + bounds[t + 1], less);
+        }));
+      }
+      wait_for_all(tasks);
+
+      vector<SortEntry> merged(entries.size());
+      while (bounds.size() > 2) {
+        vector<size_t> next_bounds;
+        tasks.clear();
+        for (size_t i = 0; i + 1 < bounds.size(); i += 2) {
+          size_t begin = bounds[i];
+          size_t mid = bounds[i + 1];
+          size_t end = i + 2 < bounds.size() ? bounds[i + 2] : mid;
+          next_bounds.push_back(begin);
+          tasks.push_back(get_pool().submit([&entries, &merged, begin, mid, end, less]() {
+            std::merge(entries.begin() + begin, entries.begin() + mid,
+                entries.begin() + mid, entries.begin() + end, merged.begin() + begin, less);
+          }));
+        }
+        next_bounds.push_back(entries.size());
+        wait_for_all(tasks);
+        entries.swap(merged);
+        bounds = std::move(next_bounds);
+      }
+    }
+
+    // Writes the buffered rows in sorted order to a new run and frees them
+    void spill_run() {
+      auto run = std::make_shared<SpillFile>(spill_directory);
+      RowBatch batch;
+      batch.reset(input_batches[0].get_schema());
+      for (const RowRef& ref : sorted_order) {
+        batch.append_row_from(input_batches[ref.batch], ref.row);
+        if (batch.is_full()) {
+          run->write_batch(batch);
+          batch.clear();
+        }
+      }
+      run->write_batch(batch);
+      runs.push_back(std::move(run));
+      input_batches.clear();
+      key_buffers.clear();
+      sorted_order.clear();
+      buffered_rows = 0;
+    }
+
+    // Merges runs merge_fan_out at a time until one pass can merge the rest,
+    // which is left to get_next_batch
+    void merge_runs() {
+      // Same order as the normalized keys
+      auto compare = [this](const RowBatch& a, size_t a_row, const RowBatch& b, size_t b_row) {
+        return sort_order.compare(a, a_row, b, b_row);
+      };
+      while (runs.size() > merge_fan_out) {
+        vector<std::shared_ptr<SpillFile>> merged_runs;
+        for (size_t start = 0; start < runs.size(); start += merge_fan_out) {
+          size_t end = std::min(start + merge_fan_out, runs.size());
+          if (end - start == 1) {
+            merged_runs.push_back(runs[start]);
+            continue;
+          }
+          SortedRunMerger pass(vector<std::shared_ptr<SpillFile>>(runs.begin() + start, runs.begin() + end), compare);
+          auto merged = std::make_shared<SpillFile>(spill_directory);
+          RowBatch batch;
+          while (pass.next_batch(batch)) {
+            merged->write_batch(batch);
+          }
+          merged_runs.push_back(std::move(merged));
+        }
+        runs = std::move(merged_runs);
+      }
+      merger.reset(new SortedRunMerger(std::move(runs), compare));
+      runs.clear();
+    }
+};
+
+/**
+ * The first k rows in sort key order, like ORDER BY ... LIMIT k. Only the
+ * best k rows seen so far are kept, in a heap whose top is the worst of
+ * them, so memory is O(k) and a row that cannot make the cut costs one
+ * comparison.
+ */
+class TopK : public BatchIterator {
+  public:
+    TopK() {}
+    TopK(vector<SortKey> sort_keys, size_t k) : sort_keys(std::move(sort_keys)), k(k) {}
+    TopK(const string& sort_column, size_t k, bool ascending = true) : sort_keys({{sort_column, ascending}}), k(k) {}
+
+    void set_sort_keys(vector<SortKey> sort_keys) {
+      this->sort_keys = std::move(sort_keys);
+    }
+
+    void set_k(size_t k) {
+      this->k = k;
+    }
+
+    void init() {
+      cout << "Initing TopK" << endl;
+      BatchIterator::init();
+      rows.reset(nullptr);
+      heap.clear();
+      output_position = 0;
+      collect_top_rows();
+    }
+
+    void close() {
+      cout << "Closing TopK" << endl;
+      BatchIterator::close();
+      rows.reset(nullptr);
+      heap.clear();
+    }
+
+    bool get_next_batch(RowBatch& batch) {
+      if (output_position >= heap.size()) {
+        return false;
+      }
+      batch.reset(rows.get_schema());
+      while (!batch.is_full() && output_position < heap.size()) {
+        batch.append_row_from(rows, heap[output_position++]);
+      }
+      return true;
+    }
+
+  private:
+    vector<SortKey> sort_keys;
+    size_t k = 0;
+    SortOrder sort_order;
+    // Kept rows live in rows, heap holds their positions. Rows pushed out of
+    // the heap stay in rows until it is compacted.
+    RowBatch rows;
+    vector<size_t> heap;
+    size_t output_position = 0;
+
+    void collect_top_rows() {
+      if (inputs.empty() || k == 0) {
+        return;
+      }
+      auto worse_on_top = [this](size_t a, size_t b) {
+        return sort_order.compare(rows, a, rows, b) < 0;
+      };
+      RowBatch input_batch;
+      while (inputs[0]->get_next_batch(input_batch)) {
+        if (rows.get_schema() != input_batch.get_schema()) {
+          if (rows.get_schema() != nullptr) {
+            throw std::runtime_error("TopK input changed schema");
+          }
+          rows.reset(input_batch.get_schema());
+          sort_order = SortOrder::resolve(*rows.get_schema(), sort_keys);
+        }
+        for (size_t i = 0; i < input_batch.size(); i++) {
+          if (heap.size() < k) {
+            rows.append_row_from(input_batch, i);
+            heap.push_back(rows.size() - 1);
+            std::push_heap(heap.begin(), heap.end(), worse_on_top);
+          } else if (sort_order.compare(input_batch, i, rows, heap.front()) < 0) {
+            std::pop_heap(heap.begin(), heap.end(), worse_on_top);
+            rows.append_row_from(input_batch, i);
+            heap.back() = rows.size() - 1;
+            std::push_heap(heap.begin(), heap.end(), worse_on_top);
+            if (rows.size() >= 2 * k + BATCH_SIZE) {
+              compact();
+            }
+          }
+        }
+      }
+      std::sort_heap(heap.begin(), heap.end(), worse_on_top);
+      compact();
+    }
+
+    // Drops rows that are no longer in the heap, keeping the heap order
+    void compact() {
+      RowBatch kept;
+      kept.reset(rows.get_schema());
+      for (size_t& position : heap) {
+        kept.append_row_from(rows, position);
+        position = kept.size() - 1;
+      }
+      rows = std::move(kept);
+    }
+};
+
+// Passes through the first limit rows, then stops pulling from its input
+class Limit : public BatchIterator {
+  public:
+    Limit() {}
+    Limit(size_t limit) : limit(limit) {}
+
+    void set_limit(size_t limit) {
+      this->limit = limit;
+    }
+
+    void init() {
+      BatchIterator::init();
+      rows_returned = 0;
+    }
+
+    bool get_next_batch(RowBatch& batch) {
+      if (inputs.empty() || rows_returned >= limit) {
+        return false;
+      }
+      if (!inputs[0]->get_next_batch(batch)) {
+        return false;
+      }
+      batch.truncate(limit - rows_returned);
+      rows_returned += batch.size();
+      return true;
+    }
+
+  private:
+    size_t limit = 0;
+    size_t rows_returned = 0;
+};
+
+/**
+ * Approximate distinct count in 2^PRECISION one byte registers, about 2.3%
+ * standard error. Each value hash picks a register by its top bits, which
+ * keeps the longest run of leading zeros seen in the rest. Merging takes the
+ * maximum of each register.
+ */
+class HyperLogLog {
+  public:
+    static constexpr int PRECISION = 11;
+
+    HyperLogLog() : registers(1 << PRECISION, 0) {}
+
+    // hash must be well mixed, as from ColumnVector::hash
+    void add_hash(uint64_t hash) {
+      size_t index = (size_t) (hash >> (64 - PRECISION));
+      // The sentinel bit caps the rank when the remaining bits are all zero
+      uint64_t rest = (hash << PRECISION) | (1ULL << (PRECISION - 1));
+      uint8_t rank = (uint8_t) (__builtin_clzll(rest) + 1);
+      registers[index] = std::max(registers[index], rank);
+    }
+
+    void merge(const HyperLogLog& other) {
+      for (size_t i = 0; i < registers.size(); i++) {
+        registers[i] = std::max(registers[i], other.registers[i]);
+      }
+    }
+
+    int64_t estimate() const {
+      double m = (double) registers.size();
+      double sum = 0.0;
+      size_t zeros = 0;
+      for (uint8_t rank : registers) {
+        sum += std::ldexp(1.0, -rank);
+        zeros += rank == 0;
+      }
+      double estimate = (0.7213 / (1.0 + 1.079 / m)) * m * m / sum;
+      // Linear counting is more accurate while many registers are empty
+      if (estimate <= 2.5 * m && zeros > 0) {
+        estimate = m * std::log(m / (double) zeros);
+      }
+      return (int64_t) std::llround(estimate);
+    }
+
+  private:
+    vector<uint8_t> registers;
+};
+
+/**
+ * KLL quantile sketch. Values enter level 0; a level that outgrows its
+ * capacity is sorted and every other value, starting at a random offset, is
+ * promoted to the next level with twice the weight. Capacities shrink by 2/3
+ * per level below the top, so the sketch holds O(k log(n/k)) values and ranks
+ * are off by about 1.7% at k = 200. Merging concatenates levels and compacts.
+ */
+class KllSketch {
+  public:
+    KllSketch(size_t k = 200) : k(k) {}
+
+    void add(double val) {
+      if (levels.empty()) {
+        levels.emplace_back();
+      }
+      levels[0].push_back(val);
+      num_values++;
+      num_retained++;
+      if (num_retained > total_capacity()) {
+        compress();
+      }
+    }
+
+    void merge(const KllSketch& other) {
+      while (levels.size() < other.levels.size()) {
+        levels.emplace_back();
+      }
+      for (size_t h = 0; h < other.levels.size(); h++) {
+        levels[h].insert(levels[h].end(), other.levels[h].begin(), other.levels[h].end());
+      }
+      num_values += other.num_values;
+      num_retained += other.num_retained;
+      while (num_retained > total_capacity()) {
+        compress();
+      }
+    }
+
+    uint64_t count() const {
+      return num_values;
+    }
+
+    // Value at rank q * count(), for q in [0, 1]
+    double quantile(double q) const {
+      vector<std::pair<double, uint64_t>> weighted;
+      for (size_t h = 0; h < levels.size(); h++) {
+        for (double val : levels[h]) {
+          weighted.push_back({val, 1ULL << h});
+        }
+      }
+      if (weighted.empty()) {
+        return 0.0;
+      }
+      std::sort(weighted.begin(), weighted.end());
+      uint64_t total = 0;
+      for (const auto& item : weighted) {
+        total += item.second;
+      }
+      double target = q * (double) total;
+      uint64_t cumulative = 0;
+      for (const auto& item : weighted) {
+        cumulative += item.second;
+        if ((double) cumulative >= target) {
+          return item.first;
+        }
+      }
+      return weighted.back().first;
+    }
+
+  private:
+    size_t k;
+    vector<vector<double>> levels;
+    size_t num_retained = 0;
+    uint64_t num_values = 0;
+    uint64_t random_state = 0x2545f4914f6cdd1dULL;
+
+    size_t capacity(size_t level) const {
+      size_t depth = levels.size() - level - 1;
+      return std::max<size_t>(2, (size_t) ((double) k * std::pow(2.0 / 3.0, (double) depth)));
+    }
+
+    size_t total_capacity() const {
+      size_t total = 0;
+      for (size_t h = 0; h < levels.size(); h++) {
+        total += capacity(h);
+      }
+      return total;
+    }
+
+    bool random_bit() {
+      random_state ^= random_state << 13;
+      random_state ^= random_state >> 7;
+      random_state ^= random_state << 17;
+      return random_state & 1;
+    }
+
+    // Compacts the lowest level that is over capacity
+    void compress() {
+      for (size_t h = 0; h < levels.size(); h++) {
+        if (levels[h].size() < capacity(h)) {
+          continue;
+        }
+        if (h + 1 == levels.size()) {
+          levels.emplace_back();
+        }
+        vector<double>& level = levels[h];
+        std::sort(level.begin(), level.end());
+        // An odd value out stays behind at this level
+        size_t paired = level.size() & ~(size_t) 1;
+        for (size_t i = random_bit() ? 1 : 0; i < paired; i += 2) {
+          levels[h + 1].push_back(level[i]);
+        }
+        level.erase(level.begin(), level.begin() + paired);
+        num_retained -= paired / 2;
+        return;
+      }
+    }
+};
+
+enum class AggregateFunction { COUNT, SUM, AVG, MIN, MAX, COUNT_DISTINCT, APPROX_COUNT_DISTINCT, APPROX_QUANTILE };
+
+// COUNT with an empty column counts rows. An empty alias is derived from the
+// function and column, e.g. avg_rating, or p99_rating for quantile 0.99.
+struct AggregateSpec {
+  AggregateFunction function;
+  string column;
+  string alias;
+  double quantile = 0.5;
+};
+
+/**
+ * GROUP BY on zero or more columns computing any number of aggregates in one
+ * pass over the input. Each row is mapped to its group through a GroupTable,
+ * then every aggregate updates its per-group state with a tight loop over
+ * the typed input column. Groups come out in order of first appearance.
+ *
+ * With set_parallelism(n), n workers take turns pulling batches from the
+ * input and pre-aggregate them into their own table. The groups of those
+ * tables are then split into n partitions by hash and each partition is
+ * merged into its own final table by one worker, so no table is ever shared
+ * between threads. Groups then come out partition by partition.
+ */
+class HashAggregate : public BatchIterator {
+  public:
+    HashAggregate() {}
+    HashAggregate(vector<string> group_by, vector<AggregateSpec> aggregates)
+      : group_by(std::move(group_by)), aggregates(std::move(aggregates)) {}
+
+    void set_group_by(vector<string> group_by) {
+      this->group_by = std::move(group_by);
+    }
+
+    void add_aggregate(AggregateFunction function, const string& column = "", const string& alias = "") {
+      aggregates.push_back({function, column, alias});
+    }
+
+    void add_spec(const AggregateSpec& spec) {
+      aggregates.push_back(spec);
+    }
+
+    void set_parallelism(size_t num_threads) {
+      this->num_threads = std::max<size_t>(num_threads, 1);
+    }
+
+    // Each pipeline worker aggregates into its own table, and the tables
+    // are merged on the pipeline's pool like set_parallelism does
+    bool set_pipeline(size_t input, std::shared_ptr<Pipeline> pipeline) {
+      this->pipeline = input == 0 ? std::move(pipeline) : nullptr;
+      return this->pipeline != nullptr;
+    }
+
+    void init() {
+      cout << "Initing Hash Aggregate" << endl;
+      BatchIterator::init();
+      input_schema = nullptr;
+      output_schema = nullptr;
+      result_tables.clear();
+      output_table = 0;
+      output_position = 0;
+      consume_input();
+    }
+
+    void close() {
+      cout << "Closing Hash Aggregate" << endl;
+      BatchIterator::close();
+      result_tables.clear();
+    }
+
+    bool get_next_batch(RowBatch& batch) {
+      while (output_table < result_tables.size()
+          && output_position >= result_tables[output_table].groups.size()) {
+        output_table++;
+        output_position = 0;
+      }
+      if (output_table >= result_tables.size()) {
+        return false;
+      }
+      const AggregateTable& table = result_tables[output_table];
+      batch.reset(output_schema);
+      size_t end = std::min(table.groups.size(), output_position + BATCH_SIZE);
+      for (size_t g = output_position; g < end; g++) {
+        for (size_t k = 0; k < group_by.size(); k++) {
+          batch.get_column(k).append_from(table.groups.get_key_column(k), g);
+        }
+        for (size_t a = 0; a < table.states.size(); a++) {
+          append_result(batch.get_column(group_by.size() + a), table.states[a], g);
+        }
+      }
+      batch.set_size(end - output_position);
+      output_position = end;
+      return true;
+    }
+
+  private:
+    // Partial state of one aggregate for every group of a table. Two partial
+    // states of the same group merge into the state of all their rows.
+    struct AggregateState {
+      AggregateFunction function;
+      int input_ordinal = -1;
+      ColumnType input_type = ColumnType::STRING;
+      vector<int64_t> counts;
+      vector<int64_t> int_sums;
+      vector<double> double_sums;
+      // MIN and MAX keep the current extreme of each group in the input type
+      ColumnVector extremes;
+      // COUNT DISTINCT keeps the distinct (group, value) pairs seen so far
+      GroupTable distinct_values;
+      // Fixed size sketches per group for the approximate functions
+      vector<HyperLogLog> hlls;
+      vector<KllSketch> sketches;
+      double quantile = 0.5;
+    };
+
+    struct AggregateTable {
+      GroupTable groups;
+      vector<AggregateState> states;
+    };
+
+    vector<string> group_by;
+    vector<AggregateSpec> aggregates;
+    size_t num_threads = 1;
+    std::unique_ptr<ThreadPool> pool;
+    std::shared_ptr<Pipeline> pipeline;
+    SchemaPtr input_schema;
+    SchemaPtr output_schema;
+    vector<size_t> group_ordinals;
+    // An empty table with resolved types, copied for every new table
+    AggregateTable empty_table;
+    vector<AggregateTable> result_tables;
+    size_t output_table = 0;
+    size_t output_position = 0;
+
+    ThreadPool& get_pool() {
+      if (pipeline != nullptr) {
+        return pipeline->get_pool();
+      }
+      if (pool == nullptr || pool->size() != num_threads) {
+        pool = std::unique_ptr<ThreadPool>(new ThreadPool(num_threads));
+      }
+      return *pool;
+    }
+
+    static bool sums_as_int(const AggregateState& state) {
+      return is_integer_type(state.input_type);
+    }
+
+    static uint64_t distinct_hash(uint32_t group, uint64_t value_hash) {
+      return combine_hashes(combine_hashes(0, mix_hash(group)), value_hash);
+    }
+
+    void consume_input() {
+      SchemaPtr pipeline_schema = pipeline == nullptr ? nullptr : pipeline->open();
+      if (pipeline_schema != nullptr) {
+        consume_pipeline(pipeline_schema);
+      } else {
+        consume_batches();
+      }
+
+      size_t num_groups = 0;
+      for (const auto& table : result_tables) {
+        num_groups += table.groups.size();
+      }
+      if (group_by.empty() && num_groups == 0) {
+        // Like SQL, a global aggregate over no rows is still one row
+        AggregateTable& table = result_tables[0];
+        bool inserted;
+        table.groups.find_or_insert({}, 0, 0, inserted);
+        for (auto& state : table.states) {
+          start_group(state, nullptr, 0);
+          if (state.function == AggregateFunction::MIN || state.function == AggregateFunction::MAX) {
+            state.extremes.append(Value());
+          }
+        }
+      }
+    }
+
+    void consume_pipeline(const SchemaPtr& schema) {
+      resolve_columns(schema);
+      vector<AggregateTable> local_tables(pipeline->num_workers(), empty_table);
+      pipeline->run([this, &local_tables](size_t worker, RowBatch& batch) {
+        add_batch(local_tables[worker], batch);
+      });
+      if (local_tables.size() == 1) {
+        result_tables = std::move(local_tables);
+      } else {
+        merge_local_tables(local_tables);
+      }
+    }
+
+    void consume_batches() {
+      RowBatch first_batch;
+      bool has_rows = !inputs.empty() && inputs[0]->get_next_batch(first_batch);
+      resolve_columns(has_rows ? first_batch.get_schema() : nullptr);
+
+      if (has_rows && num_threads > 1) {
+        consume_input_parallel(first_batch);
+      } else {
+        result_tables.push_back(empty_table);
+        if (has_rows) {
+          add_batch(result_tables[0], first_batch);
+          RowBatch batch;
+          while (inputs[0]->get_next_batch(batch)) {
+            add_batch(result_tables[0], batch);
+          }
+        }
+      }
+    }
+
+    void consume_input_parallel(const RowBatch& first_batch) {
+      vector<AggregateTable> local_tables(num_threads, empty_table);
+      add_batch(local_tables[0], first_batch);
+
+      std::mutex input_mutex;
+      bool input_done = false;
+      vector<std::future<void>> tasks;
+      for (size_t t = 0; t < num_threads; t++) {
+        tasks.push_back(get_pool().submit([this, t, &local_tables, &input_mutex, &input_done]() {
+          RowBatch batch;
+          while (true) {
+            {
+              std::lock_guard<std::mutex> lock(input_mutex);
+              if (input_done || !inputs[0]->get_next_batch(batch)) {
+                input_done = true;
+                return;
+              }
+            }
+            add_batch(local_tables[t], batch);
+          }
+        }));
+      }
+      wait_for_all(tasks);
+      merge_local_tables(local_tables);
+    }
+
+    // Merges the local tables into as many final ones, partitioned by hash
+    void merge_local_tables(vector<AggregateTable>& local_tables) {
+      size_t num_tables = local_tables.size();
+      vector<std::future<void>> tasks;
+
+      // Radix partition the groups and distinct pairs of every local table
+      size_t num_partitions = num_tables;
+      vector<vector<vector<uint32_t>>> partition_groups(num_tables);
+      vector<vector<vector<vector<uint32_t>>>> partition_pairs(num_tables);
+      for (size_t t = 0; t < num_tables; t++) {
+        tasks.push_back(get_pool().submit([&, t]() {
+          const AggregateTable& local = local_tables[t];
+          partition_groups[t].assign(num_partitions, vector<uint32_t>());
+          for (uint32_t g = 0; g < local.groups.size(); g++) {
+            partition_groups[t][partition_of(local.groups.get_hash(g), num_partitions)].push_back(g);
+          }
+          partition_pairs[t].assign(local.states.size(), vector<vector<uint32_t>>(num_partitions));
+          for (size_t a = 0; a < local.states.size(); a++) {
+            const GroupTable& pairs = local.states[a].distinct_values;
+            const vector<int64_t>& pair_groups = pairs.get_key_column(0).get_ints();
+            for (uint32_t pair = 0; pair < pairs.size(); pair++) {
+              uint64_t group_hash = local.groups.get_hash((uint32_t) pair_groups[pair]);
+              partition_pairs[t][a][partition_of(group_hash, num_partitions)].push_back(pair);
+            }
+          }
+        }));
+      }
+      wait_for_all(tasks);
+
+      // Each partition is merged by one task into its own final table
+      result_tables.assign(num_partitions, empty_table);
+      vector<vector<uint32_t>> group_mapping(num_tables);
+      for (size_t t = 0; t < num_tables; t++) {
+        group_mapping[t].resize(local_tables[t].groups.size());
+      }
+      for (size_t p = 0; p < num_partitions; p++) {
+        tasks.push_back(get_pool().submit([&, p]() {
+          AggregateTable& merged = result_tables[p];
+          for (size_t t = 0; t < num_tables; t++) {
+            merge_groups(merged, local_tables[t], partition_groups[t][p], group_mapping[t]);
+          }
+          for (size_t a = 0; a < merged.states.size(); a++) {
+            if (merged.states[a].function != AggregateFunction::COUNT_DISTINCT) {
+              continue;
+            }
+            for (size_t t = 0; t < num_tables; t++) {
+              merge_distinct(merged.states[a], local_tables[t].states[a], partition_pairs[t][a][p], group_mapping[t]);
+            }
+          }
+        }));
+      }
+      wait_for_all(tasks);
+    }
+
+    // High hash bits pick the partition, the tables probe with the low ones
+    static size_t partition_of(uint64_t hash, size_t num_partitions) {
+      return (size_t) ((hash >> 40) % num_partitions);
+    }
+
+    // Adds the listed groups of source into merged, recording where each went
+    void merge_groups(AggregateTable& merged, const AggregateTable& source, const vector<uint32_t>& source_groups,
+        vector<uint32_t>& mapping) {
+      vector<const ColumnVector*> keys;
+      for (size_t k = 0; k < group_by.size(); k++) {
+        keys.push_back(&source.groups.get_key_column(k));
+      }
+      for (uint32_t g : source_groups) {
+        bool inserted;
+        uint32_t target = merged.groups.find_or_insert(keys, g, source.groups.get_hash(g), inserted);
+        mapping[g] = target;
+        for (size_t a = 0; a < merged.states.size(); a++) {
+          AggregateState& into = merged.states[a];
+          const AggregateState& from = source.states[a];
+          if (inserted) {
+            start_group(into, &from.extremes, g);
+          }
+          switch (into.function) {
+            case AggregateFunction::COUNT:
+              into.counts[target] += from.counts[g];
+              break;
+            case AggregateFunction::SUM:
+            case AggregateFunction::AVG:
+              into.counts[target] += from.counts[g];
+              into.int_sums[target] += from.int_sums[g];
+              into.double_sums[target] += from.double_sums[g];
+              break;
+            case AggregateFunction::MIN:
+            case AggregateFunction::MAX: {
+              int sign = into.function == AggregateFunction::MIN ? 1 : -1;
+              if (replaces_extreme(sign, from.extremes, g, into.extremes, target)) {
+                into.extremes.set_from(target, from.extremes, g);
+              }
+              break;
+            }
+            case AggregateFunction::APPROX_COUNT_DISTINCT:
+              into.hlls[target].merge(from.hlls[g]);
+              break;
+            case AggregateFunction::APPROX_QUANTILE:
+              into.sketches[target].merge(from.sketches[g]);
+              break;
+            default:
+              // Distinct counts are rebuilt from the merged pairs
+              break;
+          }
+        }
+      }
+    }
+
+    void merge_distinct(AggregateState& into, const AggregateState& from, const vector<uint32_t>& pairs,
+        const vector<uint32_t>& mapping) {
+      const vector<int64_t>& pair_groups = from.distinct_values.get_key_column(0).get_ints();
+      const ColumnVector& pair_values = from.distinct_values.get_key_column(1);
+      // Gather the pairs with their groups renumbered for the merged table
+      ColumnVector target_groups(ColumnType::INT64);
+      ColumnVector values(pair_values.get_type());
+      for (uint32_t pair : pairs) {
+        target_groups.append(Value::make_int(mapping[pair_groups[pair]]));
+        values.append_from(pair_values, pair);
+      }
+
+      vector<const ColumnVector*> keys = {&target_groups, &values};
+      const vector<int64_t>& targets = target_groups.get_ints();
+      for (size_t i = 0; i < pairs.size(); i++) {
+        uint32_t target = (uint32_t) targets[i];
+        bool inserted;
+        into.distinct_values.find_or_insert(keys, i, distinct_hash(target, values.hash(i)), inserted);
+        into.counts[target] += inserted;
+      }
+    }
+
+    // A null schema means the input was empty, so input types are unknown
+    void resolve_columns(const SchemaPtr& schema) {
+      input_schema = schema;
+      group_ordinals.clear();
+      vector<ColumnType> group_types;
+      vector<std::shared_ptr<StringDictionary>> group_dictionaries;
+      auto new_schema = std::make_shared<Schema>();
+      for (const auto& column : group_by) {
+        int ordinal = schema == nullptr ? -1 : schema->get_ordinal(column);
+        if (schema != nullptr && ordinal < 0) {
+          throw std::runtime_error("Group by column not found: " + column);
+        }
+        ColumnType type = ordinal < 0 ? ColumnType::STRING : schema->get_column((size_t) ordinal).type;
+        std::shared_ptr<StringDictionary> dictionary = ordinal < 0 ? nullptr : schema->get_column((size_t) ordinal).dictionary;
+        group_ordinals.push_back((size_t) std::max(ordinal, 0));
+        group_types.push_back(type);
+        group_dictionaries.push_back(dictionary);
+        new_schema->add_column(column, type, dictionary);
+      }
+      empty_table.groups.reset(group_types, group_dictionaries);
+
+      empty_table.states.clear();
+      for (const auto& spec : aggregates) {
+        AggregateState state;
+        state.function = spec.function;
+        state.quantile = spec.quantile;
+        if (!(spec.function == AggregateFunction::COUNT && spec.column.empty()) && schema != nullptr) {
+          state.input_ordinal = schema->get_ordinal(spec.column);
+          if (state.input_ordinal < 0) {
+            throw std::runtime_error("Aggregate column not found: " + spec.column);
+          }
+          state.input_type = schema->get_column((size_t) state.input_ordinal).type;
+        }
+        if (spec.function == AggregateFunction::APPROX_QUANTILE && state.input_type == ColumnType::STRING
+            && schema != nullptr) {
+          throw std::runtime_error("Quantiles need a numeric column: " + spec.column);
+        }
+        state.extremes = ColumnVector(state.input_type);
+        state.distinct_values.reset({ColumnType::INT64, state.input_type});
+        new_schema->add_column(spec.alias.empty() ? default_alias(spec) : spec.alias, result_type(state));
+        empty_table.states.push_back(std::move(state));
+      }
+      output_schema = std::move(new_schema);
+    }
+
+    static string default_alias(const AggregateSpec& spec) {
+      static const char* names[] = {"count", "sum", "avg", "min", "max", "count_distinct", "approx_count_distinct", ""};
+      string name = names[(int) spec.function];
+      if (spec.function == AggregateFunction::APPROX_QUANTILE) {
+        name = "p" + std::to_string((int) std::lround(spec.quantile * 100));
+      }
+      return spec.column.empty() ? name : name + "_" + spec.column;
+    }
+
+    static ColumnType result_type(const AggregateState& state) {
+      switch (state.function) {
+        case AggregateFunction::COUNT:
+        case AggregateFunction::COUNT_DISTINCT:
+        case AggregateFunction::APPROX_COUNT_DISTINCT:
+          return ColumnType::INT64;
+        case AggregateFunction::SUM:
+          return sums_as_int(state) ? ColumnType::INT64 : ColumnType::DOUBLE;
+        case AggregateFunction::AVG:
+          return ColumnType::DOUBLE;
+        default:
+          return state.input_type;
+      }
+    }
+
+    // Nulls never replace an extreme, and anything replaces a null one
+    static bool replaces_extreme(int sign, const ColumnVector& column, size_t row, const ColumnVector& extremes,
+        size_t group) {
+      if (column.is_null(row)) {
+        return false;
+      }
+      return extremes.is_null(group) || sign * column.compare(row, extremes, group) < 0;
+    }
+
+    // Adds zeroed state for a new group. MIN and MAX start from row of
+    // extreme_source instead, the group's first value.
+    static void start_group(AggregateState& state, const ColumnVector* extreme_source, size_t row) {
+      state.counts.push_back(0);
+      switch (state.function) {
+        case AggregateFunction::SUM:
+        case AggregateFunction::AVG:
+          state.int_sums.push_back(0);
+          state.double_sums.push_back(0.0);
+          break;
+        case AggregateFunction::MIN:
+        case AggregateFunction::MAX:
+          if (extreme_source != nullptr) {
+            state.extremes.append_from(*extreme_source, row);
+          }
+          break;
+        case AggregateFunction::APPROX_COUNT_DISTINCT:
+          state.hlls.emplace_back();
+          break;
+        case AggregateFunction::APPROX_QUANTILE:
+          state.sketches.emplace_back();
+          break;
+        default:
+          break;
+      }
+    }
+
+    void add_batch(AggregateTable& table, const RowBatch& batch) {
+      if (batch.get_schema() != input_schema) {
+        throw std::runtime_error("Hash aggregate input changed schema");
+      }
+      vector<uint64_t> hashes;
+      batch.hash_columns(group_ordinals, hashes);
+      vector<const ColumnVector*> key_columns;
+      for (size_t ordinal : group_ordinals) {
+        key_columns.push_back(&batch.get_column(ordinal));
+      }
+      vector<uint32_t> group_ids(batch.size());
+      for (size_t i = 0; i < batch.size(); i++) {
+        bool inserted;
+        group_ids[i] = table.groups.find_or_insert(key_columns, i, hashes[i], inserted);
+        if (inserted) {
+          for (auto& state : table.states) {
+            start_group(state, state.input_ordinal < 0 ? nullptr : &batch.get_column((size_t) state.input_ordinal), i);
+          }
+        }
+      }
+      for (auto& state : table.states) {
+        update(state, batch, group_ids);
+      }
+    }
+
+    void update(AggregateState& state, const RowBatch& batch, const vector<uint32_t>& group_ids) {
+      size_t num_rows = batch.size();
+      if (state.function == AggregateFunction::COUNT) {
+        for (size_t i = 0; i < num_rows; i++) {
+          state.counts[group_ids[i]]++;
+        }
+        return;
+      }
+
+      const ColumnVector& column = batch.get_column((size_t) state.input_ordinal);
+      switch (state.function) {
+        case AggregateFunction::SUM:
+        case AggregateFunction::AVG:
+          if (column.get_type() == ColumnType::STRING) {
+            // Empty strings are missing values, like nulls
+            const string& name = batch.get_schema()->get_column((size_t) state.input_ordinal).name;
+            for (size_t i = 0; i < num_rows; i++) {
+              double val;
+              if (parse_numeric_field(column.get_string(i), name, val)) {
+                state.double_sums[group_ids[i]] += val;
+                state.counts[group_ids[i]]++;
+              }
+            }
+            break;
+          }
+          if (column.has_nulls()) {
+            // Null slots hold 0, so only the counts have to skip them
+            for (size_t i = 0; i < num_rows; i++) {
+              state.counts[group_ids[i]] += column.is_null(i) ? 0 : 1;
+            }
+          } else {
+            for (size_t i = 0; i < num_rows; i++) {
+              state.counts[group_ids[i]]++;
+            }
+          }
+          if (is_integer_type(column.get_type())) {
+            const vector<int64_t>& vals = column.get_ints();
+            for (size_t i = 0; i < num_rows; i++) {
+              state.int_sums[group_ids[i]] += vals[i];
+            }
+          } else {
+            const vector<double>& vals = column.get_doubles();
+            for (size_t i = 0; i < num_rows; i++) {
+              state.double_sums[group_ids[i]] += vals[i];
+            }
+          }
+          break;
+        case AggregateFunction::MIN:
+        case AggregateFunction::MAX: {
+          int sign = state.function == AggregateFunction::MIN ? 1 : -1;
+          for (size_t i = 0; i < num_rows; i++) {
+            if (replaces_extreme(sign, column, i, state.extremes, group_ids[i])) {
+              state.extremes.set_from(group_ids[i], column, i);
+            }
+          }
+          break;
+        }
+        case AggregateFunction::COUNT_DISTINCT: {
+          ColumnVector group_column(ColumnType::INT64);
+          for (size_t i = 0; i < num_rows; i++) {
+            group_column.append(Value::make_int(group_ids[i]));
+          }
+          vector<const ColumnVector*> keys = {&group_column, &column};
+          for (size_t i = 0; i < num_rows; i++) {
+            if (column.is_null(i)) {
+              continue;
+            }
+            bool inserted;
+            state.distinct_values.find_or_insert(keys, i, distinct_hash(group_ids[i], column.hash(i)), inserted);
+            state.counts[group_ids[i]] += inserted;
+          }
+          break;
+        }
+        case AggregateFunction::APPROX_COUNT_DISTINCT:
+          for (size_t i = 0; i < num_rows; i++) {
+            if (!column.is_null(i)) {
+              state.hlls[group_ids[i]].add_hash(column.hash(i));
+            }
+          }
+          break;
+        case AggregateFunction::APPROX_QUANTILE:
+          if (is_integer_type(column.get_type())) {
+            const vector<int64_t>& vals = column.get_ints();
+            for (size_t i = 0; i < num_rows; i++) {
+              if (!column.is_null(i)) {
+                state.sketches[group_ids[i]].add((double) vals[i]);
+              }
+            }
+          } else {
+            const vector<double>& vals = column.get_doubles();
+            for (size_t i = 0; i < num_rows; i++) {
+              if (!column.is_null(i)) {
+                state.sketches[group_ids[i]].add(vals[i]);
+              }
+            }
+          }
+          break;
+        default:
+          break;
+      }
+    }
+
+    void append_result(ColumnVector& out, const AggregateState& state, size_t group) {
+      switch (state.function) {
+        case AggregateFunction::COUNT:
+        case AggregateFunction::COUNT_DISTINCT:
+          out.append(Value::make_int(state.counts[group]));
+          break;
+        case AggregateFunction::SUM:
+          if (state.counts[group] == 0) {
+            // Like SQL, the sum of no values is null
+            out.append_null();
+          } else if (sums_as_int(state)) {
+            out.append(Value::make_int(state.int_sums[group]));
+          } else {
+            out.append(Value::make_double(state.double_sums[group]));
+          }
+          break;
+        case AggregateFunction::AVG: {
+          double sum = sums_as_int(state) ? (double) state.int_sums[group] : state.double_sums[group];
+          if (state.counts[group] == 0) {
+            out.append_null();
+          } else {
+            out.append(Value::make_double(sum / (double) state.counts[group]));
+          }
+          break;
+        }
+        case AggregateFunction::APPROX_COUNT_DISTINCT:
+          out.append(Value::make_int(state.hlls[group].estimate()));
+          break;
+        case AggregateFunction::APPROX_QUANTILE:
+          // Integer and timestamp columns get the nearest value of their type
+          if (is_integer_type(state.input_type)) {
+            out.append(Value::make_int(std::llround(state.sketches[group].quantile(state.quantile))));
+          } else {
+            out.append(Value::make_double(state.sketches[group].quantile(state.quantile)));
+          }
+          break;
+        default:
+          out.append_from(state.extremes, group);
+      }
+    }
+};
+
+// Single row approximate COUNT(DISTINCT column), see HyperLogLog
+class ApproxCountDistinct : public HashAggregate {
+  public:
+    ApproxCountDistinct(const string& column, const string& alias = "")
+      : HashAggregate({}, {{AggregateFunction::APPROX_COUNT_DISTINCT, column, alias}}) {}
+};
+
+// Single row of approximate quantiles of column, one column per quantile
+class ApproxQuantile : public HashAggregate {
+  public:
+    ApproxQuantile(const string& column, const vector<double>& quantiles) {
+      for (double quantile : quantiles) {
+        AggregateSpec spec = {AggregateFunction::APPROX_QUANTILE, column, ""};
+        spec.quantile = quantile;
+        add_spec(spec);
+      }
+    }
+};
+
+class Projection : public BatchIterator {
+  public:
+    Projection() {}
+    Projection(vector<string> columns) : columns(std::move(columns)) {}
+
+    void set_columns(vector<string> columns) {
+      this->columns = std::move(columns);
+    }
+
+    void init() {
+      cout << "Projection Node Inited" << endl;
+      // Scans that can narrow their own output never parse the other columns
+      pushed_down = !inputs.empty() && !columns.empty() && inputs[0]->push_down_projection(columns);
+      input_schema = nullptr;
+      BatchIterator::init();
+    }
+
+    void close() {
+      cout << "Projection Node closed" << endl;
+      BatchIterator::close();
+    }
+
+    bool get_next_batch(RowBatch& batch) {
+      if (inputs.empty()) {
+        return false;
+      }
+      if (pushed_down || columns.empty()) {
+        return inputs[0]->get_next_batch(batch);
+      }
+      if (!inputs[0]->get_next_batch(input_batch)) {
+        return false;
+      }
+      if (input_batch.get_schema() != input_schema) {
+        resolve_columns(input_batch.get_schema());
+      }
+      batch.reset(output_schema);
+      for (size_t i = 0; i < ordinals.size(); i++) {
+        batch.get_column(i).append_all(input_batch.get_column(ordinals[i]));
+      }
+      batch.set_size(input_batch.size());
+      return true;
+    }
+
+    unique_ptr<PipelineStage> make_pipeline_stage(const SchemaPtr& schema, SchemaPtr& result_schema) {
+      if (pushed_down || columns.empty()) {
+        result_schema = schema;
+        return unique_ptr<PipelineStage>(new ProjectStage({}, nullptr));
+      }
+      // Every worker's stage shares one output schema
+      if (schema != input_schema) {
+        resolve_columns(schema);
+      }
+      result_schema = output_schema;
+      return unique_ptr<PipelineStage>(new ProjectStage(ordinals, output_schema));
+    }
+
+  private:
+    // A null schema passes batches through unchanged
+    class ProjectStage : public PipelineStage {
+      public:
+        ProjectStage(vector<size_t> ordinals, SchemaPtr schema) : ordinals(std::move(ordinals)), schema(std::move(schema)) {}
+
+        void process(RowBatch& batch) {
+          if (schema == nullptr) {
+            return;
+          }
+          output.reset(schema);
+          for (size_t i = 0; i < ordinals.size(); i++) {
+            output.get_column(i).append_all(batch.get_column(ordinals[i]));
+          }
+          output.set_size(batch.size());
+          std::swap(batch, output);
+        }
+
+      private:
+        vector<size_t> ordinals;
+        SchemaPtr schema;
+        RowBatch output;
+    };
+
+    vector<string> columns;
+    bool pushed_down = false;
+    RowBatch input_batch;
+    SchemaPtr input_schema;
+    SchemaPtr output_schema;
+    vector<size_t> ordinals;
+
+    void resolve_columns(const SchemaPtr& schema) {
+      auto new_schema = std::make_shared<Schema>();
+      ordinals.clear();
+      for (const auto& column : columns) {
+        int ordinal = schema->get_ordinal(column);
+        if (ordinal < 0) {
+          throw std::runtime_error("Projection column not found: " + column);
+        }
+        ordinals.push_back((size_t) ordinal);
+        new_schema->add_column(column, schema->get_column((size_t) ordinal).type, schema->get_column((size_t) ordinal).dictionary);
+      }
+      input_schema = schema;
+      output_schema = std::move(new_schema);
+    }
+};
+
+/**
+ * Output layout of a join: the left columns followed by the right ones. A
+ * right column whose name is already taken is renamed to "right.<name>".
+ */
+SchemaPtr merge_join_schemas(const Schema& left, const Schema& right) {
+  auto merged = std::make_shared<Schema>(left.get_columns());
+  for (const auto& column : right.get_columns()) {
+    string name = column.name;
+    while (merged->get_ordinal(name) >= 0) {
+      name = "right." + name;
+    }
+    merged->add_column(name, column.type, column.dictionary);
+  }
+  return merged;
+}
+
+// Appends left_row of left followed by right_row of right to a batch laid
+// out by merge_join_schemas. A null right pads the right columns instead.
+void append_joined_row(RowBatch& batch, const RowBatch& left, size_t left_row,
+    const RowBatch* right, size_t right_row) {
+  for (size_t i = 0; i < left.num_columns(); i++) {
+    batch.get_column(i).append_from(left.get_column(i), left_row);
+  }
+  for (size_t i = left.num_columns(); i < batch.num_columns(); i++) {
+    if (right != nullptr) {
+      batch.get_column(i).append_from(right->get_column(i - left.num_columns()), right_row);
+    } else {
+      batch.get_column(i).append(Value());
+    }
+  }
+  batch.set_size(batch.size() + 1);
+}
+
+class NestedJoin : public Iterator {
+  public:
+
+    NestedJoin() {}
 
     void init() {
-      cout <<  "Initing Average Iterator" << endl;
+      check_for_required_inputs();
       Iterator::init();
-      total_count = 0;
-      running_sum = 0.0;
+      current_r = nullptr;
+      s_position = 0;
+      buffer_inner_input();
     }
+
     void close() {
-      cout << "Closing Average Iterator" << endl;
       Iterator::close();
+      s_rows.clear();
+      current_r = nullptr;
     }
 
-    void set_result_alias(const string& alias) {
-      result_alias = alias;
+    void set_predicate(bool (*theta) (const std::unique_ptr<RowTuple>&, const std::unique_ptr<RowTuple>&)) {
+      this->theta = theta;
     }
 
-    void set_col_to_avg(const string& col_name) {
-      this->column_to_avg = col_name;
+    unique_ptr<RowTuple> get_next_ptr() {
+      unique_ptr<Iterator>& R = inputs[0];
+      if (current_r == nullptr) {
+        this->current_r = R->get_next_ptr();
+      }
+      while (this->current_r != nullptr) {
+        unique_ptr<RowTuple>& r = this->current_r;
+        while (s_position < s_rows.size()) {
+          const unique_ptr<RowTuple>& s = s_rows[s_position++];
+          if (theta(r,s)) {
+            return merge_row_tuples(r, s);
+          }
+        }
+        s_position = 0;
+        this->current_r = R->get_next_ptr();
+      }
+      return nullptr;
     }
 
-    /* Pointer representation */
-    unique_ptr<RowTuple> get_next_ptr() {
-      if (inputs.empty() || column_to_avg == "") {
-        cout << "Average: Either inputs or target col name not set" << endl;
-        return nullptr;
+  private:
+    unique_ptr<RowTuple> current_r;
+    // The inner input is read once and rescanned from memory for every outer row
+    vector<unique_ptr<RowTuple>> s_rows;
+    size_t s_position = 0;
+    SchemaPtr r_schema;
+    SchemaPtr s_schema;
+    SchemaPtr merged_schema;
+
+    bool (*theta) (const std::unique_ptr<RowTuple>&, const std::unique_ptr<RowTuple>&) = nullptr;
+
+    void check_for_required_inputs() {
+      if (theta == nullptr) {
+        throw std::runtime_error("Nested Join requires a predicate function");
+      }
+      if (inputs.size() != 2) {
+        throw std::runtime_error("Nested join requires two inputs");
       }
+    }
 
-      unique_ptr<Iterator>& input = inputs[0];
-      unique_ptr<RowTuple> curr_tuple;
+    void buffer_inner_input() {
+      s_rows.clear();
+      unique_ptr<RowTuple> s;
+      while ((s = inputs[1]->get_next_ptr()) != nullptr) {
+        s_rows.push_back(std::move(s));
+      }
+    }
 
-      while((curr_tuple = input->get_next_ptr()) != nullptr) {
-        string val = curr_tuple->get_value(this->column_to_avg);
-        if (val == "") {
-          // Assuming that all or none of the tuples contain the column to sort on 
-          // Revisit this logic if necessary
-          cout << "Average: No value in row_tuple matching key: " << this->column_to_avg << endl;
-          return nullptr;
+    unique_ptr<RowTuple> merge_row_tuples(const unique_ptr<RowTuple>& r, const unique_ptr<RowTuple>& s) {
+      if (r->get_schema() != r_schema || s->get_schema() != s_schema) {
+        r_schema = r->get_schema();
+        s_schema = s->get_schema();
+        merged_schema = merge_join_schemas(*r_schema, *s_schema);
+      }
+      vector<Value> values(r->get_values());
+      values.insert(values.end(), s->get_values().begin(), s->get_values().end());
+      return unique_ptr<RowTuple>(new RowTuple(merged_schema, std::move(values)));
+    }
+};
+
+enum class JoinType {
+  INNER,
+  LEFT,  // Unmatched left rows are kept, padded with empty right columns
+  SEMI,  // Left rows with at least one match, left columns only
+  ANTI   // Left rows without a match, left columns only
+};
+
+/**
+ * Equi-join of inputs[0] (left) and inputs[1] (right) on one or more key
+ * columns. One side is read into memory and indexed by key hash, then the
+ * other side streams through and probes it.
+ *
+ * Inner joins build on whichever input turns out smaller: both inputs are
+ * read a batch at a time until one runs out. Left, semi and anti joins always
+ * build on the right input.
+ *
+ * With a memory budget set, a build side that outgrows it turns this into a
+ * Grace hash join: both inputs are hashed into num_partitions spill files
+ * each, and every pair of partitions is joined by a child HashJoin with the
+ * same budget. A child whose partition is still too big repartitions it with
+ * a different hash seed, down to MAX_SPILL_DEPTH levels.
+ */
+class HashJoin : public BatchIterator {
+  public:
+    HashJoin() {}
+    HashJoin(const string& left_key, const string& right_key, JoinType join_type = JoinType::INNER)
+      : left_keys({left_key}), right_keys({right_key}), join_type(join_type) {}
+    HashJoin(vector<string> left_keys, vector<string> right_keys, JoinType join_type = JoinType::INNER)
+      : left_keys(std::move(left_keys)), right_keys(std::move(right_keys)), join_type(join_type) {}
+
+    void set_keys(vector<string> left_keys, vector<string> right_keys) {
+      this->left_keys = std::move(left_keys);
+      this->right_keys = std::move(right_keys);
+    }
+
+    void set_join_type(JoinType join_type) {
+      this->join_type = join_type;
+    }
+
+    // Bytes of build rows to hold in memory before spilling, 0 for no limit
+    void set_memory_budget(size_t bytes) {
+      memory_budget = bytes;
+    }
+
+    void set_num_partitions(size_t num_partitions) {
+      this->num_partitions = std::max<size_t>(num_partitions, 2);
+    }
+
+    void set_spill_directory(const string& directory) {
+      spill_directory = directory;
+    }
+
+    /**
+     * A pipeline on the right input makes it the build side, whatever the
+     * join type. Pipeline workers each keep the batches of their morsels
+     * along with the key hashes, and the hash table is built over all of
+     * them. Joins with a memory budget read their inputs in order.
+     */
+    bool set_pipeline(size_t input, std::shared_ptr<Pipeline> pipeline) {
+      build_pipeline = input == 1 && memory_budget == 0 ? std::move(pipeline) : nullptr;
+      return build_pipeline != nullptr;
+    }
+
+    void init() {
+      if (depth == 0) {
+        cout << "Initing Hash Join" << endl;
+      }
+      if (inputs.size() != 2) {
+        throw std::runtime_error("Hash join requires two inputs");
+      }
+      if (left_keys.empty() || left_keys.size() != right_keys.size()) {
+        throw std::runtime_error("Hash join requires the same number of left and right keys");
+      }
+      BatchIterator::init();
+      clear_state();
+      read_build_input();
+      if (spilled) {
+        partition_inputs();
+      } else {
+        build_hash_table();
+      }
+    }
+
+    void close() {
+      if (depth == 0) {
+        cout << "Closing Hash Join" << endl;
+      }
+      BatchIterator::close();
+      clear_state();
+    }
+
+    bool get_next_batch(RowBatch& batch) {
+      if (spilled) {
+        return get_next_partition_batch(batch);
+      }
+      batch.reset(output_schema);
+      while (!batch.is_full()) {
+        if (probe_row >= probe_batch.size()) {
+          if (!load_probe_batch()) {
+            break;
+          }
+          if (probe_batch.get_schema() != probe_schema) {
+            resolve_probe_schema();
+            if (batch.size() > 0) {
+              // Rows already in batch use the previous layout
+              return true;
+            }
+            batch.reset(output_schema);
+          }
+          probe_batch.hash_columns(probe_key_ordinals, probe_hashes);
+          continue;
         }
-        double converted_val = std::stod(val.c_str());
-        if (!converted_val) {
-          cout << "Avg: Conversion to long failed" << endl;
-          return nullptr;
+        probe(batch);
+      }
+      return batch.size() > 0;
+    }
+
+  private:
+    // Position of a row inside build_batches
+    struct RowRef {
+      uint32_t batch;
+      uint32_t row;
+    };
+
+    static constexpr uint32_t END_OF_CHAIN = UINT32_MAX;
+    static constexpr size_t MAX_SPILL_DEPTH = 4;
+    // Hash table bytes per build row: entry, hash, chain link and ~2 buckets
+    static constexpr size_t HASH_ENTRY_BYTES = sizeof(RowRef) + sizeof(uint64_t) + 3 * sizeof(uint32_t);
+
+    vector<string> left_keys;
+    vector<string> right_keys;
+    JoinType join_type = JoinType::INNER;
+    bool build_is_left = false;
+
+    size_t memory_budget = 0;
+    size_t num_partitions = 16;
+    string spill_directory = default_spill_directory();
+    // Repartitioning level, a child join of a spilled join is one deeper
+    size_t depth = 0;
+    bool spilled = false;
+    SchemaPtr build_schema;
+    // Known up front by partition joins, whose build partition may be empty
+    SchemaPtr build_schema_hint;
+    vector<std::shared_ptr<SpillFile>> build_partitions;
+    vector<std::shared_ptr<SpillFile>> probe_partitions;
+    size_t next_partition = 0;
+    unique_ptr<Iterator> partition_join;
+    std::shared_ptr<Pipeline> build_pipeline;
+
+    vector<RowBatch> build_batches;
+    // Key hashes of each build batch, when the pipeline workers computed them
+    vector<vector<uint64_t>> build_hashes;
+    vector<size_t> build_key_ordinals;
+    // Chained hash table over the build rows: heads is indexed by the low
+    // bits of the hash and next links entries with the same bucket
+    vector<RowRef> entries;
+    vector<uint64_t> entry_hashes;
+    vector<uint32_t> next;
+    vector<uint32_t> heads;
+    uint64_t bucket_mask = 0;
+
+    // Probe rows read while picking the build side, consumed before the input
+    vector<RowBatch> pending_probe_batches;
+    size_t pending_position = 0;
+    bool probe_exhausted = false;
+    RowBatch probe_batch;
+    SchemaPtr probe_schema;
+    vector<size_t> probe_key_ordinals;
+    vector<uint64_t> probe_hashes;
+    SchemaPtr output_schema;
+
+    // Where probing stopped when the output batch filled up
+    size_t probe_row = 0;
+    bool chain_started = false;
+    uint32_t chain = END_OF_CHAIN;
+    bool matched = false;
+
+    void clear_state() {
+      spilled = false;
+      build_schema = build_schema_hint;
+      build_partitions.clear();
+      probe_partitions.clear();
+      next_partition = 0;
+      if (partition_join != nullptr) {
+        partition_join->close();
+        partition_join.reset();
+      }
+      build_batches.clear();
+      build_hashes.clear();
+      entries.clear();
+      entry_hashes.clear();
+      next.clear();
+      heads.clear();
+      pending_probe_batches.clear();
+      pending_position = 0;
+      probe_exhausted = false;
+      probe_batch.reset(nullptr);
+      probe_schema = nullptr;
+      output_schema = nullptr;
+      probe_row = 0;
+      chain_started = false;
+      chain = END_OF_CHAIN;
+    }
+
+    unique_ptr<Iterator>& probe_input() {
+      return inputs[build_is_left ? 1 : 0];
+    }
+
+    bool over_budget(size_t num_rows, size_t num_bytes) const {
+      return memory_budget > 0 && depth < MAX_SPILL_DEPTH
+        && num_bytes + num_rows * HASH_ENTRY_BYTES > memory_budget;
+    }
+
+    void read_build_input() {
+      SchemaPtr pipeline_schema = build_pipeline == nullptr ? nullptr : build_pipeline->open();
+      if (pipeline_schema != nullptr) {
+        read_build_pipeline(pipeline_schema);
+        return;
+      }
+      if (join_type != JoinType::INNER) {
+        build_is_left = false;
+        size_t num_rows = 0;
+        size_t num_bytes = 0;
+        bool done = false;
+        while (!done && !over_budget(num_rows, num_bytes)) {
+          done = !read_one(*inputs[1], build_batches, num_rows, num_bytes);
+        }
+        spilled = !done;
+        return;
+      }
+
+      vector<RowBatch> left_batches;
+      vector<RowBatch> right_batches;
+      size_t left_rows = 0;
+      size_t right_rows = 0;
+      size_t num_bytes = 0;
+      bool left_done = false;
+      bool right_done = false;
+      while (!left_done && !right_done) {
+        if (over_budget(left_rows + right_rows, num_bytes)) {
+          // Neither side fits, both get partitioned
+          spilled = true;
+          break;
         }
-        running_sum += converted_val;
-        total_count++;
+        left_done = !read_one(*inputs[0], left_batches, left_rows, num_bytes);
+        right_done = !read_one(*inputs[1], right_batches, right_rows, num_bytes);
       }
-      double avg = total_count == 0 ? 0.0 : ((running_sum)/((double) total_count));
+      build_is_left = left_done && (!right_done || left_rows <= right_rows);
+      if (spilled) {
+        build_is_left = left_rows <= right_rows;
+      }
+      build_batches = std::move(build_is_left ? left_batches : right_batches);
+      pending_probe_batches = std::move(build_is_left ? right_batches : left_batches);
+      probe_exhausted = build_is_left ? right_done : left_done;
+    }
 
-      return std::unique_ptr<RowTuple>(
-          new RowTuple(std::unordered_map<string, string>{{result_alias, std::to_string(avg)}}));
+    void read_build_pipeline(const SchemaPtr& schema) {
+      build_is_left = false;
+      build_schema = schema;
+      vector<size_t> key_ordinals = resolve_keys(*schema, right_keys);
+      vector<vector<RowBatch>> local_batches(build_pipeline->num_workers());
+      vector<vector<vector<uint64_t>>> local_hashes(build_pipeline->num_workers());
+      build_pipeline->run([&](size_t worker, RowBatch& batch) {
+        local_hashes[worker].emplace_back();
+        batch.hash_columns(key_ordinals, local_hashes[worker].back());
+        local_batches[worker].push_back(std::move(batch));
+      });
+      for (size_t w = 0; w < local_batches.size(); w++) {
+        for (size_t b = 0; b < local_batches[w].size(); b++) {
+          build_batches.push_back(std::move(local_batches[w][b]));
+          build_hashes.push_back(std::move(local_hashes[w][b]));
+        }
+      }
     }
 
-  private:
-    string result_alias = "Average";
-    string column_to_avg = "";
-    long total_count;
-    double running_sum; // TODO guard against overflow
+    static bool read_one(Iterator& input, vector<RowBatch>& batches, size_t& num_rows, size_t& num_bytes) {
+      RowBatch batch;
+      if (!input.get_next_batch(batch)) {
+        return false;
+      }
+      num_rows += batch.size();
+      num_bytes += batch.memory_usage();
+      batches.push_back(std::move(batch));
+      return true;
+    }
+
+    static vector<size_t> resolve_keys(const Schema& schema, const vector<string>& keys) {
+      vector<size_t> ordinals;
+      for (const auto& key : keys) {
+        int ordinal = schema.get_ordinal(key);
+        if (ordinal < 0) {
+          throw std::runtime_error("Join key not found: " + key);
+        }
+        ordinals.push_back((size_t) ordinal);
+      }
+      return ordinals;
+    }
+
+    void build_hash_table() {
+      if (build_batches.empty()) {
+        return;
+      }
+      build_schema = build_batches[0].get_schema();
+      build_key_ordinals = resolve_keys(*build_schema, build_is_left ? left_keys : right_keys);
+
+      vector<uint64_t> hashes;
+      for (uint32_t b = 0; b < build_batches.size(); b++) {
+        if (build_batches[b].get_schema() != build_schema) {
+          throw std::runtime_error("Hash join build input changed schema");
+        }
+        if (build_hashes.empty()) {
+          build_batches[b].hash_columns(build_key_ordinals, hashes);
+        }
+        const vector<uint64_t>& batch_hashes = build_hashes.empty() ? hashes : build_hashes[b];
+        for (uint32_t i = 0; i < build_batches[b].size(); i++) {
+          entries.push_back({b, i});
+          entry_hashes.push_back(batch_hashes[i]);
+        }
+      }
+
+      size_t num_buckets = 16;
+      while (num_buckets < entries.size() * 2) {
+        num_buckets *= 2;
+      }
+      bucket_mask = num_buckets - 1;
+      heads.assign(num_buckets, END_OF_CHAIN);
+      next.resize(entries.size());
+      for (uint32_t e = 0; e < entries.size(); e++) {
+        uint64_t bucket = entry_hashes[e] & bucket_mask;
+        next[e] = heads[bucket];
+        heads[bucket] = e;
+      }
+    }
+
+    unique_ptr<Iterator>& build_input() {
+      return inputs[build_is_left ? 0 : 1];
+    }
+
+    // Moves everything read so far and the rest of both inputs to disk
+    void partition_inputs() {
+      uint64_t seed = 0x9e3779b97f4a7c15ULL * (depth + 1);
+      const vector<string>& build_keys = build_is_left ? left_keys : right_keys;
+      const vector<string>& probe_keys = build_is_left ? right_keys : left_keys;
+
+      SpillPartitioner build_partitioner(num_partitions, seed, spill_directory);
+      drain_into(build_partitioner, build_batches, *build_input(), build_keys, build_schema);
+      build_partitions = build_partitioner.finish(build_schema);
+
+      SchemaPtr probe_schema_seen;
+      SpillPartitioner probe_partitioner(num_partitions, seed, spill_directory);
+      drain_into(probe_partitioner, pending_probe_batches,
+          *probe_input(), probe_keys, probe_schema_seen, probe_exhausted);
+      probe_partitions = probe_partitioner.finish(probe_schema_seen);
+      probe_exhausted = true;
+    }
+
+    static void drain_into(SpillPartitioner& partitioner, vector<RowBatch>& buffered, Iterator& input,
+        const vector<string>& keys, SchemaPtr& schema, bool input_done = false) {
+      vector<size_t> key_ordinals;
+      bool keys_resolved = false;
+      auto add = [&](const RowBatch& batch) {
+        // schema may already hold the hint for this input, so the keys are
+        // resolved on the first batch either way
+        if (!keys_resolved || batch.get_schema() != schema) {
+          keys_resolved = true;
+          schema = batch.get_schema();
+          key_ordinals = resolve_keys(*schema, keys);
+        }
+        partitioner.add(batch, key_ordinals);
+      };
+      for (const auto& batch : buffered) {
+        add(batch);
+      }
+      buffered.clear();
+      RowBatch batch;
+      while (!input_done && input.get_next_batch(batch)) {
+        add(batch);
+      }
+    }
+
+    bool get_next_partition_batch(RowBatch& batch) {
+      while (true) {
+        if (partition_join != nullptr) {
+          if (partition_join->get_next_batch(batch)) {
+            return true;
+          }
+          partition_join->close();
+          partition_join.reset();
+        }
+        if (next_partition >= build_partitions.size()) {
+          return false;
+        }
+        open_partition_join(next_partition++);
+      }
+    }
+
+    void open_partition_join(size_t partition) {
+      std::shared_ptr<SpillFile>& build = build_partitions[partition];
+      std::shared_ptr<SpillFile>& probe = probe_partitions[partition];
+      bool keeps_unmatched = join_type == JoinType::LEFT || join_type == JoinType::ANTI;
+      if (probe->num_rows() == 0 || (build->num_rows() == 0 && !keeps_unmatched)) {
+        return;
+      }
+
+      uint64_t total_build_rows = 0;
+      for (const auto& file : build_partitions) {
+        total_build_rows += file->num_rows();
+      }
+      HashJoin* child = new HashJoin(left_keys, right_keys, join_type);
+      child->memory_budget = memory_budget;
+      child->num_partitions = num_partitions;
+      child->spill_directory = spill_directory;
+      // A partition that did not split at all is one hot key, splitting
+      // it again cannot help
+      child->depth = build->num_rows() == total_build_rows ? MAX_SPILL_DEPTH : depth + 1;
+      child->build_schema_hint = build->get_schema();
+      child->append_input(unique_ptr<Iterator>(new SpillScan(build_is_left ? build : probe)));
+      child->append_input(unique_ptr<Iterator>(new SpillScan(build_is_left ? probe : build)));
+      partition_join.reset(child);
+      partition_join->init();
+    }
+
+    bool load_probe_batch() {
+      probe_row = 0;
+      chain_started = false;
+      if (pending_position < pending_probe_batches.size()) {
+        probe_batch = std::move(pending_probe_batches[pending_position++]);
+        return true;
+      }
+      pending_probe_batches.clear();
+      if (probe_exhausted || !probe_input()->get_next_batch(probe_batch)) {
+        probe_exhausted = true;
+        probe_batch.reset(probe_batch.get_schema());
+        return false;
+      }
+      return true;
+    }
+
+    void resolve_probe_schema() {
+      probe_schema = probe_batch.get_schema();
+      probe_key_ordinals = resolve_keys(*probe_schema, build_is_left ? right_keys : left_keys);
+      if (build_schema != nullptr) {
+        build_key_ordinals = resolve_keys(*build_schema, build_is_left ? left_keys : right_keys);
+        for (size_t k = 0; k < probe_key_ordinals.size(); k++) {
+          ColumnType probe_type = probe_schema->get_column(probe_key_ordinals[k]).type;
+          ColumnType build_type = build_schema->get_column(build_key_ordinals[k]).type;
+          if ((probe_type == ColumnType::STRING) != (build_type == ColumnType::STRING)) {
+            throw std::runtime_error("Join keys " + left_keys[k] + " and " + right_keys[k] + " have incompatible types");
+          }
+        }
+      }
+
+      if (join_type == JoinType::SEMI || join_type == JoinType::ANTI) {
+        output_schema = probe_schema;
+      } else if (build_schema == nullptr) {
+        // Nothing was read from the right input, so its columns are unknown
+        output_schema = probe_schema;
+      } else if (build_is_left) {
+        output_schema = merge_join_schemas(*build_schema, *probe_schema);
+      } else {
+        output_schema = merge_join_schemas(*probe_schema, *build_schema);
+      }
+    }
+
+    bool keys_equal(const RowRef& ref, size_t row) const {
+      const RowBatch& build = build_batches[ref.batch];
+      for (size_t k = 0; k < build_key_ordinals.size(); k++) {
+        if (build.get_column(build_key_ordinals[k]).compare(
+              ref.row, probe_batch.get_column(probe_key_ordinals[k]), row) != 0) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // Advances through probe rows until batch is full or probe_batch is done
+    void probe(RowBatch& batch) {
+      while (probe_row < probe_batch.size()) {
+        uint64_t hash = probe_hashes[probe_row];
+        if (!chain_started) {
+          chain = heads.empty() ? END_OF_CHAIN : heads[hash & bucket_mask];
+          chain_started = true;
+          matched = false;
+        }
+        while (chain != END_OF_CHAIN) {
+          if (batch.is_full()) {
+            return;
+          }
+          uint32_t entry = chain;
+          chain = next[entry];
+          if (entry_hashes[entry] != hash || !keys_equal(entries[entry], probe_row)) {
+            continue;
+          }
+          matched = true;
+          if (join_type == JoinType::SEMI || join_type == JoinType::ANTI) {
+            chain = END_OF_CHAIN;
+            break;
+          }
+          append_match(batch, entries[entry]);
+        }
+
+        if (batch.is_full()) {
+          return;
+        }
+        if ((join_type == JoinType::SEMI && matched) || (join_type == JoinType::ANTI && !matched)) {
+          batch.append_row_from(probe_batch, probe_row);
+        } else if (join_type == JoinType::LEFT && !matched) {
+          append_joined_row(batch, probe_batch, probe_row, nullptr, 0);
+        }
+        probe_row++;
+        chain_started = false;
+      }
+    }
+
+    void append_match(RowBatch& batch, const RowRef& ref) {
+      const RowBatch& build = build_batches[ref.batch];
+      if (build_is_left) {
+        append_joined_row(batch, build, ref.row, &probe_batch, probe_row);
+      } else {
+        append_joined_row(batch, probe_batch, probe_row, &build, ref.row);
+      }
+    }
 };
 
-class Distinct : public Iterator {
-  // Note, input needs to be in sorted order for this operator to work
+
+/**
+ * Equi-join of two inputs that are both sorted ascending on their join keys,
+ * e.g. Sort outputs or files written in key order. Both inputs are read once,
+ * in step. Only the right rows of the current key are held in memory, so
+ * they can be paired with every left row of that key.
+ */
+class MergeJoin : public BatchIterator {
   public:
-    Distinct() {}
+    MergeJoin() {}
+    MergeJoin(const string& left_key, const string& right_key, JoinType join_type = JoinType::INNER)
+      : left_keys({left_key}), right_keys({right_key}), join_type(join_type) {}
+    MergeJoin(vector<string> left_keys, vector<string> right_keys, JoinType join_type = JoinType::INNER)
+      : left_keys(std::move(left_keys)), right_keys(std::move(right_keys)), join_type(join_type) {}
+
+    void set_keys(vector<string> left_keys, vector<string> right_keys) {
+      this->left_keys = std::move(left_keys);
+      this->right_keys = std::move(right_keys);
+    }
+
+    void set_join_type(JoinType join_type) {
+      this->join_type = join_type;
+    }
 
     void init() {
-      cout << "Initing Distinct Node" << endl;
-      Iterator::init();
+      cout << "Initing Merge Join" << endl;
+      if (inputs.size() != 2) {
+        throw std::runtime_error("Merge join requires two inputs");
+      }
+      if (left_keys.empty() || left_keys.size() != right_keys.size()) {
+        throw std::runtime_error("Merge join requires the same number of left and right keys");
+      }
+      BatchIterator::init();
+      left_batch.reset(nullptr);
+      right_batch.reset(nullptr);
+      right_run.reset(nullptr);
+      left_row = 0;
+      right_row = 0;
+      left_done = false;
+      right_done = false;
+      run_active = false;
+      run_position = 0;
+      left_schema = nullptr;
+      right_schema = nullptr;
+      output_schema = nullptr;
     }
 
     void close() {
-      cout << "Closing Distinct Node" << endl;
-      Iterator::close();
+      cout << "Closing Merge Join" << endl;
+      BatchIterator::close();
+      left_batch.reset(nullptr);
+      right_batch.reset(nullptr);
+      right_run.reset(nullptr);
     }
 
-    std::unique_ptr<RowTuple> get_next_ptr() {
-      if (inputs.empty()) {
-        return nullptr;
+    bool get_next_batch(RowBatch& batch) {
+      if (!has_left_row()) {
+        return false;
       }
-      std::unique_ptr<Iterator>& input = inputs[0];
-      std::unique_ptr<RowTuple> curr_tuple;
+      has_right_row();
+      resolve_schemas();
+      batch.reset(output_schema);
 
-      while((curr_tuple = input->get_next_ptr()) != nullptr) {
-        if (curr_reference == nullptr) {
-          curr_reference = std::move(curr_tuple);
-        }
-        else {
-          if (*curr_reference != *curr_tuple) {
-            auto return_val = std::move(curr_reference);
-            curr_reference = std::move(curr_tuple);
-            return return_val;
+      while (!batch.is_full() && has_left_row()) {
+        if (run_active) {
+          if (compare_keys(left_batch, left_row, left_ordinals, right_run, 0, right_ordinals) != 0) {
+            run_active = false;
+            continue;
+          }
+          if (!emit_run(batch)) {
+            return true;
           }
+          left_row++;
+          continue;
         }
 
+        int cmp = has_right_row() ? compare_keys(left_batch, left_row, left_ordinals, right_batch, right_row, right_ordinals) : -1;
+        if (cmp < 0) {
+          if (join_type == JoinType::LEFT) {
+            append_joined_row(batch, left_batch, left_row, nullptr, 0);
+          } else if (join_type == JoinType::ANTI) {
+            batch.append_row_from(left_batch, left_row);
+          }
+          left_row++;
+        } else if (cmp > 0) {
+          right_row++;
+        } else {
+          read_right_run();
+        }
       }
-      if (curr_reference != nullptr) {
-        return std::move(curr_reference);
-      }
-      return nullptr;
+      return batch.size() > 0;
     }
 
   private:
-    std::unique_ptr<RowTuple> curr_reference = nullptr;
-};
+    vector<string> left_keys;
+    vector<string> right_keys;
+    JoinType join_type = JoinType::INNER;
 
-// Note right now sort criteria is being passed in
-class Sort : public Iterator {
-  public:
-    Sort() {}
-    Sort(string sort_col) : sort_column(sort_col) {}
+    RowBatch left_batch;
+    RowBatch right_batch;
+    size_t left_row = 0;
+    size_t right_row = 0;
+    bool left_done = false;
+    bool right_done = false;
+    SchemaPtr left_schema;
+    SchemaPtr right_schema;
+    vector<size_t> left_ordinals;
+    vector<size_t> right_ordinals;
+    SchemaPtr output_schema;
 
-    void init() {
-      Iterator::init();
-      iterator_position = 0;
-      get_unsorted_input();
-      sort_input();
-    }
+    // Right rows sharing the current key, and how far the current left row
+    // got through them when the output batch filled up
+    RowBatch right_run;
+    bool run_active = false;
+    size_t run_position = 0;
 
-    void close() {
-      Iterator::close();
-      iterator_position = 0;
-      sorted_list.clear();
+    bool has_left_row() {
+      while (left_row >= left_batch.size()) {
+        if (left_done || !inputs[0]->get_next_batch(left_batch)) {
+          left_done = true;
+          return false;
+        }
+        left_row = 0;
+      }
+      return true;
     }
 
-    void set_sort_column(string col_to_sort) {
-      this->sort_column = col_to_sort;
+    bool has_right_row() {
+      while (right_row >= right_batch.size()) {
+        if (right_done || !inputs[1]->get_next_batch(right_batch)) {
+          right_done = true;
+          return false;
+        }
+        right_row = 0;
+      }
+      return true;
     }
 
-    std::unique_ptr<RowTuple> get_next_ptr() {
-      if (iterator_position >= sorted_list.size()) {
-        return nullptr;
+    static vector<size_t> resolve_keys(const Schema& schema, const vector<string>& keys) {
+      vector<size_t> ordinals;
+      for (const auto& key : keys) {
+        int ordinal = schema.get_ordinal(key);
+        if (ordinal < 0) {
+          throw std::runtime_error("Join key not found: " + key);
+        }
+        ordinals.push_back((size_t) ordinal);
       }
-      auto next = std::move(sorted_list[iterator_position++]);
-      return next;
+      return ordinals;
     }
 
-  private:
-    std::vector<std::unique_ptr<RowTuple>> sorted_list;
-    std::string sort_column = "";
-    unsigned int iterator_position;
+    // Inputs are expected to keep one schema, like Sort assumes
+    void resolve_schemas() {
+      if (left_batch.get_schema() != left_schema) {
+        left_schema = left_batch.get_schema();
+        left_ordinals = resolve_keys(*left_schema, left_keys);
+        output_schema = nullptr;
+      }
+      if (!right_done && right_batch.get_schema() != right_schema) {
+        right_schema = right_batch.get_schema();
+        right_ordinals = resolve_keys(*right_schema, right_keys);
+        output_schema = nullptr;
+      }
+      if (output_schema != nullptr) {
+        return;
+      }
+      if (join_type == JoinType::SEMI || join_type == JoinType::ANTI || right_schema == nullptr) {
+        output_schema = left_schema;
+      } else {
+        output_schema = merge_join_schemas(*left_schema, *right_schema);
+      }
+    }
 
-    void get_unsorted_input() {
-      std::unique_ptr<Iterator>& input = inputs[0];
-      std::unique_ptr<RowTuple> curr_tuple;
+    static int compare_keys(const RowBatch& a, size_t a_row, const vector<size_t>& a_keys,
+        const RowBatch& b, size_t b_row, const vector<size_t>& b_keys) {
+      for (size_t k = 0; k < a_keys.size(); k++) {
+        int cmp = a.get_column(a_keys[k]).compare(a_row, b.get_column(b_keys[k]), b_row);
+        if (cmp != 0) {
+          return cmp;
+        }
+      }
+      return 0;
+    }
 
-      while ((curr_tuple = input->get_next_ptr()) != nullptr) {
-        sorted_list.push_back(std::move(curr_tuple));
+    // Copies every right row equal to the current right row into right_run
+    void read_right_run() {
+      right_run.reset(right_schema);
+      right_run.append_row_from(right_batch, right_row++);
+      while (has_right_row()
+          && compare_keys(right_batch, right_row, right_ordinals, right_run, 0, right_ordinals) == 0) {
+        right_run.append_row_from(right_batch, right_row++);
       }
+      run_active = true;
+      run_position = 0;
     }
-    
-    // NOTE, assuming that all RowTuples have same columns
-    void sort_input() {
-      // TODO overload comparison operator for RowTuples and put some of this logic there
-      auto col_to_sort = this->sort_column;
-      std::sort(sorted_list.begin(), sorted_list.end(), 
-          [&col_to_sort](unique_ptr<RowTuple> &a, unique_ptr<RowTuple> &b) {
-          if (col_to_sort != "") {
-            //TODO What if value not found?
-            //TODO Make sure you sort numeric data numerically!!!
-            string a_val = a->get_value(col_to_sort);
-            string b_val = b->get_value(col_to_sort);
-            //double a_val = atof(a->get_value(col_to_sort).c_str());
-            //double b_val = atof(b->get_value(col_to_sort).c_str());
-            return  a_val < b_val;
-          }
-          
-          std::vector<std::string> a_keys;
-          for(const auto& it : a->get_row_data()) {
-            a_keys.push_back(it.first);
-          }
-          std::sort(a_keys.begin(), a_keys.end()); // necessary for predictable sorting
-          for (const auto& key : a_keys) {
-            string a_val = a->get_value(key);
-            string b_val = b->get_value(key);
-            if ((b_val == "") || (a_val < b_val)) {
-              return true;
-            }
-            else if (a_val > b_val) {
-              return false;
-            }
-          }
-          // defaulting to false if the rows are equal
+
+    // Pairs the current left row with the run. Returns false if batch filled
+    // up first, in which case the next call picks up at run_position.
+    bool emit_run(RowBatch& batch) {
+      if (join_type == JoinType::SEMI) {
+        batch.append_row_from(left_batch, left_row);
+        return true;
+      }
+      if (join_type == JoinType::ANTI) {
+        return true;
+      }
+      while (run_position < right_run.size()) {
+        if (batch.is_full()) {
           return false;
-      });
+        }
+        append_joined_row(batch, left_batch, left_row, &right_run, run_position++);
+      }
+      run_position = 0;
+      return true;
     }
 };
 
-class Projection : public Iterator {
-};
-
-class NestedJoin : public Iterator {
+/**
+ * Runs a plan morsel-driven on one work-stealing ThreadPool, without the
+ * operators having to be parallel themselves. init() splits the plan into
+ * pipelines: for every input of every operator that takes a pipeline (see
+ * Iterator::set_pipeline), the chain of single input operators below it
+ * down to a leaf becomes a Pipeline. At run time a chain whose leaf cannot
+ * be split into morsels, or that holds an operator that cannot stream, is
+ * pulled on the calling thread as before. Results are pulled from the plan
+ * as usual.
+ */
+class PipelineExecutor : public BatchIterator {
   public:
+    PipelineExecutor(size_t num_threads) : num_threads(std::max<size_t>(num_threads, 1)) {}
 
-    NestedJoin() {}
+    PipelineExecutor(unique_ptr<Iterator> plan, size_t num_threads) : PipelineExecutor(num_threads) {
+      append_input(std::move(plan));
+    }
 
     void init() {
-      check_for_required_inputs();
-      Iterator::init();
+      cout << "Initing Pipeline Executor" << endl;
+      if (pool == nullptr || pool->size() != num_threads) {
+        pool = std::make_shared<ThreadPool>(num_threads);
+      }
+      num_pipelines = 0;
+      breakers.clear();
+      if (!inputs.empty()) {
+        plan_pipelines(*inputs[0]);
+      }
+      BatchIterator::init();
     }
 
     void close() {
-      Iterator::close();
+      cout << "Closing Pipeline Executor" << endl;
+      BatchIterator::close();
     }
 
-    void set_predicate(bool (*theta) (const std::unique_ptr<RowTuple>&, const std::unique_ptr<RowTuple>&)) {
-      this->theta = theta;
+    bool get_next_batch(RowBatch& batch) {
+      return !inputs.empty() && inputs[0]->get_next_batch(batch);
     }
 
-    unique_ptr<RowTuple> get_next_ptr() {
-      unique_ptr<Iterator>& R = inputs[0];
-      unique_ptr<Iterator>& S = inputs[1];
-      if (current_r == nullptr) {
-        this->current_r = R->get_next_ptr();
-      }
-      while (this->current_r != nullptr) {
-        unique_ptr<RowTuple>& r = this->current_r;
-        unique_ptr<RowTuple> s;
-        while ((s = S->get_next_ptr()) != nullptr) {
-          if (theta(r,s)) {
-            return merge_row_tuples(r, s);
-          }
-        }
-        S->close();
-        S->init();
-        this->current_r = R->get_next_ptr();
-      }
-      return nullptr;
+    size_t get_num_pipelines() const {
+      return num_pipelines;
     }
 
   private:
-    unique_ptr<RowTuple> current_r;
+    size_t num_threads;
+    std::shared_ptr<ThreadPool> pool;
+    size_t num_pipelines = 0;
+    // Operators that took a pipeline, chains above them stop there
+    std::unordered_set<const Iterator*> breakers;
 
-    bool (*theta) (const std::unique_ptr<RowTuple>&, const std::unique_ptr<RowTuple>&);
-
-    void check_for_required_inputs() {
-      if (theta == nullptr) {
-        throw std::runtime_error("Nested Join requires a predicate function");
+    // Plans the inputs first, so breakers below are known
+    void plan_pipelines(Iterator& node) {
+      const vector<unique_ptr<Iterator>>& children = node.get_inputs();
+      for (const auto& child : children) {
+        plan_pipelines(*child);
       }
-      if (inputs.size() != 2) {
-        throw std::runtime_error("Nested join requires two inputs");
+      for (size_t i = 0; i < children.size(); i++) {
+        vector<Iterator*> chain = {children[i].get()};
+        while (breakers.count(chain.back()) == 0 && chain.back()->get_inputs().size() == 1) {
+          chain.push_back(chain.back()->get_inputs()[0].get());
+        }
+        if (!chain.back()->get_inputs().empty()) {
+          continue;
+        }
+        if (node.set_pipeline(i, std::make_shared<Pipeline>(pool, chain))) {
+          breakers.insert(&node);
+          num_pipelines++;
+        }
       }
     }
-
-    unique_ptr<RowTuple> merge_row_tuples(const unique_ptr<RowTuple>& r, const unique_ptr<RowTuple>& s) {
-      return nullptr;
-    }
 };
 
-
 // Basic Count Test
 void test_count_basic(const string& file_path) {
   Count count;
@@ -612,9 +7221,20 @@ void test_average_basic(const string& file_path) {
   avg_node.append_input(std::move(file_scan));
   avg_node.init();
   avg_node.set_col_to_avg("rating");
-  avg_node.get_next_ptr()->print_contents();
+  unique_ptr<RowTuple> typed = avg_node.get_next_ptr();
+  typed->print_contents();
   avg_node.close();
-  
+
+  // Without inferred types the ratings are averaged from their text
+  Average text_avg;
+  FileScan* text_scan = new FileScan(file_path);
+  text_scan->set_infer_types(false);
+  text_avg.append_input(unique_ptr<Iterator>(text_scan));
+  text_avg.init();
+  text_avg.set_col_to_avg("rating");
+  cout << "Average of text column\t" << "Expected: " << typed->get_value("Average") << " Actual: "
+       << text_avg.get_next_ptr()->get_value("Average") << endl;
+  text_avg.close();
 }
 
 // Basic sort test
@@ -631,6 +7251,704 @@ void test_sort_basic(const string& file_path) {
   }
 }
 
+vector<int64_t> sorted_timestamps(const string& file_path, size_t memory_budget, size_t fan_out) {
+  Sort sort("timestamp");
+  sort.set_memory_budget(memory_budget);
+  sort.set_merge_fan_out(fan_out);
+  sort.append_input(unique_ptr<Iterator>(new FileScan(file_path)));
+  sort.init();
+  vector<int64_t> timestamps;
+  RowBatch batch;
+  while (sort.get_next_batch(batch)) {
+    const ColumnVector& column = batch.get_column(batch.get_schema()->get_ordinal("timestamp"));
+    for (size_t i = 0; i < batch.size(); i++) {
+      timestamps.push_back(column.get(i).as_int());
+    }
+  }
+  sort.close();
+  return timestamps;
+}
+
+// A small budget and fan-out force several runs and more than one merge pass
+void test_external_sort(const string& file_path) {
+  vector<int64_t> in_memory = sorted_timestamps(file_path, 0, 16);
+  vector<int64_t> external = sorted_timestamps(file_path, 256 * 1024, 4);
+  cout << "External sort rows\t" << "Expected: " << in_memory.size() << " Actual: " << external.size() << endl;
+  cout << "External sort order\t" << "Expected: 1 Actual: " << (in_memory == external) << endl;
+}
+
+// Rating descending then movieId ascending, sorted on one and four threads
+void test_parallel_multi_key_sort(const string& file_path) {
+  vector<vector<Value>> orders[2];
+  for (size_t run = 0; run < 2; run++) {
+    Sort sort({{"rating", false}, {"movieId", true}});
+    sort.set_parallelism(run == 0 ? 1 : 4);
+    sort.append_input(unique_ptr<Iterator>(new FileScan(file_path)));
+    sort.init();
+    RowBatch batch;
+    while (sort.get_next_batch(batch)) {
+      int rating = batch.get_schema()->get_ordinal("rating");
+      int movie = batch.get_schema()->get_ordinal("movieId");
+      for (size_t i = 0; i < batch.size(); i++) {
+        orders[run].push_back({batch.get_column(rating).get(i), batch.get_column(movie).get(i)});
+      }
+    }
+    sort.close();
+  }
+
+  size_t out_of_order = 0;
+  for (size_t i = 1; i < orders[1].size(); i++) {
+    const vector<Value>& prev = orders[1][i - 1];
+    const vector<Value>& curr = orders[1][i];
+    out_of_order += prev[0] < curr[0] || (curr[0] == prev[0] && curr[1] < prev[1]);
+  }
+  cout << "Parallel multi-key sort order\t" << "Expected: 0 Actual: " << out_of_order << endl;
+  cout << "Parallel multi-key sort matches serial\t" << "Expected: 1 Actual: " << (orders[0] == orders[1]) << endl;
+}
+
+// Top 100 by rating, ties broken by movieId, against a full Sort and Limit
+void test_top_k(const string& file_path) {
+  vector<SortKey> keys = {{"rating", false}, {"movieId", true}};
+  vector<unique_ptr<Iterator>> plans;
+  plans.push_back(unique_ptr<Iterator>(new TopK(keys, 100)));
+  plans.back()->append_input(unique_ptr<Iterator>(new FileScan(file_path)));
+  unique_ptr<Iterator> sort(new Sort(keys));
+  sort->append_input(unique_ptr<Iterator>(new FileScan(file_path)));
+  plans.push_back(unique_ptr<Iterator>(new Limit(100)));
+  plans.back()->append_input(std::move(sort));
+
+  vector<vector<Value>> results[2];
+  for (size_t p = 0; p < plans.size(); p++) {
+    plans[p]->init();
+    RowBatch batch;
+    while (plans[p]->get_next_batch(batch)) {
+      int rating = batch.get_schema()->get_ordinal("rating");
+      int movie = batch.get_schema()->get_ordinal("movieId");
+      for (size_t i = 0; i < batch.size(); i++) {
+        results[p].push_back({batch.get_column(rating).get(i), batch.get_column(movie).get(i)});
+      }
+    }
+    plans[p]->close();
+  }
+  cout << "TopK rows\t" << "Expected: 100 Actual: " << results[0].size() << endl;
+  cout << "TopK matches Sort + Limit\t" << "Expected: 1 Actual: " << (results[0] == results[1]) << endl;
+}
+
+// Per movie aggregates must add up to the global ones
+void test_hash_aggregate(const string& file_path) {
+  HashAggregate per_movie({"movieId"}, {
+      {AggregateFunction::COUNT, "", "num_ratings"},
+      {AggregateFunction::SUM, "rating", ""},
+      {AggregateFunction::AVG, "rating", ""},
+      {AggregateFunction::MIN, "rating", ""},
+      {AggregateFunction::MAX, "rating", ""},
+      {AggregateFunction::COUNT_DISTINCT, "userId", ""}});
+  per_movie.append_input(unique_ptr<Iterator>(new FileScan(file_path)));
+  per_movie.init();
+  RowBatch batch;
+  int64_t num_groups = 0;
+  int64_t num_ratings = 0;
+  double rating_sum = 0.0;
+  int64_t bad_groups = 0;
+  while (per_movie.get_next_batch(batch)) {
+    const Schema& schema = *batch.get_schema();
+    for (size_t i = 0; i < batch.size(); i++) {
+      int64_t count = batch.get_column(schema.get_ordinal("num_ratings")).get(i).as_int();
+      double sum = batch.get_column(schema.get_ordinal("sum_rating")).get(i).as_double();
+      double avg = batch.get_column(schema.get_ordinal("avg_rating")).get(i).as_double();
+      double min = batch.get_column(schema.get_ordinal("min_rating")).get(i).as_double();
+      double max = batch.get_column(schema.get_ordinal("max_rating")).get(i).as_double();
+      int64_t users = batch.get_column(schema.get_ordinal("count_distinct_userId")).get(i).as_int();
+      bad_groups += min > avg + 1e-9 || avg > max + 1e-9 || users < 1 || users > count;
+      num_ratings += count;
+      rating_sum += sum;
+      num_groups++;
+    }
+  }
+  per_movie.close();
+
+  HashAggregate global({}, {{AggregateFunction::COUNT_DISTINCT, "movieId", "movies"},
+      {AggregateFunction::AVG, "rating", "avg"}});
+  global.append_input(unique_ptr<Iterator>(new FileScan(file_path)));
+  global.init();
+  unique_ptr<RowTuple> totals = global.get_next_ptr();
+  global.close();
+
+  cout << "Hash aggregate groups\t" << "Expected: " << totals->get_value("movies") << " Actual: " << num_groups << endl;
+  cout << "Hash aggregate average\t" << "Expected: " << totals->get_value("avg")
+       << " Actual: " << std::to_string(rating_sum / (double) num_ratings) << endl;
+  cout << "Hash aggregate inconsistent groups\t" << "Expected: 0 Actual: " << bad_groups << endl;
+
+  FileScan* text_scan = new FileScan(file_path);
+  text_scan->set_infer_types(false);
+  HashAggregate text_global({}, {{AggregateFunction::AVG, "rating", "avg"}});
+  text_global.append_input(unique_ptr<Iterator>(text_scan));
+  text_global.init();
+  cout << "Hash aggregate average of text\t" << "Expected: " << totals->get_value("avg") << " Actual: "
+       << text_global.get_next_ptr()->get_value("avg") << endl;
+  text_global.close();
+}
+
+// Four workers must produce the same groups and values as one
+void test_parallel_hash_aggregate(const string& file_path) {
+  std::map<string, string> results[2];
+  for (size_t run = 0; run < 2; run++) {
+    HashAggregate per_movie({"movieId"}, {
+        {AggregateFunction::COUNT, "", ""},
+        {AggregateFunction::AVG, "rating", ""},
+        {AggregateFunction::MAX, "timestamp", ""},
+        {AggregateFunction::COUNT_DISTINCT, "userId", ""}});
+    per_movie.set_parallelism(run == 0 ? 1 : 4);
+    per_movie.append_input(unique_ptr<Iterator>(new FileScan(file_path)));
+    per_movie.init();
+    unique_ptr<RowTuple> row;
+    while ((row = per_movie.get_next_ptr()) != nullptr) {
+      string values;
+      for (size_t i = 1; i < row->get_values().size(); i++) {
+        values += row->get_value(i).to_string() + ",";
+      }
+      results[run][row->get_values()[0].to_string()] = values;
+    }
+    per_movie.close();
+  }
+  cout << "Parallel hash aggregate groups\t" << "Expected: " << results[0].size() << " Actual: " << results[1].size() << endl;
+  cout << "Parallel hash aggregate matches serial\t" << "Expected: 1 Actual: " << (results[0] == results[1]) << endl;
+}
+
+uint64_t count_distinct_pairs(const string& file_path, bool use_hash, size_t memory_budget) {
+  unique_ptr<Iterator> pairs(new Projection({"userId", "movieId"}));
+  pairs->append_input(unique_ptr<Iterator>(new FileScan(file_path)));
+  if (!use_hash) {
+    unique_ptr<Iterator> sort(new Sort());
+    sort->append_input(std::move(pairs));
+    pairs = std::move(sort);
+  }
+  Distinct distinct;
+  distinct.set_use_hash(use_hash);
+  distinct.set_memory_budget(memory_budget);
+  distinct.append_input(std::move(pairs));
+  distinct.init();
+  RowBatch batch;
+  uint64_t num_rows = 0;
+  while (distinct.get_next_batch(batch)) {
+    num_rows += batch.size();
+  }
+  distinct.close();
+  return num_rows;
+}
+
+// Hash distinct, in memory and spilled, against Sort + Distinct
+void test_hash_distinct(const string& file_path) {
+  uint64_t sorted = count_distinct_pairs(file_path, false, 0);
+  uint64_t hashed = count_distinct_pairs(file_path, true, 0);
+  uint64_t spilled = count_distinct_pairs(file_path, true, 256 * 1024);
+  cout << "Hash distinct pairs\t" << "Expected: " << sorted << " Actual: " << hashed << endl;
+  cout << "Spilled hash distinct pairs\t" << "Expected: " << sorted << " Actual: " << spilled << endl;
+}
+
+// Sketch answers must land near the exact ones
+void test_approx_aggregates(const string& file_path) {
+  HashAggregate exact({}, {{AggregateFunction::COUNT_DISTINCT, "userId", "users"}});
+  exact.append_input(unique_ptr<Iterator>(new FileScan(file_path)));
+  exact.init();
+  double exact_users = exact.get_next_ptr()->get_values()[0].as_double();
+  exact.close();
+
+  ApproxCountDistinct approx_users("userId", "users");
+  approx_users.set_parallelism(2);
+  approx_users.append_input(unique_ptr<Iterator>(new FileScan(file_path)));
+  approx_users.init();
+  double estimate = approx_users.get_next_ptr()->get_values()[0].as_double();
+  approx_users.close();
+  cout << "Approx count distinct within 5%\t" << "Expected: 1 Actual: "
+       << (std::abs(estimate - exact_users) <= 0.05 * exact_users) << endl;
+
+  vector<int64_t> timestamps = sorted_timestamps(file_path, 0, 16);
+  ApproxQuantile quantiles("timestamp", {0.5, 0.99});
+  quantiles.append_input(unique_ptr<Iterator>(new FileScan(file_path)));
+  quantiles.init();
+  unique_ptr<RowTuple> result = quantiles.get_next_ptr();
+  quantiles.close();
+  const double qs[] = {0.5, 0.99};
+  for (size_t i = 0; i < 2; i++) {
+    int64_t val = result->get_value(i).as_int();
+    double rank = (double) (std::lower_bound(timestamps.begin(), timestamps.end(), val) - timestamps.begin());
+    cout << "Approx quantile " << qs[i] << " rank within 2%\t" << "Expected: 1 Actual: "
+         << (std::abs(rank / (double) timestamps.size() - qs[i]) <= 0.02) << endl;
+  }
+}
+
+uint64_t count_filtered(unique_ptr<Iterator> input, const ExprPtr& expression) {
+  Select select;
+  select.set_predicate(expression);
+  select.append_input(std::move(input));
+  select.init();
+  uint64_t rows = 0;
+  RowBatch batch;
+  while (select.get_next_batch(batch)) {
+    rows += batch.size();
+  }
+  select.close();
+  return rows;
+}
+
+// Expression filters against the same conditions checked row by row
+void test_expression_filter(const string& file_path, const string& columnar_path) {
+  const int64_t since = 1262304000;
+  uint64_t expected_recent = 0;
+  uint64_t expected_mixed = 0;
+  FileScan scan(file_path);
+  scan.init();
+  unique_ptr<RowTuple> row;
+  while ((row = scan.get_next_ptr()) != nullptr) {
+    const vector<Value>& vals = row->get_values();
+    double rating = vals[2].as_double();
+    int64_t movie = vals[1].as_int();
+    expected_recent += rating >= 4.0 && vals[3].as_int() > since;
+    expected_mixed += movie == 1 || movie == 296 || movie == 318 || !(rating >= 1.0 && rating <= 4.5);
+  }
+  scan.close();
+
+  ExprPtr recent = make_and({make_comparison("rating", CompareOp::GE, Value::make_double(4.0)),
+                             make_comparison("timestamp", CompareOp::GT, Value::make_int(since))});
+  uint64_t recent_rows = count_filtered(unique_ptr<Iterator>(new FileScan(file_path)), recent);
+  cout << "Expression filter AND\t" << "Expected: " << expected_recent << " Actual: " << recent_rows << endl;
+
+  ExprPtr mixed = make_or({make_in("movieId", {Value::make_int(1), Value::make_int(296), Value::make_int(318)}),
+                           make_not(make_between("rating", Value::make_double(1.0), Value::make_double(4.5)))});
+  uint64_t mixed_rows = count_filtered(unique_ptr<Iterator>(new FileScan(file_path)), mixed);
+  cout << "Expression filter IN OR NOT\t" << "Expected: " << expected_mixed << " Actual: " << mixed_rows << endl;
+
+  // Sorted by timestamp, all but the last row groups fall below the cutoff
+  vector<int64_t> timestamps = sorted_timestamps(file_path, 0, 16);
+  int64_t cutoff = timestamps[timestamps.size() * 9 / 10];
+  uint64_t expected_late = timestamps.end() - std::upper_bound(timestamps.begin(), timestamps.end(), cutoff);
+  Sort sort("timestamp");
+  sort.append_input(unique_ptr<Iterator>(new FileScan(file_path)));
+  ColumnarWriter writer(columnar_path);
+  writer.write(sort);
+  ColumnarScan* columnar_scan = new ColumnarScan(columnar_path);
+  Select select;
+  select.set_predicate(make_comparison(Operand::constant(Value::make_int(cutoff)), CompareOp::LT,
+                                       Operand::column_ref("timestamp")));
+  select.append_input(unique_ptr<Iterator>(columnar_scan));
+  select.init();
+  uint64_t late_rows = 0;
+  RowBatch batch;
+  while (select.get_next_batch(batch)) {
+    late_rows += batch.size();
+  }
+  size_t skipped = columnar_scan->get_skipped_row_groups();
+  select.close();
+  cout << "Zone map filter\t" << "Expected: " << expected_late << " Actual: " << late_rows << endl;
+  cout << "Zone map skipped row groups\t" << "Expected: 1 Actual: " << (skipped > 0) << endl;
+}
+
+// Sum of userId over the rows the pushed down filter lets through
+int64_t sum_pushed_down_users(const string& file_path, size_t num_threads, const vector<string>& columns) {
+  auto scan = new FileScan(file_path);
+  scan->set_parallelism(num_threads);
+  scan->set_projection(columns);
+  Select select;
+  select.set_predicate(make_and({make_comparison("rating", CompareOp::GE, Value::make_double(4.5)),
+                                 make_comparison("timestamp", CompareOp::GT, Value::make_int(1262304000))}));
+  select.append_input(unique_ptr<Iterator>(scan));
+  select.init();
+  int64_t sum = 0;
+  RowBatch batch;
+  while (select.get_next_batch(batch)) {
+    const ColumnVector& users = batch.get_column(batch.get_schema()->get_ordinal("userId"));
+    for (size_t i = 0; i < batch.size(); i++) {
+      sum += users.get(i).as_int();
+    }
+  }
+  select.close();
+  return sum;
+}
+
+void test_filter_pushdown(const string& file_path) {
+  int64_t expected = 0;
+  FileScan scan(file_path);
+  scan.init();
+  unique_ptr<RowTuple> row;
+  while ((row = scan.get_next_ptr()) != nullptr) {
+    const vector<Value>& vals = row->get_values();
+    if (vals[2].as_double() >= 4.5 && vals[3].as_int() > 1262304000) {
+      expected += vals[0].as_int();
+    }
+  }
+  scan.close();
+  int64_t serial = sum_pushed_down_users(file_path, 1, {});
+  int64_t parallel = sum_pushed_down_users(file_path, 4, {});
+  int64_t projected = sum_pushed_down_users(file_path, 1, {"timestamp", "userId", "rating"});
+  cout << "Filter pushdown\t" << "Expected: " << expected << " Actual: " << serial << endl;
+  cout << "Parallel filter pushdown\t" << "Expected: " << expected << " Actual: " << parallel << endl;
+  cout << "Projected filter pushdown\t" << "Expected: " << expected << " Actual: " << projected << endl;
+}
+
+// String columns reuse their arena across batches, and copies own their bytes
+// Values past the type sample widen their column instead of failing the
+// scan, and empty numeric fields are nulls that aggregates skip
+void test_type_widening(const string& csv_path) {
+  FILE* fp = std::fopen(csv_path.c_str(), "w");
+  fprintf(fp, "id,label,score,tmdb\n");
+  int64_t tmdb_sum = 0;
+  int64_t tmdb_count = 0;
+  for (int i = 0; i < 1500; i++) {
+    if (i % 3 == 0) {
+      fprintf(fp, "%d,%d,%d,\n", i, i, i);
+    } else {
+      fprintf(fp, "%d,%d,%d,%d\n", i, i, i, i * 2);
+      tmdb_sum += i * 2;
+      tmdb_count++;
+    }
+  }
+  fprintf(fp, "1500,n/a,2.5,\n");
+  std::fclose(fp);
+
+  FileScan scan(csv_path);
+  scan.init();
+  RowBatch batch;
+  scan.get_next_batch(batch);
+  cout << "Widened label type\t" << "Expected: " << (int) ColumnType::STRING << " Actual: "
+       << (int) batch.get_schema()->get_column(1).type << endl;
+  cout << "Widened score type\t" << "Expected: " << (int) ColumnType::DOUBLE << " Actual: "
+       << (int) batch.get_schema()->get_column(2).type << endl;
+  cout << "Empty field is null\t" << "Expected: 1 Actual: " << batch.get_column(3).is_null(0) << endl;
+  scan.close();
+
+  HashAggregate global({}, {{AggregateFunction::COUNT, "", "rows"}, {AggregateFunction::AVG, "tmdb", "avg"},
+      {AggregateFunction::MIN, "tmdb", "min"}});
+  global.append_input(unique_ptr<Iterator>(new FileScan(csv_path)));
+  global.init();
+  unique_ptr<RowTuple> totals = global.get_next_ptr();
+  global.close();
+  cout << "Widened scan rows\t" << "Expected: 1501 Actual: " << totals->get_value("rows") << endl;
+  cout << "Average skips nulls\t" << "Expected: " << std::to_string((double) tmdb_sum / (double) tmdb_count)
+       << " Actual: " << totals->get_value("avg") << endl;
+  cout << "Min skips nulls\t" << "Expected: 2 Actual: " << totals->get_value("min") << endl;
+}
+
+void test_column_arena() {
+  ColumnVector column(ColumnType::STRING);
+  ColumnVector copy;
+  size_t first_usage = 0;
+  for (int round = 0; round < 100; round++) {
+    column.clear();
+    for (int i = 0; i < (int) BATCH_SIZE; i++) {
+      column.append_text("a value too long for the small string buffer #" + std::to_string(round * 10000 + i));
+    }
+    if (round == 0) {
+      copy = column;
+      first_usage = column.memory_usage();
+    }
+  }
+  cout << "Arena copy survives reuse\t" << "Expected: a value too long for the small string buffer #5 Actual: "
+       << copy.get(5).as_string() << endl;
+  cout << "Arena memory reused\t" << "Expected: 1 Actual: " << (column.memory_usage() <= 2 * first_usage) << endl;
+}
+
+// Group counts per genre, keyed by the genre text
+std::map<string, int64_t> count_per_genre(unique_ptr<Iterator> input) {
+  HashAggregate per_genre({"genres"}, {{AggregateFunction::COUNT, "", "movies"}});
+  per_genre.append_input(std::move(input));
+  per_genre.init();
+  std::map<string, int64_t> counts;
+  RowBatch batch;
+  while (per_genre.get_next_batch(batch)) {
+    for (size_t i = 0; i < batch.size(); i++) {
+      counts[string(batch.get_column(0).get_string(i))] = batch.get_column(1).get(i).as_int();
+    }
+  }
+  per_genre.close();
+  return counts;
+}
+
+// Low cardinality string columns are dictionary encoded without changing results
+void test_dictionary_strings(const string& movies_path, const string& columnar_path) {
+  FileScan scan(movies_path);
+  scan.init();
+  RowBatch batch;
+  scan.get_next_batch(batch);
+  cout << "Genres dictionary encoded\t" << "Expected: 1 Actual: "
+       << batch.get_column(2).is_dictionary_encoded() << endl;
+  cout << "Titles dictionary encoded\t" << "Expected: 0 Actual: "
+       << batch.get_column(1).is_dictionary_encoded() << endl;
+  scan.close();
+
+  auto plain_scan = [&]() {
+    FileScan* plain = new FileScan(movies_path);
+    plain->set_dictionary_encoding("genres", false);
+    return unique_ptr<Iterator>(plain);
+  };
+  std::map<string, int64_t> expected = count_per_genre(plain_scan());
+  std::map<string, int64_t> encoded = count_per_genre(unique_ptr<Iterator>(new FileScan(movies_path)));
+  cout << "Dictionary group by\t" << "Expected: " << expected.size() << " Actual: "
+       << (encoded == expected ? encoded.size() : 0) << endl;
+
+  ExprPtr comedy = make_comparison("genres", CompareOp::EQ, Value("Comedy"));
+  ExprPtr not_drama = make_not(make_in("genres", {Value("Drama"), Value("Horror")}));
+  uint64_t expected_comedy = count_filtered(plain_scan(), comedy);
+  uint64_t expected_not_drama = count_filtered(plain_scan(), not_drama);
+  uint64_t comedy_rows = count_filtered(unique_ptr<Iterator>(new FileScan(movies_path)), comedy);
+  uint64_t not_drama_rows = count_filtered(unique_ptr<Iterator>(new FileScan(movies_path)), not_drama);
+  cout << "Dictionary equality filter\t" << "Expected: " << expected_comedy << " Actual: " << comedy_rows << endl;
+  cout << "Dictionary IN filter\t" << "Expected: " << expected_not_drama << " Actual: " << not_drama_rows << endl;
+
+  convert_csv_to_columnar(movies_path, columnar_path);
+  std::map<string, int64_t> columnar = count_per_genre(unique_ptr<Iterator>(new ColumnarScan(columnar_path)));
+  uint64_t columnar_comedy = count_filtered(unique_ptr<Iterator>(new ColumnarScan(columnar_path)), comedy);
+  cout << "Columnar dictionary group by\t" << "Expected: " << expected.size() << " Actual: "
+       << (columnar == expected ? columnar.size() : 0) << endl;
+  cout << "Columnar dictionary filter\t" << "Expected: " << expected_comedy << " Actual: " << columnar_comedy << endl;
+
+  // A column that outgrows its dictionary keeps its values as plain strings
+  ColumnVector capped(ColumnType::STRING, std::make_shared<StringDictionary>(4));
+  for (int i = 0; i < 10; i++) {
+    capped.append_string("value " + std::to_string(i % 6));
+  }
+  cout << "Full dictionary falls back\t" << "Expected: 0 Actual: " << capped.is_dictionary_encoded() << endl;
+  cout << "Full dictionary keeps values\t" << "Expected: value 3 Actual: " << capped.get_string(9) << endl;
+}
+
+bool rating_at_least_four(const std::unique_ptr<RowTuple>& tuple) {
+  return std::stod(tuple->get_value("rating")) >= 4.0;
+}
+
+// Select feeding Count exercises the batch path end to end
+void test_select_count_batch(const string& file_path) {
+  auto select = unique_ptr<Select>(new Select());
+  select->set_predicate(rating_at_least_four);
+  select->append_input(unique_ptr<Iterator>(new FileScan(file_path)));
+  Count count("high_ratings");
+  count.append_input(std::move(select));
+  count.init();
+
+  RowBatch batch;
+  while (count.get_next_batch(batch)) {
+    for (size_t i = 0; i < batch.size(); i++) {
+      batch.get_row(i)->print_contents();
+    }
+  }
+  count.close();
+}
+
+// Parallel scans should see exactly the rows a single-threaded scan sees
+void test_parallel_file_scan(const string& file_path) {
+  for (bool preserve_order : {true, false}) {
+    auto scan = unique_ptr<FileScan>(new FileScan(file_path));
+    scan->set_parallelism(std::thread::hardware_concurrency(), preserve_order);
+    Average avg_node("parallel_avg");
+    avg_node.set_col_to_avg("rating");
+    avg_node.append_input(std::move(scan));
+    avg_node.init();
+    avg_node.get_next_ptr()->print_contents();
+    avg_node.close();
+  }
+}
+
+// Every row read back from the columnar copy should match the CSV
+void test_columnar_roundtrip(const string& csv_path, const string& columnar_path) {
+  uint64_t rows_written = convert_csv_to_columnar(csv_path, columnar_path);
+  FileScan csv_scan(csv_path);
+  ColumnarScan columnar_scan(columnar_path);
+  csv_scan.init();
+  columnar_scan.init();
+
+  unique_ptr<RowTuple> csv_row;
+  unique_ptr<RowTuple> columnar_row;
+  uint64_t rows_matched = 0;
+  while ((csv_row = csv_scan.get_next_ptr()) != nullptr) {
+    columnar_row = columnar_scan.get_next_ptr();
+    if (columnar_row != nullptr && *csv_row == *columnar_row) {
+      rows_matched++;
+    }
+  }
+  cout << "Columnar roundtrip\t" << "Expected: " << rows_written << " Actual: " << rows_matched << endl;
+  csv_scan.close();
+  columnar_scan.close();
+}
+
+void test_projection_pushdown(const string& file_path) {
+  // Same query with the projection pushed into the scan and applied on top
+  unique_ptr<Iterator> file_scan(new FileScan(file_path));
+  unique_ptr<Iterator> projection(new Projection({"rating", "movieId"}));
+  projection->append_input(std::move(file_scan));
+  Average pushed_average("avg_rating");
+  pushed_average.append_input(std::move(projection));
+  pushed_average.set_col_to_avg("rating");
+  pushed_average.init();
+  unique_ptr<RowTuple> pushed = pushed_average.get_next_ptr();
+  pushed_average.close();
+
+  unique_ptr<Iterator> inner_projection(new Projection({"userId", "rating", "movieId"}));
+  inner_projection->append_input(unique_ptr<Iterator>(new FileScan(file_path)));
+  unique_ptr<Iterator> outer_projection(new Projection({"rating"}));
+  outer_projection->append_input(std::move(inner_projection));
+  Average average("avg_rating");
+  average.append_input(std::move(outer_projection));
+  average.set_col_to_avg("rating");
+  average.init();
+  unique_ptr<RowTuple> expected = average.get_next_ptr();
+  average.close();
+
+  cout << "Projection pushdown\t" << "Expected: " << expected->get_value("avg_rating")
+       << " Actual: " << pushed->get_value("avg_rating") << endl;
+}
+
+uint64_t count_hash_join(const string& left_path, const string& right_path, JoinType join_type,
+    size_t memory_budget = 0) {
+  HashJoin join("movieId", "movieId", join_type);
+  join.set_memory_budget(memory_budget);
+  join.append_input(unique_ptr<Iterator>(new FileScan(left_path)));
+  join.append_input(unique_ptr<Iterator>(new FileScan(right_path)));
+  join.init();
+  RowBatch batch;
+  uint64_t num_rows = 0;
+  while (join.get_next_batch(batch)) {
+    num_rows += batch.size();
+  }
+  join.close();
+  return num_rows;
+}
+
+// Every rating either has a movie or not, and movieId is unique in movies
+void test_hash_join(const string& ratings_path, const string& movies_path) {
+  uint64_t inner = count_hash_join(ratings_path, movies_path, JoinType::INNER);
+  uint64_t left = count_hash_join(ratings_path, movies_path, JoinType::LEFT);
+  uint64_t semi = count_hash_join(ratings_path, movies_path, JoinType::SEMI);
+  uint64_t anti = count_hash_join(ratings_path, movies_path, JoinType::ANTI);
+  cout << "Hash join inner vs semi\t" << "Expected: " << semi << " Actual: " << inner << endl;
+  cout << "Hash join left vs semi + anti\t" << "Expected: " << semi + anti << " Actual: " << left << endl;
+
+  // A budget far below either input forces both through spill partitions
+  uint64_t spilled_inner = count_hash_join(ratings_path, movies_path, JoinType::INNER, 64 * 1024);
+  uint64_t spilled_anti = count_hash_join(ratings_path, movies_path, JoinType::ANTI, 64 * 1024);
+  cout << "Spilled hash join inner\t" << "Expected: " << inner << " Actual: " << spilled_inner << endl;
+  cout << "Spilled hash join anti\t" << "Expected: " << anti << " Actual: " << spilled_anti << endl;
+}
+
+// Merge join over sorted scans must agree with the hash join
+void test_merge_join(const string& ratings_path, const string& movies_path) {
+  unique_ptr<Iterator> sorted_ratings(new Sort("movieId"));
+  sorted_ratings->append_input(unique_ptr<Iterator>(new FileScan(ratings_path)));
+  unique_ptr<Iterator> sorted_movies(new Sort("movieId"));
+  sorted_movies->append_input(unique_ptr<Iterator>(new FileScan(movies_path)));
+
+  MergeJoin join("movieId", "movieId");
+  join.append_input(std::move(sorted_ratings));
+  join.append_input(std::move(sorted_movies));
+  join.init();
+  RowBatch batch;
+  uint64_t num_rows = 0;
+  uint64_t mismatched = 0;
+  while (join.get_next_batch(batch)) {
+    const ColumnVector& left_key = batch.get_column(batch.get_schema()->get_ordinal("movieId"));
+    const ColumnVector& right_key = batch.get_column(batch.get_schema()->get_ordinal("right.movieId"));
+    for (size_t i = 0; i < batch.size(); i++) {
+      mismatched += left_key.compare(i, right_key, i) != 0;
+    }
+    num_rows += batch.size();
+  }
+  join.close();
+
+  uint64_t expected = count_hash_join(ratings_path, movies_path, JoinType::INNER);
+  cout << "Merge join rows\t" << "Expected: " << expected << " Actual: " << num_rows << endl;
+  cout << "Merge join mismatched keys\t" << "Expected: 0 Actual: " << mismatched << endl;
+}
+
+// Count and rating sum per movie over the ratings of at least 4, run through
+// a PipelineExecutor when num_threads is not 0
+std::map<int64_t, std::pair<int64_t, double>> high_ratings_per_movie(unique_ptr<Iterator> source, size_t num_threads) {
+  auto select = unique_ptr<Select>(new Select());
+  select->set_predicate(make_comparison("rating", CompareOp::GE, Value::make_double(4.0)));
+  select->append_input(std::move(source));
+  auto per_movie = unique_ptr<HashAggregate>(new HashAggregate({"movieId"}, {
+      {AggregateFunction::COUNT, "", "num_ratings"},
+      {AggregateFunction::SUM, "rating", "sum_rating"}}));
+  per_movie->append_input(std::move(select));
+  unique_ptr<Iterator> plan = std::move(per_movie);
+  if (num_threads > 0) {
+    plan = unique_ptr<Iterator>(new PipelineExecutor(std::move(plan), num_threads));
+  }
+  plan->init();
+  std::map<int64_t, std::pair<int64_t, double>> groups;
+  RowBatch batch;
+  while (plan->get_next_batch(batch)) {
+    for (size_t i = 0; i < batch.size(); i++) {
+      groups[batch.get_column(0).get(i).as_int()] = {batch.get_column(1).get(i).as_int(),
+                                                     batch.get_column(2).get(i).as_double()};
+    }
+  }
+  plan->close();
+  return groups;
+}
+
+// Plans run morsel-driven must give the same answers as on one thread
+void test_pipeline_executor(const string& ratings_path, const string& movies_path, const string& columnar_path) {
+  const size_t num_threads = 4;
+  std::map<int64_t, std::pair<int64_t, double>> expected =
+      high_ratings_per_movie(unique_ptr<Iterator>(new FileScan(ratings_path)), 0);
+  std::map<int64_t, std::pair<int64_t, double>> pipelined =
+      high_ratings_per_movie(unique_ptr<Iterator>(new FileScan(ratings_path)), num_threads);
+  cout << "Pipeline filter aggregate\t" << "Expected: " << expected.size() << " Actual: "
+       << (pipelined == expected ? pipelined.size() : 0) << endl;
+
+  convert_csv_to_columnar(ratings_path, columnar_path);
+  std::map<int64_t, std::pair<int64_t, double>> columnar =
+      high_ratings_per_movie(unique_ptr<Iterator>(new ColumnarScan(columnar_path)), num_threads);
+  cout << "Pipeline columnar aggregate\t" << "Expected: " << expected.size() << " Actual: "
+       << (columnar == expected ? columnar.size() : 0) << endl;
+
+  ExprPtr recent = make_comparison("timestamp", CompareOp::GT, Value::make_int(1262304000));
+  uint64_t expected_recent = count_filtered(unique_ptr<Iterator>(new FileScan(ratings_path)), recent);
+  auto select = unique_ptr<Select>(new Select());
+  select->set_predicate(recent);
+  select->append_input(unique_ptr<Iterator>(new FileScan(ratings_path)));
+  auto count = unique_ptr<Count>(new Count("recent"));
+  count->append_input(std::move(select));
+  PipelineExecutor count_plan(std::move(count), num_threads);
+  count_plan.init();
+  int64_t recent_rows = count_plan.get_next_ptr()->get_values()[0].as_int();
+  size_t count_pipelines = count_plan.get_num_pipelines();
+  count_plan.close();
+  cout << "Pipeline filter count\t" << "Expected: " << expected_recent << " Actual: " << recent_rows << endl;
+  cout << "Pipeline count pipelines\t" << "Expected: 1 Actual: " << count_pipelines << endl;
+
+  vector<int64_t> expected_timestamps = sorted_timestamps(ratings_path, 0, 16);
+  auto projection = unique_ptr<Projection>(new Projection({"timestamp", "userId"}));
+  projection->append_input(unique_ptr<Iterator>(new FileScan(ratings_path)));
+  auto sort = unique_ptr<Sort>(new Sort("timestamp"));
+  sort->append_input(std::move(projection));
+  PipelineExecutor sort_plan(std::move(sort), num_threads);
+  sort_plan.init();
+  vector<int64_t> timestamps;
+  RowBatch batch;
+  while (sort_plan.get_next_batch(batch)) {
+    for (size_t i = 0; i < batch.size(); i++) {
+      timestamps.push_back(batch.get_column(0).get(i).as_int());
+    }
+  }
+  sort_plan.close();
+  cout << "Pipeline sort\t" << "Expected: " << expected_timestamps.size() << " Actual: "
+       << (timestamps == expected_timestamps ? timestamps.size() : 0) << endl;
+
+  for (JoinType join_type : {JoinType::INNER, JoinType::ANTI}) {
+    uint64_t expected_rows = count_hash_join(ratings_path, movies_path, join_type);
+    auto join = unique_ptr<HashJoin>(new HashJoin("movieId", "movieId", join_type));
+    join->append_input(unique_ptr<Iterator>(new FileScan(ratings_path)));
+    join->append_input(unique_ptr<Iterator>(new FileScan(movies_path)));
+    PipelineExecutor join_plan(std::move(join), num_threads);
+    join_plan.init();
+    uint64_t join_rows = 0;
+    while (join_plan.get_next_batch(batch)) {
+      join_rows += batch.size();
+    }
+    join_plan.close();
+    cout << "Pipeline hash join build\t" << "Expected: " << expected_rows << " Actual: " << join_rows << endl;
+  }
+}
+
 void test_row_tuple_equality() {
   cout << "Starting RowTuple equality tests" << endl;
   RowTuple t1({{"student", "jimmy cricket"}, {"id", "2"}});
@@ -656,6 +7974,13 @@ void test_row_tuple_equality() {
   RowTuple t9({{"student", "james cricket"}, {"id", "2"}});
   RowTuple t10({{"student", "jimmy cricket"}, {"id", "2"}});
   cout << "RowTuple equality test 1\t" <<  "Expected: 1 " << "Actual: " << (t9 != t10) << endl;
+
+  cout << "RowTuple Equality: Shared schema vs map-built tuple" << endl;
+  auto schema = std::make_shared<Schema>(vector<Column>{{"student", ColumnType::STRING}, {"id", ColumnType::STRING}});
+  RowTuple t11(schema, {Value("jimmy cricket"), Value("2")});
+  RowTuple t12(schema, {Value("jimmy cricket"), Value("2")});
+  cout << "RowTuple equality test 1\t" <<  "Expected: 1 " << "Actual: " << (t11 == t12) << endl;
+  cout << "RowTuple equality test 1\t" <<  "Expected: 1 " << "Actual: " << (t11 == t1) << endl;
 }
 
 // Modify later to add Sort Node as input
@@ -1,5 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+#include "csv.h"
 
 void free_csv_line( char **parsed )
 {
@@ -12,41 +14,38 @@ void free_csv_line( char **parsed )
     free( parsed );
 }
 
+/*
+ * Counts the commas outside quotes 64 bytes at a time.  The quoted regions of
+ * each block come from a prefix XOR over its quote mask, carried over from
+ * the previous block.
+ */
 static int count_fields( const char *line )
 {
-    const char *ptr;
-    int cnt, fQuote;
+    size_t len, i;
+    uint64_t inside, in_quote;
+    char tail[64];
+    const char *block;
+    csv_masks masks;
+    int cnt;
 
-    for ( cnt = 1, fQuote = 0, ptr = line; *ptr; ptr++ )
+    len = strlen( line );
+
+    for ( cnt = 1, in_quote = 0, i = 0; i < len; i += 64 )
     {
-        if ( fQuote )
-        {
-            if ( *ptr == '\"' )
-            {
-                if ( ptr[1] == '\"' )
-                {
-                    ptr++;
-                    continue;
-                }
-                fQuote = 0;
-            }
-            continue;
+        block = line + i;
+        if ( len - i < 64 ) {
+            memset( tail, 0, sizeof(tail) );
+            memcpy( tail, block, len - i );
+            block = tail;
         }
 
-        switch( *ptr )
-        {
-            case '\"':
-                fQuote = 1;
-                continue;
-            case ',':
-                cnt++;
-                continue;
-            default:
-                continue;
-        }
+        csv_block_masks( block, &masks );
+        inside = csv_prefix_xor( masks.quotes ) ^ in_quote;
+        cnt += __builtin_popcountll( masks.delims & ~inside );
+        in_quote = (uint64_t) 0 - (inside >> 63);
     }
 
-    if ( fQuote ) {
+    if ( in_quote ) {
         return -1;
     }
 
@@ -61,7 +60,7 @@ static int count_fields( const char *line )
 char **parse_csv( const char *line )
 {
     char **buf, **bptr, *tmp, *tptr;
-    const char *ptr;
+    const char *ptr, *end, *run;
     int fieldcnt, fQuote, fEnd;
 
     fieldcnt = count_fields( line );
@@ -76,7 +75,8 @@ char **parse_csv( const char *line )
         return NULL;
     }
 
-    tmp = malloc( strlen(line) + 1 );
+    end = line + strlen( line );
+    tmp = malloc( (size_t) (end - line) + 1 );
 
     if ( !tmp )
     {
@@ -88,6 +88,14 @@ char **parse_csv( const char *line )
 
     for ( ptr = line, fQuote = 0, *tmp = '\0', tptr = tmp, fEnd = 0; ; ptr++ )
     {
+        /* Copy runs of ordinary characters in bulk */
+        run = csv_find_field_end( ptr, end );
+        if ( run != ptr ) {
+            memcpy( tptr, ptr, (size_t) (run - ptr) );
+            tptr += run - ptr;
+            ptr = run;
+        }
+
         if ( fQuote )
         {
             if ( !*ptr ) {
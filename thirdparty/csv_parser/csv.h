@@ -1,12 +1,80 @@
 #ifndef CSV_DOT_H_INCLUDE_GUARD
 #define CSV_DOT_H_INCLUDE_GUARD
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define CSV_ERR_LONGLINE 0
 #define CSV_ERR_NO_MEMORY 1
 
+#define CSV_MMAP_ERR_QUOTE -1
+#define CSV_MMAP_ERR_NO_MEMORY -2
+
 char **parse_csv( const char *line );
 void free_csv_line( char **parsed );
 char **split_on_unescaped_newlines(const char *txt);
 char *fread_csv_line(FILE *fp, int max_line_size, int *done, int *err);
 
+#define CSV_READ_BLOCK_SIZE 65536
+
+/* Per-file state for reading CSV lines, see fread_csv_line.c */
+typedef struct {
+    FILE *fp;
+    char read_buf[CSV_READ_BLOCK_SIZE + 1];
+    char *read_ptr;
+    char *read_end;
+    int fread_len;
+    char *line_buf;
+    int max_line_size;
+} csv_reader;
+
+int csv_reader_init(csv_reader *r, FILE *fp, int max_line_size);
+char *csv_reader_next_line(csv_reader *r, int *done, int *err);
+void csv_reader_free(csv_reader *r);
+
+/* A field of a row read by csv_mmap_next_row, not NUL terminated */
+typedef struct {
+    const char *data;
+    size_t len;
+    int unescaped;
+} csv_field;
+
+typedef struct {
+    const char *data;
+    size_t size;
+    size_t pos;
+    csv_field *fields;
+    size_t num_fields;
+    size_t fields_cap;
+    char *scratch;
+    size_t scratch_len;
+    size_t scratch_cap;
+    int owns_data;
+} csv_mmap;
+
+int csv_mmap_open( csv_mmap *m, const char *path );
+void csv_mmap_view( csv_mmap *m, const char *data, size_t size );
+int csv_mmap_next_row( csv_mmap *m );
+void csv_mmap_close( csv_mmap *m );
+size_t csv_count_quotes( const char *data, size_t len );
+size_t csv_find_row_start( const char *data, size_t size, size_t pos, int in_quote );
+
+/* Structural characters of a 64-byte block, bit i is byte i */
+typedef struct {
+    uint64_t quotes;
+    uint64_t delims;
+    uint64_t newlines;
+} csv_masks;
+
+#define CSV_SIMD_SCALAR 0
+#define CSV_SIMD_SSE2 1
+#define CSV_SIMD_AVX2 2
+
+int csv_simd_set_level( int level );
+int csv_simd_level( void );
+void csv_block_masks( const char *block, csv_masks *out );
+uint64_t csv_prefix_xor( uint64_t bits );
+const char *csv_find_field_end( const char *ptr, const char *end );
+const char *csv_find_line_end( const char *ptr, const char *end );
+
 #endif
@@ -0,0 +1,310 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "csv.h"
+
+/*
+ * Memory-mapped CSV reader.
+ *
+ * Rows are split directly out of the mapped file and handed back as
+ * (pointer, length) slices, so the common case does no copying and no
+ * allocation per field.  Only fields that need rewriting (doubled quotes
+ * inside a quoted field, or text trailing a closing quote) are unescaped
+ * into a scratch buffer owned by the reader.
+ */
+
+int csv_mmap_open( csv_mmap *m, const char *path )
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    memset( m, 0, sizeof(*m) );
+
+    fd = open( path, O_RDONLY );
+    if ( fd < 0 ) {
+        return -1;
+    }
+    if ( fstat( fd, &st ) != 0 || !S_ISREG( st.st_mode ) ) {
+        close( fd );
+        return -1;
+    }
+
+    /* mmap refuses zero-length mappings, an empty file simply has no rows */
+    if ( st.st_size > 0 ) {
+        map = mmap( NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if ( map == MAP_FAILED ) {
+            close( fd );
+            return -1;
+        }
+        madvise( map, (size_t) st.st_size, MADV_SEQUENTIAL );
+        m->data = map;
+        m->size = (size_t) st.st_size;
+    }
+
+    /* The mapping stays valid after the descriptor is closed */
+    close( fd );
+    m->owns_data = 1;
+    return 0;
+}
+
+/*
+ * Set up a reader over size bytes at data, which must start at a row
+ * boundary.  The reader does not own the memory, so several views can split
+ * one mapping between threads.
+ */
+void csv_mmap_view( csv_mmap *m, const char *data, size_t size )
+{
+    memset( m, 0, sizeof(*m) );
+    m->data = data;
+    m->size = size;
+}
+
+void csv_mmap_close( csv_mmap *m )
+{
+    if ( m->data && m->owns_data ) {
+        munmap( (void *) m->data, m->size );
+    }
+    free( m->fields );
+    free( m->scratch );
+    memset( m, 0, sizeof(*m) );
+}
+
+static int push_field( csv_mmap *m, const char *data, size_t len, int unescaped )
+{
+    csv_field *grown;
+
+    if ( m->num_fields == m->fields_cap ) {
+        size_t cap = m->fields_cap ? m->fields_cap * 2 : 16;
+        grown = realloc( m->fields, cap * sizeof(csv_field) );
+        if ( !grown ) {
+            return -1;
+        }
+        m->fields = grown;
+        m->fields_cap = cap;
+    }
+    m->fields[m->num_fields].data = data;
+    m->fields[m->num_fields].len = len;
+    m->fields[m->num_fields].unescaped = unescaped;
+    m->num_fields++;
+    return 0;
+}
+
+static int reserve_scratch( csv_mmap *m, size_t extra )
+{
+    char *grown;
+    size_t cap;
+
+    if ( m->scratch_len + extra <= m->scratch_cap ) {
+        return 0;
+    }
+    cap = m->scratch_cap ? m->scratch_cap : 256;
+    while ( cap < m->scratch_len + extra ) {
+        cap *= 2;
+    }
+    grown = realloc( m->scratch, cap );
+    if ( !grown ) {
+        return -1;
+    }
+    m->scratch = grown;
+    m->scratch_cap = cap;
+    return 0;
+}
+
+static int is_line_end( const char *ptr, const char *end )
+{
+    return *ptr == '\n' || ( *ptr == '\r' && ( ptr + 1 == end || ptr[1] == '\n' ) );
+}
+
+/*
+ * Slow path: run the same state machine as parse_csv from the start of the
+ * field, writing the unescaped text to the scratch buffer.  Returns a pointer
+ * to the character that ended the field, or NULL if a quote is never closed.
+ */
+static const char *unescape_field( csv_mmap *m, const char *ptr, const char *end, size_t *offset )
+{
+    int fQuote = 0;
+
+    if ( reserve_scratch( m, 0 ) != 0 ) {
+        return NULL;
+    }
+    *offset = m->scratch_len;
+
+    for ( ; ptr < end; ptr++ ) {
+        if ( fQuote ) {
+            if ( *ptr == '\"' ) {
+                if ( ptr + 1 < end && ptr[1] == '\"' ) {
+                    ptr++;
+                } else {
+                    fQuote = 0;
+                    continue;
+                }
+            }
+        } else if ( *ptr == '\"' ) {
+            fQuote = 1;
+            continue;
+        } else if ( *ptr == ',' || is_line_end( ptr, end ) ) {
+            break;
+        }
+
+        if ( reserve_scratch( m, 1 ) != 0 ) {
+            return NULL;
+        }
+        m->scratch[m->scratch_len++] = *ptr;
+    }
+
+    if ( fQuote ) {
+        return NULL;
+    }
+    return ptr;
+}
+
+/*
+ * Reads the next row.  On success the fields are in m->fields[0..n) and n is
+ * returned; 0 means the file is exhausted and CSV_MMAP_ERR_* is returned for
+ * malformed input.  Slices stay valid until the next call.
+ */
+int csv_mmap_next_row( csv_mmap *m )
+{
+    const char *end = m->data + m->size;
+    const char *ptr = m->data + m->pos;
+    const char *start, *quote;
+    size_t i, offset;
+    int any_unescaped = 0;
+
+    m->num_fields = 0;
+    m->scratch_len = 0;
+
+    if ( m->pos >= m->size ) {
+        return 0;
+    }
+
+    for ( ;; ) {
+        start = ptr;
+
+        if ( ptr < end && *ptr == '\"' ) {
+            /* Quoted field: zero copy unless it contains "" or trailing text */
+            quote = memchr( ptr + 1, '\"', (size_t) (end - ptr - 1) );
+            if ( !quote ) {
+                return CSV_MMAP_ERR_QUOTE;
+            }
+            if ( quote + 1 == end || quote[1] == ',' || is_line_end( quote + 1, end ) ) {
+                if ( push_field( m, start + 1, (size_t) (quote - start - 1), 0 ) != 0 ) {
+                    return CSV_MMAP_ERR_NO_MEMORY;
+                }
+                ptr = quote + 1;
+            } else {
+                ptr = unescape_field( m, start, end, &offset );
+                if ( !ptr ) {
+                    return CSV_MMAP_ERR_QUOTE;
+                }
+                /* Scratch may still move, so record the offset for now */
+                if ( push_field( m, (const char *) (uintptr_t) offset, m->scratch_len - offset, 1 ) != 0 ) {
+                    return CSV_MMAP_ERR_NO_MEMORY;
+                }
+                any_unescaped = 1;
+            }
+        } else {
+            /* Skip ordinary characters in bulk, a lone \r is ordinary too */
+            ptr = csv_find_field_end( ptr, end );
+            while ( ptr < end && ( *ptr == '\0' || ( *ptr == '\r' && !is_line_end( ptr, end ) ) ) ) {
+                ptr = csv_find_field_end( ptr + 1, end );
+            }
+            if ( ptr < end && *ptr == '\"' ) {
+                /* A quote opening mid-field, hand the whole field to the slow path */
+                ptr = unescape_field( m, start, end, &offset );
+                if ( !ptr ) {
+                    return CSV_MMAP_ERR_QUOTE;
+                }
+                if ( push_field( m, (const char *) (uintptr_t) offset, m->scratch_len - offset, 1 ) != 0 ) {
+                    return CSV_MMAP_ERR_NO_MEMORY;
+                }
+                any_unescaped = 1;
+            } else if ( push_field( m, start, (size_t) (ptr - start), 0 ) != 0 ) {
+                return CSV_MMAP_ERR_NO_MEMORY;
+            }
+        }
+
+        if ( ptr < end && *ptr == ',' ) {
+            ptr++;
+            continue;
+        }
+        break;
+    }
+
+    /* Skip the line terminator, accepting both \n and \r\n */
+    if ( ptr < end && *ptr == '\r' ) {
+        ptr++;
+    }
+    if ( ptr < end && *ptr == '\n' ) {
+        ptr++;
+    }
+    m->pos = (size_t) (ptr - m->data);
+
+    if ( any_unescaped ) {
+        for ( i = 0; i < m->num_fields; i++ ) {
+            if ( m->fields[i].unescaped ) {
+                m->fields[i].data = m->scratch + (uintptr_t) m->fields[i].data;
+            }
+        }
+    }
+
+    return (int) m->num_fields;
+}
+
+/*
+ * Number of '"' bytes in [data, data + len).  Its parity tells whether a
+ * position is inside quotes, given the parity up to the start of the range.
+ */
+size_t csv_count_quotes( const char *data, size_t len )
+{
+    char tail[64];
+    const char *block;
+    csv_masks masks;
+    size_t i, cnt = 0;
+
+    for ( i = 0; i < len; i += 64 ) {
+        block = data + i;
+        if ( len - i < 64 ) {
+            memset( tail, 0, sizeof(tail) );
+            memcpy( tail, block, len - i );
+            block = tail;
+        }
+        csv_block_masks( block, &masks );
+        cnt += (size_t) __builtin_popcountll( masks.quotes );
+    }
+    return cnt;
+}
+
+/*
+ * Offset of the first row that starts at or after pos, or size if there is
+ * none.  in_quote says whether pos is inside a quoted field, so newlines
+ * embedded in quotes are never mistaken for row ends.
+ */
+size_t csv_find_row_start( const char *data, size_t size, size_t pos, int in_quote )
+{
+    const char *ptr = data + pos;
+    const char *end = data + size;
+
+    if ( pos == 0 || ( !in_quote && data[pos - 1] == '\n' ) ) {
+        return pos;
+    }
+
+    for ( ; ptr < end; ptr++ ) {
+        ptr = csv_find_line_end( ptr, end );
+        if ( ptr == end ) {
+            break;
+        }
+        if ( *ptr == '\"' ) {
+            in_quote = !in_quote;
+        } else if ( *ptr == '\n' && !in_quote ) {
+            return (size_t) (ptr + 1 - data);
+        }
+    }
+    return size;
+}
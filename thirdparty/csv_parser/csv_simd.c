@@ -0,0 +1,238 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include "csv.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CSV_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Structural character scanning for CSV.
+ *
+ * Two kinds of primitives live here:
+ *
+ *   csv_block_masks classifies 64 bytes at once into bitmasks of quotes,
+ *   commas and newlines.  Combined with csv_prefix_xor over the quote mask
+ *   this gives the quoted regions of a block without a byte-at-a-time state
+ *   machine.
+ *
+ *   csv_find_field_end / csv_find_line_end skip over runs of ordinary
+ *   characters and return the next byte the caller has to look at.
+ *
+ * Each has a scalar, SSE2 and AVX2 version.  The best one the CPU supports
+ * is picked on first use, or forced with csv_simd_set_level.
+ */
+
+typedef void (*block_masks_fn)( const char *block, csv_masks *out );
+typedef const char *(*find_any_fn)( const char *ptr, const char *end, const char *set );
+
+static block_masks_fn block_masks_impl;
+static find_any_fn find_any_impl;
+static int simd_level = -1;
+
+/* Sets of characters a scan stops at.  Unused slots repeat a member. */
+static const char field_end_set[5] = { ',', '\"', '\n', '\r', '\0' };
+static const char line_end_set[5] = { '\"', '\n', '\0', '\0', '\0' };
+
+static void block_masks_scalar( const char *block, csv_masks *out )
+{
+    uint64_t quotes = 0, delims = 0, newlines = 0, bit;
+    int i;
+
+    for ( i = 0; i < 64; i++ ) {
+        bit = (uint64_t) 1 << i;
+        switch ( block[i] ) {
+            case '\"':
+                quotes |= bit;
+                break;
+            case ',':
+                delims |= bit;
+                break;
+            case '\n':
+                newlines |= bit;
+                break;
+            default:
+                break;
+        }
+    }
+    out->quotes = quotes;
+    out->delims = delims;
+    out->newlines = newlines;
+}
+
+static const char *find_any_scalar( const char *ptr, const char *end, const char *set )
+{
+    for ( ; ptr < end; ptr++ ) {
+        if ( *ptr == set[0] || *ptr == set[1] || *ptr == set[2] || *ptr == set[3] || *ptr == set[4] ) {
+            return ptr;
+        }
+    }
+    return end;
+}
+
+#ifdef CSV_SIMD_X86
+
+__attribute__((target("sse2")))
+static void block_masks_sse2( const char *block, csv_masks *out )
+{
+    const __m128i quote = _mm_set1_epi8( '\"' );
+    const __m128i comma = _mm_set1_epi8( ',' );
+    const __m128i newline = _mm_set1_epi8( '\n' );
+    uint64_t quotes = 0, delims = 0, newlines = 0;
+    __m128i v;
+    int i;
+
+    for ( i = 0; i < 4; i++ ) {
+        v = _mm_loadu_si128( (const __m128i *) (block + 16 * i) );
+        quotes |= (uint64_t) (uint16_t) _mm_movemask_epi8( _mm_cmpeq_epi8( v, quote ) ) << (16 * i);
+        delims |= (uint64_t) (uint16_t) _mm_movemask_epi8( _mm_cmpeq_epi8( v, comma ) ) << (16 * i);
+        newlines |= (uint64_t) (uint16_t) _mm_movemask_epi8( _mm_cmpeq_epi8( v, newline ) ) << (16 * i);
+    }
+    out->quotes = quotes;
+    out->delims = delims;
+    out->newlines = newlines;
+}
+
+__attribute__((target("sse2")))
+static const char *find_any_sse2( const char *ptr, const char *end, const char *set )
+{
+    const __m128i c0 = _mm_set1_epi8( set[0] );
+    const __m128i c1 = _mm_set1_epi8( set[1] );
+    const __m128i c2 = _mm_set1_epi8( set[2] );
+    const __m128i c3 = _mm_set1_epi8( set[3] );
+    const __m128i c4 = _mm_set1_epi8( set[4] );
+    __m128i v, hits;
+    int mask;
+
+    for ( ; end - ptr >= 16; ptr += 16 ) {
+        v = _mm_loadu_si128( (const __m128i *) ptr );
+        hits = _mm_or_si128(
+            _mm_or_si128( _mm_cmpeq_epi8( v, c0 ), _mm_cmpeq_epi8( v, c1 ) ),
+            _mm_or_si128( _mm_or_si128( _mm_cmpeq_epi8( v, c2 ), _mm_cmpeq_epi8( v, c3 ) ),
+                          _mm_cmpeq_epi8( v, c4 ) ) );
+        mask = _mm_movemask_epi8( hits );
+        if ( mask ) {
+            return ptr + __builtin_ctz( (unsigned) mask );
+        }
+    }
+    return find_any_scalar( ptr, end, set );
+}
+
+__attribute__((target("avx2")))
+static void block_masks_avx2( const char *block, csv_masks *out )
+{
+    const __m256i quote = _mm256_set1_epi8( '\"' );
+    const __m256i comma = _mm256_set1_epi8( ',' );
+    const __m256i newline = _mm256_set1_epi8( '\n' );
+    __m256i lo = _mm256_loadu_si256( (const __m256i *) block );
+    __m256i hi = _mm256_loadu_si256( (const __m256i *) (block + 32) );
+
+    out->quotes = (uint64_t) (uint32_t) _mm256_movemask_epi8( _mm256_cmpeq_epi8( lo, quote ) )
+        | ((uint64_t) (uint32_t) _mm256_movemask_epi8( _mm256_cmpeq_epi8( hi, quote ) ) << 32);
+    out->delims = (uint64_t) (uint32_t) _mm256_movemask_epi8( _mm256_cmpeq_epi8( lo, comma ) )
+        | ((uint64_t) (uint32_t) _mm256_movemask_epi8( _mm256_cmpeq_epi8( hi, comma ) ) << 32);
+    out->newlines = (uint64_t) (uint32_t) _mm256_movemask_epi8( _mm256_cmpeq_epi8( lo, newline ) )
+        | ((uint64_t) (uint32_t) _mm256_movemask_epi8( _mm256_cmpeq_epi8( hi, newline ) ) << 32);
+}
+
+__attribute__((target("avx2")))
+static const char *find_any_avx2( const char *ptr, const char *end, const char *set )
+{
+    const __m256i c0 = _mm256_set1_epi8( set[0] );
+    const __m256i c1 = _mm256_set1_epi8( set[1] );
+    const __m256i c2 = _mm256_set1_epi8( set[2] );
+    const __m256i c3 = _mm256_set1_epi8( set[3] );
+    const __m256i c4 = _mm256_set1_epi8( set[4] );
+    __m256i v, hits;
+    unsigned mask;
+
+    for ( ; end - ptr >= 32; ptr += 32 ) {
+        v = _mm256_loadu_si256( (const __m256i *) ptr );
+        hits = _mm256_or_si256(
+            _mm256_or_si256( _mm256_cmpeq_epi8( v, c0 ), _mm256_cmpeq_epi8( v, c1 ) ),
+            _mm256_or_si256( _mm256_or_si256( _mm256_cmpeq_epi8( v, c2 ), _mm256_cmpeq_epi8( v, c3 ) ),
+                             _mm256_cmpeq_epi8( v, c4 ) ) );
+        mask = (unsigned) _mm256_movemask_epi8( hits );
+        if ( mask ) {
+            return ptr + __builtin_ctz( mask );
+        }
+    }
+    return find_any_sse2( ptr, end, set );
+}
+
+#endif
+
+int csv_simd_set_level( int level )
+{
+#ifdef CSV_SIMD_X86
+    __builtin_cpu_init();
+    if ( level >= CSV_SIMD_AVX2 && __builtin_cpu_supports( "avx2" ) ) {
+        block_masks_impl = block_masks_avx2;
+        find_any_impl = find_any_avx2;
+        simd_level = CSV_SIMD_AVX2;
+        return simd_level;
+    }
+    if ( level >= CSV_SIMD_SSE2 && __builtin_cpu_supports( "sse2" ) ) {
+        block_masks_impl = block_masks_sse2;
+        find_any_impl = find_any_sse2;
+        simd_level = CSV_SIMD_SSE2;
+        return simd_level;
+    }
+#endif
+    block_masks_impl = block_masks_scalar;
+    find_any_impl = find_any_scalar;
+    simd_level = CSV_SIMD_SCALAR;
+    return simd_level;
+}
+
+int csv_simd_level( void )
+{
+    if ( simd_level < 0 ) {
+        csv_simd_set_level( CSV_SIMD_AVX2 );
+    }
+    return simd_level;
+}
+
+void csv_block_masks( const char *block, csv_masks *out )
+{
+    if ( simd_level < 0 ) {
+        csv_simd_set_level( CSV_SIMD_AVX2 );
+    }
+    block_masks_impl( block, out );
+}
+
+/*
+ * Turns a mask of quote positions into a mask of the bytes inside quotes:
+ * every bit is the XOR of itself and all lower bits.  A doubled quote "" flips
+ * the state twice, so escaped quotes need no special casing.
+ */
+uint64_t csv_prefix_xor( uint64_t bits )
+{
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+/* Next ',', '"', '\n', '\r' or NUL in [ptr, end), or end */
+const char *csv_find_field_end( const char *ptr, const char *end )
+{
+    if ( simd_level < 0 ) {
+        csv_simd_set_level( CSV_SIMD_AVX2 );
+    }
+    return find_any_impl( ptr, end, field_end_set );
+}
+
+/* Next '"', '\n' or NUL in [ptr, end), or end */
+const char *csv_find_line_end( const char *ptr, const char *end )
+{
+    if ( simd_level < 0 ) {
+        csv_simd_set_level( CSV_SIMD_AVX2 );
+    }
+    return find_any_impl( ptr, end, line_end_set );
+}
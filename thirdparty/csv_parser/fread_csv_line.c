@@ -3,82 +3,86 @@
 #include <stdio.h>
 #include "csv.h"
 
-#define READ_BLOCK_SIZE 65536
-#define QUICK_GETC( ch, fp )\
+#define QUICK_GETC( ch, r )\
 do\
 {\
-    if ( read_ptr == read_end )\
+    if ( r->read_ptr == r->read_end )\
     {\
-        fread_len = fread( read_buf, sizeof(char), READ_BLOCK_SIZE, fp );\
-        if ( fread_len < READ_BLOCK_SIZE )\
-            read_buf[fread_len] = '\0';\
-        read_ptr = read_buf;\
+        r->fread_len = fread( r->read_buf, sizeof(char), CSV_READ_BLOCK_SIZE, r->fp );\
+        if ( r->fread_len < CSV_READ_BLOCK_SIZE )\
+            r->read_buf[r->fread_len] = '\0';\
+        r->read_ptr = r->read_buf;\
     }\
-    ch = *read_ptr++;\
+    ch = *r->read_ptr++;\
 }\
 while(0)
 
 /*
- * Given a file pointer, read a CSV line from that file.
- * File may include newlines escaped with "double quotes".
- *
- * Warning: This function is optimized for the use case where
- *   you repeatedly call it until the file is exhausted.  It is
- *   very suboptimal for the use case of just grabbing one single
- *   line of CSV and stopping.  Also, this function advances the
- *   file position (in the fseek/ftell sense) unpredictably.  You
- *   should not change the file position between calls to
- *   fread_csv_line (e.g., don't use "getc" on the file in between
- *   calls to fread_csv_line).
- *
- * Other arguments:
- * size_t max_line_size: Maximum line size, in bytes.
- * int *done: Pointer to an int that will be set to 1 when file is exhausted.
- * int *err: Pointer to an int where error code will be written.
+ * Prepare a reader for fp.  All buffering state lives in the reader, so any
+ * number of readers may be used at once, from any number of threads, as long
+ * as each reader is only used by one thread at a time.
  *
- * Warning: Calling this function on an exhausted file (as indicated by the
- *   'done' flag) is undefined behavior.
- *
- * See csv.h for definitions of error codes.
+ * Returns 0 on success, or CSV_ERR_NO_MEMORY.
  */
-char *fread_csv_line(FILE *fp, int max_line_size, int *done, int *err) {
-    static FILE *bookmark;
-    static char read_buf[READ_BLOCK_SIZE], *read_ptr, *read_end;
-    static int fread_len, prev_max_line_size = -1;
-    static char *buf;
+int csv_reader_init(csv_reader *r, FILE *fp, int max_line_size) {
+    memset( r, 0, sizeof(*r) );
+    r->fp = fp;
+    r->max_line_size = max_line_size;
+    /* Room for a quote pair written past the limit check, plus the NUL */
+    r->line_buf = malloc( max_line_size + 2 );
+    if ( !r->line_buf ) {
+        return CSV_ERR_NO_MEMORY;
+    }
+    r->read_ptr = r->read_end = r->read_buf + CSV_READ_BLOCK_SIZE;
+    return 0;
+}
+
+/*
+ * Frees the reader's buffers.  The FILE is left open for the caller.
+ */
+void csv_reader_free(csv_reader *r) {
+    free( r->line_buf );
+    r->line_buf = NULL;
+}
+
+/*
+ * Read the next CSV line from the reader's file into its line buffer.
+ * Same semantics as fread_csv_line, except the returned line is owned by the
+ * reader and is only valid until the next call.
+ */
+char *csv_reader_next_line(csv_reader *r, int *done, int *err) {
     char *bptr, *limit;
+    const char *run;
     char ch;
     int fQuote;
 
-    if ( max_line_size > prev_max_line_size ) {
-        if ( prev_max_line_size != -1 ) {
-            free( buf );
-        }
-        buf = malloc( max_line_size + 1 );
-        if ( !buf ) {
-            *err = CSV_ERR_NO_MEMORY;
-            prev_max_line_size = -1;
-            return NULL;
-        }
-        prev_max_line_size = max_line_size;
-    }
-    bptr = buf;
-    limit = buf + max_line_size;
-
-    if ( bookmark != fp ) {
-        read_ptr = read_end = read_buf + READ_BLOCK_SIZE;
-        bookmark = fp;
+    if ( !r->line_buf ) {
+        *err = CSV_ERR_NO_MEMORY;
+        return NULL;
     }
+    bptr = r->line_buf;
+    limit = r->line_buf + r->max_line_size;
 
     for ( fQuote = 0; ; ) {
-        QUICK_GETC(ch, fp);
+        /* Copy the buffered run up to the next quote, newline or NUL in bulk */
+        if ( r->read_ptr < r->read_end ) {
+            run = csv_find_line_end( r->read_ptr, r->read_end );
+            if ( run - r->read_ptr > limit - bptr ) {
+                *err = CSV_ERR_LONGLINE;
+                return NULL;
+            }
+            memcpy( bptr, r->read_ptr, (size_t) (run - r->read_ptr) );
+            bptr += run - r->read_ptr;
+            r->read_ptr = (char *) run;
+        }
+
+        QUICK_GETC(ch, r);
 
         if ( !ch || (ch == '\n' && !fQuote)) {
             break;
         }
 
         if ( bptr >= limit ) {
-            free( buf );
             *err = CSV_ERR_LONGLINE;
             return NULL;
         }
@@ -86,7 +90,7 @@ char *fread_csv_line(FILE *fp, int max_line_size, int *done, int *err) {
 
         if ( fQuote ) {
             if ( ch == '\"' ) {
-                QUICK_GETC(ch, fp);
+                QUICK_GETC(ch, r);
 
                 if ( ch != '\"' ) {
                     if ( !ch || ch == '\n' ) {
@@ -102,9 +106,69 @@ char *fread_csv_line(FILE *fp, int max_line_size, int *done, int *err) {
     }
 
     *done = !ch;
-    if (*done > 0) {
-      bookmark = NULL;
-    }
     *bptr = '\0';
-    return strdup(buf);
+    return r->line_buf;
+}
+
+/*
+ * Given a file pointer, read a CSV line from that file.
+ * File may include newlines escaped with "double quotes".
+ *
+ * Warning: This function is optimized for the use case where
+ *   you repeatedly call it until the file is exhausted.  It is
+ *   very suboptimal for the use case of just grabbing one single
+ *   line of CSV and stopping.  Also, this function advances the
+ *   file position (in the fseek/ftell sense) unpredictably.  You
+ *   should not change the file position between calls to
+ *   fread_csv_line (e.g., don't use "getc" on the file in between
+ *   calls to fread_csv_line).
+ *
+ * This is a wrapper around a single shared csv_reader, so it cannot be
+ * interleaved across files or threads.  Use csv_reader_init and
+ * csv_reader_next_line for that.
+ *
+ * Other arguments:
+ * size_t max_line_size: Maximum line size, in bytes.
+ * int *done: Pointer to an int that will be set to 1 when file is exhausted.
+ * int *err: Pointer to an int where error code will be written.
+ *
+ * Warning: Calling this function on an exhausted file (as indicated by the
+ *   'done' flag) is undefined behavior.
+ *
+ * See csv.h for definitions of error codes.
+ */
+char *fread_csv_line(FILE *fp, int max_line_size, int *done, int *err) {
+    static csv_reader reader;
+    static int reader_ready;
+    char *line;
+
+    if ( !reader_ready || reader.fp != fp ) {
+        if ( reader_ready ) {
+            csv_reader_free( &reader );
+        }
+        if ( csv_reader_init( &reader, fp, max_line_size ) != 0 ) {
+            *err = CSV_ERR_NO_MEMORY;
+            reader_ready = 0;
+            return NULL;
+        }
+        reader_ready = 1;
+    } else if ( max_line_size > reader.max_line_size ) {
+        /* Same file: grow the line buffer but keep the bytes already read */
+        char *grown = realloc( reader.line_buf, max_line_size + 2 );
+        if ( !grown ) {
+            *err = CSV_ERR_NO_MEMORY;
+            return NULL;
+        }
+        reader.line_buf = grown;
+        reader.max_line_size = max_line_size;
+    }
+
+    line = csv_reader_next_line( &reader, done, err );
+    if ( !line ) {
+        return NULL;
+    }
+    if ( *done > 0 ) {
+        reader.fp = NULL;
+    }
+    return strdup( line );
 }
@@ -1,10 +1,15 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "../csv.h"
 
 int test_parse_csv(void);
 int test_split_on_unescaped_newlines(void);
 int test_fread_csv_line(void);
+int test_csv_mmap(void);
+int test_csv_reader_interleaved(void);
+int test_csv_simd_levels(void);
+int test_csv_find_row_start(void);
 
 void run_test(const char *name, int test(void)) {
   int result;
@@ -23,6 +28,14 @@ int main(void) {
   run_test("test_split_on_unescaped_newlines", test_split_on_unescaped_newlines);
 
   run_test("test_fread_csv_line", test_fread_csv_line);
+
+  run_test("test_csv_mmap", test_csv_mmap);
+
+  run_test("test_csv_reader_interleaved", test_csv_reader_interleaved);
+
+  run_test("test_csv_simd_levels", test_csv_simd_levels);
+
+  run_test("test_csv_find_row_start", test_csv_find_row_start);
 }
 
 int test_parse_csv(void)
@@ -115,4 +128,141 @@ int test_fread_csv_line(void) {
     return 0;
   }
   return 1;
-}
\ No newline at end of file
+}
+static int field_is( const csv_field *field, const char *expected ) {
+  return field->len == strlen(expected) && !memcmp(field->data, expected, field->len);
+}
+
+int test_csv_mmap(void) {
+  csv_mmap m;
+  const char *expected[] = {
+    "bar", "bar", "b\"ar", "b\na\nr", "\n\nb\n\n\"a\"\n\nr\n\n", "baz", "baz", "\"baz\"", "bar"
+  };
+  int i;
+
+  if ( csv_mmap_open(&m, "tests/test.csv") ) {
+    return 0;
+  }
+
+  for ( i = 0; i < 9; i++ ) {
+    if ( csv_mmap_next_row(&m) != 3 || !field_is(&m.fields[0], "foo") ) {
+      csv_mmap_close(&m);
+      return 0;
+    }
+    /* The interesting field is the second one, except on rows 6-8 */
+    if ( !field_is(&m.fields[(i >= 5 && i <= 7) ? 2 : 1], expected[i]) ) {
+      csv_mmap_close(&m);
+      return 0;
+    }
+  }
+  if ( csv_mmap_next_row(&m) != 0 ) {
+    csv_mmap_close(&m);
+    return 0;
+  }
+
+  csv_mmap_close(&m);
+  return 1;
+}
+
+/* Two readers on the same file must not disturb each other */
+int test_csv_reader_interleaved(void) {
+  csv_reader a, b;
+  int err = 0, done_a = 0, done_b = 0, lines = 0;
+  FILE *fp_a = fopen("tests/test.csv", "r");
+  FILE *fp_b = fopen("tests/test.csv", "r");
+  char *line_a, *line_b;
+  int ok = 1;
+
+  if ( !fp_a || !fp_b || csv_reader_init(&a, fp_a, 1024) || csv_reader_init(&b, fp_b, 1024) ) {
+    return 0;
+  }
+
+  while ( !done_a && !done_b ) {
+    line_a = csv_reader_next_line(&a, &done_a, &err);
+    line_b = csv_reader_next_line(&b, &done_b, &err);
+    if ( !line_a || !line_b || strcmp(line_a, line_b) || done_a != done_b ) {
+      ok = 0;
+      break;
+    }
+    lines++;
+  }
+
+  csv_reader_free(&a);
+  csv_reader_free(&b);
+  fclose(fp_a);
+  fclose(fp_b);
+  return ok && lines == 10;
+}
+
+/* Every SIMD level must agree with the scalar scanner */
+int test_csv_simd_levels(void) {
+  const char alphabet[] = "ab,\"\n\r";
+  char buf[256];
+  csv_masks expected_masks, masks;
+  const char *expected_field, *expected_line;
+  char **parsed;
+  int i, j, level, ok = 1;
+  /* A quoted field straddling the first 64-byte block boundary */
+  const char *line =
+    "0123456789,0123456789,0123456789,0123456789,0123456789,\"abc,def\"\"ghi,jkl\",tail";
+
+  srand(42);
+  for ( i = 0; i < (int) sizeof(buf); i++ ) {
+    buf[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+  }
+
+  for ( level = CSV_SIMD_SSE2; level <= CSV_SIMD_AVX2; level++ ) {
+    for ( i = 0; i + 64 <= (int) sizeof(buf); i += 7 ) {
+      csv_simd_set_level(CSV_SIMD_SCALAR);
+      csv_block_masks(buf + i, &expected_masks);
+      expected_field = csv_find_field_end(buf + i, buf + sizeof(buf));
+      expected_line = csv_find_line_end(buf + i, buf + sizeof(buf));
+
+      csv_simd_set_level(level);
+      csv_block_masks(buf + i, &masks);
+      if ( memcmp(&masks, &expected_masks, sizeof(masks))
+      ||   csv_find_field_end(buf + i, buf + sizeof(buf)) != expected_field
+      ||   csv_find_line_end(buf + i, buf + sizeof(buf)) != expected_line ) {
+        ok = 0;
+      }
+    }
+
+    parsed = parse_csv(line);
+    if ( !parsed ) {
+      ok = 0;
+      continue;
+    }
+    for ( j = 0; parsed[j]; j++ )
+      ;
+    if ( j != 7 || strcmp(parsed[5], "abc,def\"ghi,jkl") || strcmp(parsed[6], "tail") ) {
+      ok = 0;
+    }
+    free_csv_line(parsed);
+  }
+
+  csv_simd_set_level(CSV_SIMD_AVX2);
+  return ok;
+}
+
+/* Splitting a file anywhere must land on a real row boundary */
+int test_csv_find_row_start(void) {
+  csv_mmap m;
+  size_t split, start, quotes;
+  int ok = 1;
+
+  if ( csv_mmap_open(&m, "tests/test.csv") ) {
+    return 0;
+  }
+
+  for ( split = 0; split <= m.size; split++ ) {
+    quotes = csv_count_quotes(m.data, split);
+    start = csv_find_row_start(m.data, m.size, split, (int) (quotes & 1));
+    /* Every row of test.csv starts with "foo" */
+    if ( start < split || ( start < m.size && strncmp(m.data + start, "foo", 3) ) ) {
+      ok = 0;
+    }
+  }
+
+  csv_mmap_close(&m);
+  return ok;
+}